@@ -0,0 +1,97 @@
+#ifndef BINARYLOG_H_
+#define BINARYLOG_H_
+
+#include <cstdint>
+
+// Layout of the files the Binary sink writes and logdecode reads
+// A file is a run of segments of about FileOptions::segment_size, each one
+// Segment | Sync | records ... | Index | Dictionary | Trailer
+// and every record, those included, starts with a BinaryRecord, so a file
+// can be walked from the front even when a crash cut the last segment short
+// Records carry the call site, type or format id, raw TscClock ticks and
+// the payload bytes, the LogDictEntry saying what an id stands for is
+// written in front of the first record of a segment using it and again in
+// the segment's Dictionary, so every segment decodes on its own
+// A Sync record every binary_sync_interval records gives the tick rate to
+// convert the ticks after it, the Index lists them all with a time to seek
+// to and the Trailer at the very end of the segment says where the Index and
+// the Dictionary are and what time range the segment covers
+
+inline constexpr std::uint64_t binary_segment_magic = 0x4c4f475345474d31ULL;
+inline constexpr std::uint64_t binary_trailer_magic = 0x4c4f47454e444931ULL;
+inline constexpr std::uint32_t binary_version = 1;
+inline constexpr std::uint32_t binary_sync_interval = 256;
+
+enum class BinaryRecordKind : std::uint16_t {
+    // BinarySegmentInfo
+    Segment = 1,
+    // BinarySync, tsc is the tick it was taken at
+    Sync = 2,
+    // One LogDictEntry and its text
+    DictEntry = 3,
+    // Bytes of a PlainBytes registered type, type is its id
+    Object = 4,
+    // Packed LogFmt arguments, format is the id of the Format entry
+    Format = 5,
+    // Rendered on the backend, types that can not be copied as bytes and
+    // arguments without a FormatArgType
+    Text = 6,
+    // BinaryIndexEntry for every Sync of the segment
+    Index = 7,
+    // Every LogDictEntry of the segment back to back
+    Dictionary = 8,
+    // BinaryTrailer, last record of a segment
+    Trailer = 9,
+};
+
+// Followed by payload_size bytes, nothing is padded or aligned
+struct BinaryRecord {
+    std::uint32_t payload_size;
+    BinaryRecordKind kind;
+    std::uint16_t type;
+    std::uint32_t call_site;
+    std::uint32_t format;
+    std::uint64_t tsc;
+};
+static_assert(sizeof(BinaryRecord) == 24);
+
+struct BinarySegmentInfo {
+    std::uint64_t magic;
+    std::uint32_t version;
+    std::int32_t pid;
+    // Counts across the files of one Logger
+    std::uint64_t sequence;
+    std::uint32_t type_count;
+    std::uint32_t reserved;
+};
+
+// tsc converts to anchor_ns + (tsc - Sync tsc) * nanos_per_tick
+struct BinarySync {
+    std::int64_t anchor_ns;
+    double nanos_per_tick;
+};
+
+// Records are not strictly in time order since the backend takes them from
+// several producer queues, so time_ns is the latest time of any record
+// before the Sync at offset, a reader looking for times after time_ns can
+// start there
+struct BinaryIndexEntry {
+    std::int64_t time_ns;
+    // In the file
+    std::uint64_t offset;
+};
+
+struct BinaryTrailer {
+    // In the file, of the Segment, Index and Dictionary records
+    std::uint64_t segment_offset;
+    std::uint64_t index_offset;
+    std::uint64_t dictionary_offset;
+    // Object, Format and Text records and the earliest and latest of their
+    // times
+    std::uint64_t messages;
+    std::int64_t first_ns;
+    std::int64_t last_ns;
+    std::uint64_t magic;
+};
+
+#endif /* BINARYLOG_H_ */
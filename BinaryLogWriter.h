@@ -0,0 +1,264 @@
+#ifndef BINARYLOGWRITER_H_
+#define BINARYLOGWRITER_H_
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "BinaryLog.h"
+#include "CallSite.h"
+#include "FileWrapper.h"
+#include "LogBuffer.h"
+#include "LogDictionary.h"
+#include "LogFormat.h"
+#include "TscClock.h"
+
+// Backend side of SinkType::Binary, one per Logger, appends records to the
+// Logger's FileWrapper in the layout of BinaryLog.h
+// Objects and LogFmt arguments go out as the bytes the producer left in the
+// queue entry, only what has no byte form is printed to text
+// Types is the RegisteredLoggerTypes the records' type ids refer to
+template <typename Types>
+class BinaryLogWriter {
+   public:
+    BinaryLogWriter(FileWrapper& file_,
+                    const std::size_t segment_size_) noexcept
+        : file(file_), segment_size(segment_size_) {}
+    BinaryLogWriter() = delete;
+    BinaryLogWriter(const BinaryLogWriter&) = delete;
+    BinaryLogWriter(const BinaryLogWriter&&) = delete;
+    BinaryLogWriter operator=(const BinaryLogWriter&) = delete;
+    BinaryLogWriter operator=(const BinaryLogWriter&&) = delete;
+    // Before the FileWrapper closes the file
+    ~BinaryLogWriter() noexcept { FinishSegment(); }
+
+    inline void WriteObject(const CallSiteId call_site, const LoggerTypeId type,
+                            const void* object,
+                            const std::uint64_t tsc) noexcept {
+        if (!Types::plain_bytes[type]) {
+            text.Clear();
+            Types::Print(type, object, text);
+            WriteText(call_site.value, text.View(), tsc);
+            return;
+        }
+        BeginMessage(call_site.value, tsc);
+        if (type_segments[type] != segment) {
+            const std::uint64_t fields[4] = {Types::sizes[type], 0, 0, 0};
+            AddDictEntry(LogDictKind::Type, type, fields, Types::names[type]);
+            type_segments[type] = segment;
+        }
+        Write(BinaryRecordKind::Object, type, call_site.value, 0, tsc, object,
+              Types::sizes[type]);
+        EndMessage(tsc);
+    }
+
+    inline void WriteFormat(const CallSiteId call_site,
+                            const FormatDescriptor& format,
+                            const unsigned char* args,
+                            const std::uint64_t tsc) noexcept {
+        if (!format.arg_types) {
+            text.Clear();
+            format.render(args, text);
+            WriteText(call_site.value, text.View(), tsc);
+            return;
+        }
+        BeginMessage(call_site.value, tsc);
+        const auto id = FormatId(format);
+        Write(BinaryRecordKind::Format, 0, call_site.value, id, tsc, args,
+              format.args_size);
+        EndMessage(tsc);
+    }
+
+    // call_site can be no_call_site
+    inline void WriteText(const std::uint32_t call_site, std::string_view text_,
+                          const std::uint64_t tsc) noexcept {
+        BeginMessage(call_site, tsc);
+        Write(BinaryRecordKind::Text, 0, call_site, 0, tsc, text_.data(),
+              text_.size());
+        EndMessage(tsc);
+    }
+
+    // Closes the segment with its Index, Dictionary and Trailer, the next
+    // message starts a new one
+    inline void FinishSegment() noexcept {
+        if (!open) {
+            return;
+        }
+        const auto index_offset = file.Position();
+        Write(BinaryRecordKind::Index, 0, no_call_site, 0, 0, index.data(),
+              index.size() * sizeof(BinaryIndexEntry));
+        const auto dictionary_offset = file.Position();
+        Write(BinaryRecordKind::Dictionary, 0, no_call_site, 0, 0,
+              dictionary.data(), dictionary.size());
+        const BinaryTrailer trailer{
+            segment_offset,
+            index_offset,
+            dictionary_offset,
+            messages,
+            messages ? TscClock::ToEpochNanos(first_tsc) : 0,
+            messages ? TscClock::ToEpochNanos(last_tsc) : 0,
+            binary_trailer_magic};
+        Write(BinaryRecordKind::Trailer, 0, no_call_site, 0, 0, &trailer,
+              sizeof(trailer));
+        open = false;
+        // Segments never straddle two files
+        if (file.StoredSize() + 2 * segment_size > FileWrapper::max_size) {
+            file.Rotate();
+        }
+    }
+
+   private:
+    struct FormatState {
+        std::uint32_t id;
+        std::uint32_t segment;
+    };
+
+    inline void BeginMessage(const std::uint32_t call_site,
+                             const std::uint64_t tsc) noexcept {
+        if (!open) {
+            StartSegment();
+        }
+        if (since_sync == binary_sync_interval) {
+            Sync(tsc);
+        }
+        if (call_site == no_call_site) {
+            return;
+        }
+        if (call_site >= call_site_segments.size()) {
+            call_site_segments.resize(call_site + 1);
+        }
+        if (call_site_segments[call_site] != segment) {
+            const auto& site = CallSiteRegistry::Get({call_site});
+            std::uint64_t fields[4];
+            CallSiteDictFields(site, fields);
+            AddDictEntry(LogDictKind::CallSite, call_site, fields,
+                         site.location.file_name(),
+                         site.location.function_name());
+            call_site_segments[call_site] = segment;
+        }
+    }
+
+    inline void EndMessage(const std::uint64_t tsc) noexcept {
+        messages++;
+        since_sync++;
+        first_tsc = std::min(first_tsc, tsc);
+        last_tsc = std::max(last_tsc, tsc);
+        if (file.Position() - segment_offset >= segment_size) {
+            FinishSegment();
+        }
+    }
+
+    inline void StartSegment() noexcept {
+        open = true;
+        segment++;
+        segment_offset = file.Position();
+        messages = 0;
+        first_tsc = std::numeric_limits<std::uint64_t>::max();
+        last_tsc = 0;
+        index.clear();
+        dictionary.clear();
+        const BinarySegmentInfo info{binary_segment_magic,
+                                     binary_version,
+                                     getpid(),
+                                     segment - 1,
+                                     static_cast<std::uint32_t>(Types::size),
+                                     0};
+        Write(BinaryRecordKind::Segment, 0, no_call_site, 0, 0, &info,
+              sizeof(info));
+        since_sync = binary_sync_interval;
+    }
+
+    inline void Sync(const std::uint64_t tsc) noexcept {
+        index.push_back({messages ? TscClock::ToEpochNanos(last_tsc)
+                                  : std::numeric_limits<std::int64_t>::min(),
+                         file.Position()});
+        const BinarySync sync{TscClock::ToEpochNanos(tsc),
+                              TscClock::CurrentNanosPerTick()};
+        Write(BinaryRecordKind::Sync, 0, no_call_site, 0, tsc, &sync,
+              sizeof(sync));
+        since_sync = 0;
+    }
+
+    // Ids stay the same for the life of the writer, the entry is written
+    // again in every segment
+    inline std::uint32_t FormatId(const FormatDescriptor& format) noexcept {
+        if (&format != last_format) {
+            last_format = &format;
+            last_format_state =
+                &formats
+                     .try_emplace(&format,
+                                  FormatState{static_cast<std::uint32_t>(
+                                                  formats.size()),
+                                              0})
+                     .first->second;
+        }
+        auto& state = *last_format_state;
+        if (state.segment != segment) {
+            const std::uint64_t fields[4] = {format.arg_count, 0, 0, 0};
+            AddDictEntry(
+                LogDictKind::Format, state.id, fields,
+                {reinterpret_cast<const char*>(format.arg_types),
+                 format.arg_count},
+                format.format);
+            state.segment = segment;
+        }
+        return state.id;
+    }
+
+    // Inline as a DictEntry record and kept for the segment's Dictionary
+    inline void AddDictEntry(const LogDictKind kind, const std::uint32_t id,
+                             const std::uint64_t (&fields)[4],
+                             std::string_view text_1,
+                             std::string_view text_2 = {}) noexcept {
+        const auto offset = dictionary.size();
+        const auto size = LogDictEntrySize(text_1.size() + text_2.size());
+        dictionary.resize(offset + size);
+        WriteLogDictEntry(dictionary.data() + offset, kind, id, fields, text_1,
+                          text_2);
+        Write(BinaryRecordKind::DictEntry, 0, no_call_site, 0, 0,
+              dictionary.data() + offset, size);
+    }
+
+    inline void Write(const BinaryRecordKind kind, const std::uint16_t type,
+                      const std::uint32_t call_site, const std::uint32_t format,
+                      const std::uint64_t tsc, const void* payload,
+                      const std::size_t size) noexcept {
+        const BinaryRecord record{static_cast<std::uint32_t>(size),
+                                  kind,
+                                  type,
+                                  call_site,
+                                  format,
+                                  tsc};
+        file.BeginMessage();
+        file.Append(reinterpret_cast<const char*>(&record), sizeof(record));
+        file.Append(static_cast<const char*>(payload), size);
+    }
+
+    FileWrapper& file;
+    const std::size_t segment_size;
+    bool open{};
+    // Starts at 1, so 0 in the tables below is no segment
+    std::uint32_t segment{};
+    unsigned long segment_offset{};
+    std::uint64_t messages{};
+    std::uint32_t since_sync{};
+    std::uint64_t first_tsc{};
+    std::uint64_t last_tsc{};
+    std::vector<BinaryIndexEntry> index;
+    std::vector<unsigned char> dictionary;
+    // Segment each id was last written in
+    std::vector<std::uint32_t> call_site_segments;
+    std::uint32_t type_segments[Types::size]{};
+    std::unordered_map<const FormatDescriptor*, FormatState> formats;
+    const FormatDescriptor* last_format{};
+    FormatState* last_format_state{};
+    LogBuffer text;
+};
+
+#endif /* BINARYLOGWRITER_H_ */
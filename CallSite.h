@@ -0,0 +1,164 @@
+#ifndef CALLSITE_H_
+#define CALLSITE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <source_location>
+
+#include "LogLevel.h"
+#include "SpinLock.h"
+
+// Index into the CallSiteRegistry, all a queue entry carries about where it
+// was logged from and how
+struct CallSiteId {
+    std::uint32_t value;
+};
+
+// Call site that also carries its level in the type, so the Log overloads
+// taking it can filter at compile time
+template <LogLevel level_>
+struct LevelCallSiteId {
+    static constexpr LogLevel level = level_;
+    CallSiteId id;
+};
+
+struct CallSite {
+    std::source_location location;
+    bool log_time;
+    bool log_location;
+    bool new_line;
+    LogLevel level;
+};
+
+// Process wide table of call sites, written once per call site and read by
+// the backend to render the location prefix
+// Intern is lock free, a call site that is already known costs a hash and a
+// probe or two
+class CallSiteRegistry {
+   public:
+    static constexpr std::size_t capacity = 1 << 14;
+
+    static inline CallSiteId Intern(
+        const std::source_location& location, const bool log_time,
+        const bool log_location, const bool new_line,
+        const LogLevel level = LogLevel::Off) noexcept {
+        const CallSite site{location, log_time, log_location, new_line, level};
+        auto index = Hash(site) & (table_size - 1);
+        while (true) {
+            auto state = table[index].load(std::memory_order_acquire);
+            if (state == empty &&
+                table[index].compare_exchange_strong(
+                    state, busy, std::memory_order_acquire)) {
+                const auto id = next_id.fetch_add(1, std::memory_order_relaxed);
+                if (id >= capacity) {
+                    fprintf(stderr, "Logger: more than %zu call sites\n",
+                            capacity);
+                    std::abort();
+                }
+                sites[id] = site;
+                table[index].store(id + first_id, std::memory_order_release);
+                return {id};
+            }
+            while (state == busy) {
+                CpuRelax();
+                state = table[index].load(std::memory_order_acquire);
+            }
+            if (Equal(sites[state - first_id], site)) {
+                return {state - first_id};
+            }
+            index = (index + 1) & (table_size - 1);
+        }
+    }
+
+    // Intern behind a small per thread cache, for call sites whose flags are
+    // only known at run time, a hit is a few compares and no atomics
+    static inline CallSiteId InternCached(
+        const std::source_location& location, const bool log_time,
+        const bool log_location, const bool new_line,
+        const LogLevel level = LogLevel::Off) noexcept {
+        struct Cached {
+            CallSite site;
+            CallSiteId id;
+            // A zeroed entry would match a default location with no flags
+            bool valid;
+        };
+        thread_local Cached cache[cache_size]{};
+        const CallSite site{location, log_time, log_location, new_line, level};
+        auto& cached =
+            cache[(location.line() * 31 + location.column() +
+                   (log_time | log_location << 1 | new_line << 2)) &
+                  (cache_size - 1)];
+        if (!cached.valid || !Equal(cached.site, site)) {
+            cached.id = Intern(location, log_time, log_location, new_line,
+                               level);
+            cached.site = site;
+            cached.valid = true;
+        }
+        return cached.id;
+    }
+
+    static inline const CallSite& Get(const CallSiteId id) noexcept {
+        return sites[id.value];
+    }
+
+   private:
+    static constexpr std::size_t table_size = capacity * 2;
+    static constexpr std::uint32_t empty = 0;
+    static constexpr std::uint32_t busy = 1;
+    static constexpr std::uint32_t first_id = 2;
+    static constexpr std::size_t cache_size = 64;
+
+    static inline std::uint64_t Hash(const CallSite& site) noexcept {
+        std::uint64_t hash =
+            reinterpret_cast<std::uintptr_t>(site.location.file_name());
+        hash = hash * 0x9E3779B97F4A7C15 + site.location.line();
+        hash = hash * 0x9E3779B97F4A7C15 + site.location.column();
+        hash = hash * 0x9E3779B97F4A7C15 +
+               (site.log_time | site.log_location << 1 | site.new_line << 2 |
+                static_cast<unsigned>(site.level) << 3);
+        return hash ^ (hash >> 29);
+    }
+
+    // String literals from one call site always have the same address
+    static inline bool Equal(const CallSite& a, const CallSite& b) noexcept {
+        return a.location.line() == b.location.line() &&
+               a.location.column() == b.location.column() &&
+               a.location.file_name() == b.location.file_name() &&
+               a.location.function_name() == b.location.function_name() &&
+               a.log_time == b.log_time && a.log_location == b.log_location &&
+               a.new_line == b.new_line && a.level == b.level;
+    }
+
+    static inline std::atomic<std::uint32_t> table[table_size]{};
+    static inline CallSite sites[capacity]{};
+    static inline std::atomic<std::uint32_t> next_id{};
+};
+
+// Interns the call site the first time the line runs, after that it is a
+// static load, the flags have to be constants
+// Logger::Log(&logger, LOGGER_CALLSITE(true, true, true), data);
+#define LOGGER_CALLSITE(log_time, log_location, new_line)              \
+    ([](const std::source_location& location_) noexcept {              \
+        static const CallSiteId id = CallSiteRegistry::Intern(         \
+            location_, log_time, log_location, new_line);              \
+        return id;                                                     \
+    }(std::source_location::current()))
+
+// Same with a level, compiles down to nothing when the level is below
+// LOGGER_COMPILE_MIN_LEVEL
+// Logger::LogEmplace<LoggerType1>(
+//     &logger, LOGGER_LEVEL_CALLSITE(LogLevel::Debug, true, false, true), 1);
+#define LOGGER_LEVEL_CALLSITE(level, log_time, log_location, new_line)   \
+    ([](const std::source_location& location_) noexcept {                \
+        if constexpr (!level_compiled_in<level>) {                       \
+            return LevelCallSiteId<level>{};                             \
+        } else {                                                         \
+            static const CallSiteId id = CallSiteRegistry::Intern(       \
+                location_, log_time, log_location, new_line, level);     \
+            return LevelCallSiteId<level>{id};                           \
+        }                                                                \
+    }(std::source_location::current()))
+
+#endif /* CALLSITE_H_ */
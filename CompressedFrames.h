@@ -0,0 +1,345 @@
+#ifndef COMPRESSEDFRAMES_H_
+#define COMPRESSEDFRAMES_H_
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "LzCodec.h"
+
+// A compressed file is a run of frames, a FrameHeader and one flushed write
+// buffer compressed on its own, so a reader can start at any frame and find
+// the frame holding an offset of the uncompressed stream from the headers
+// alone, and a file cut short by a crash loses only its last frame
+
+enum class Compression : std::uint16_t {
+    None = 0,
+    // LzCodec
+    Lz = 1,
+};
+
+inline constexpr std::uint32_t frame_magic = 0x315a474c;
+
+struct FrameHeader {
+    std::uint32_t magic;
+    // Bytes after the header
+    std::uint32_t stored_size;
+    // Bytes once decompressed
+    std::uint32_t size;
+    // None when compressing did not make the frame smaller
+    Compression codec;
+    std::uint16_t reserved;
+    // Where the frame starts in the uncompressed stream of the file
+    std::uint64_t offset;
+};
+static_assert(sizeof(FrameHeader) == 24);
+
+// Compresses buffers into frames and writes them to the file, either on the
+// calling thread or on a helper thread of its own so the backend only hands
+// a filled buffer over and goes back to the queues
+class FrameWriter {
+   public:
+    // Buffers that can be handed over at the same time
+    static constexpr std::size_t max_slots = 4;
+
+    FrameWriter(const Compression codec_, const std::size_t buffer_size,
+                const bool threaded) noexcept
+        : codec(codec_),
+          frame(static_cast<unsigned char*>(std::malloc(
+              sizeof(FrameHeader) + LzCodec::CompressBound(buffer_size)))),
+          table(std::make_unique<std::uint32_t[]>(LzCodec::table_size)) {
+        if (!frame) {
+            perror("Logger frame buffer");
+            std::abort();
+        }
+        if (threaded) {
+            thread = std::thread([this] { Run(); });
+        }
+    }
+    FrameWriter() = delete;
+    FrameWriter(const FrameWriter&) = delete;
+    FrameWriter(const FrameWriter&&) = delete;
+    FrameWriter operator=(const FrameWriter&) = delete;
+    FrameWriter operator=(const FrameWriter&&) = delete;
+    ~FrameWriter() noexcept {
+        if (thread.joinable()) {
+            WaitAll();
+            // A job without data stops the thread
+            Submit({nullptr, 0, 0, 0});
+            thread.join();
+        }
+        std::free(frame);
+    }
+
+    inline bool Threaded() const noexcept { return thread.joinable(); }
+
+    // Frames from now on go to fd, only once nothing is in flight
+    inline void SetFile(const int fd_) noexcept {
+        fd = fd_;
+        failed = false;
+        stored.store(0, std::memory_order_relaxed);
+        lost.store(0, std::memory_order_relaxed);
+    }
+
+    // offset is where data starts in the uncompressed stream
+    // With the helper thread data has to stay as it is until slot is no
+    // longer busy, slot is the caller's index for the buffer
+    inline void Write(const char* data, const std::size_t length,
+                      const std::uint64_t offset,
+                      const std::size_t slot) noexcept {
+        const Job job{reinterpret_cast<const unsigned char*>(data), length,
+                      offset, slot};
+        if (!Threaded()) {
+            WriteFrame(job);
+            return;
+        }
+        busy[slot].store(true, std::memory_order_relaxed);
+        pending.fetch_add(length, std::memory_order_relaxed);
+        Submit(job);
+    }
+
+    inline void WaitSlot(const std::size_t slot) noexcept {
+        while (busy[slot].load(std::memory_order_acquire)) {
+            busy[slot].wait(true, std::memory_order_acquire);
+        }
+    }
+
+    inline void WaitAll() noexcept {
+        for (std::size_t slot = 0; slot < max_slots; slot++) {
+            WaitSlot(slot);
+        }
+    }
+
+    // Bytes in the current file, what the helper thread has not written
+    // yet counts uncompressed, frames dropped after a failed write count as
+    // if written so the file still rotates
+    inline unsigned long StoredSize() const noexcept {
+        return stored.load(std::memory_order_relaxed) +
+               lost.load(std::memory_order_relaxed) +
+               pending.load(std::memory_order_relaxed);
+    }
+
+   private:
+    struct Job {
+        const unsigned char* data;
+        std::size_t length;
+        std::uint64_t offset;
+        std::size_t slot;
+    };
+
+    inline void Submit(const Job& job) noexcept {
+        const auto index = tail.load(std::memory_order_relaxed);
+        jobs[index % max_slots] = job;
+        tail.store(index + 1, std::memory_order_release);
+        tail.notify_one();
+    }
+
+    // Helper thread, jobs in the order they were handed over
+    inline void Run() noexcept {
+        std::uint64_t head = 0;
+        while (true) {
+            const auto available = tail.load(std::memory_order_acquire);
+            if (head == available) {
+                tail.wait(available, std::memory_order_acquire);
+                continue;
+            }
+            const auto job = jobs[head++ % max_slots];
+            if (!job.data) {
+                return;
+            }
+            WriteFrame(job);
+            pending.fetch_sub(job.length, std::memory_order_relaxed);
+            busy[job.slot].store(false, std::memory_order_release);
+            busy[job.slot].notify_one();
+        }
+    }
+
+    // Kept as it is when compressing does not make it smaller
+    // After a failed write the rest of the file's frames are dropped, a hole
+    // in the stream would end the file for readers anyway
+    inline void WriteFrame(const Job& job) noexcept {
+        if (failed) {
+            lost.store(lost.load(std::memory_order_relaxed) + job.length,
+                       std::memory_order_relaxed);
+            return;
+        }
+        FrameHeader header{frame_magic,
+                           static_cast<std::uint32_t>(job.length),
+                           static_cast<std::uint32_t>(job.length),
+                           Compression::None,
+                           0,
+                           job.offset};
+        auto payload = frame + sizeof(FrameHeader);
+        std::size_t compressed = job.length;
+        if (codec == Compression::Lz) {
+            compressed =
+                LzCodec::Compress(job.data, job.length, payload, table.get());
+        }
+        if (compressed < job.length) {
+            header.codec = codec;
+            header.stored_size = static_cast<std::uint32_t>(compressed);
+        } else {
+            std::memcpy(payload, job.data, job.length);
+        }
+        std::memcpy(frame, &header, sizeof(header));
+        const auto size = sizeof(FrameHeader) + header.stored_size;
+        auto offset = stored.load(std::memory_order_relaxed);
+        const unsigned char* data = frame;
+        auto length = size;
+        while (length) {
+            const auto written = pwrite(fd, data, length, offset);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                // stored stays, so what made it to the file is only a frame
+                // cut short at the end
+                perror("Logger compressed pwrite");
+                failed = true;
+                lost.store(lost.load(std::memory_order_relaxed) + job.length,
+                           std::memory_order_relaxed);
+                return;
+            }
+            data += written;
+            length -= written;
+            offset += written;
+        }
+        stored.store(stored.load(std::memory_order_relaxed) + size,
+                     std::memory_order_relaxed);
+    }
+
+    const Compression codec;
+    unsigned char* const frame;
+    const std::unique_ptr<std::uint32_t[]> table;
+    int fd = -1;
+    std::atomic<unsigned long> stored{};
+    std::atomic<unsigned long> pending{};
+    std::atomic<unsigned long> lost{};
+    // Only touched by whoever writes frames, and by SetFile
+    bool failed{};
+    Job jobs[max_slots]{};
+    std::atomic<std::uint64_t> tail{};
+    std::atomic<bool> busy[max_slots]{};
+    std::thread thread;
+};
+
+// Reads a file as its uncompressed stream, whether it is made of frames or
+// was written without compression
+class FrameReader {
+   public:
+    // Returns whether the file is made of frames
+    inline bool Open(const int fd_) noexcept {
+        fd = fd_;
+        frames.clear();
+        cached = -1;
+        const auto file_size =
+            static_cast<std::uint64_t>(lseek(fd, 0, SEEK_END));
+        std::uint64_t at = 0;
+        std::uint64_t offset = 0;
+        FrameHeader header;
+        while (pread(fd, &header, sizeof(header), at) ==
+                   static_cast<ssize_t>(sizeof(header)) &&
+               header.magic == frame_magic && header.offset == offset &&
+               at + sizeof(header) + header.stored_size <= file_size) {
+            frames.push_back({at, header});
+            at += sizeof(header) + header.stored_size;
+            offset += header.size;
+        }
+        size = frames.empty() ? file_size : offset;
+        return !frames.empty();
+    }
+
+    inline std::uint64_t Size() const noexcept { return size; }
+
+    // Bytes read, fewer than length only at the end or on a damaged frame
+    inline std::size_t Read(std::uint64_t offset, unsigned char* out,
+                            const std::size_t length) noexcept {
+        if (frames.empty()) {
+            std::size_t got = 0;
+            while (got < length) {
+                const auto result = pread(fd, out + got, length - got,
+                                          static_cast<off_t>(offset + got));
+                if (result <= 0) {
+                    break;
+                }
+                got += result;
+            }
+            return got;
+        }
+        std::size_t got = 0;
+        while (got < length && offset < size) {
+            // Last frame starting at or before offset
+            const auto next = std::upper_bound(
+                frames.begin(), frames.end(), offset,
+                [](const std::uint64_t value, const Frame& frame) {
+                    return value < frame.header.offset;
+                });
+            const auto index = next - frames.begin() - 1;
+            if (!Load(index)) {
+                break;
+            }
+            const auto& header = frames[index].header;
+            const auto within = offset - header.offset;
+            const auto chunk =
+                std::min<std::size_t>(length - got, header.size - within);
+            std::memcpy(out + got, data.data() + within, chunk);
+            got += chunk;
+            offset += chunk;
+        }
+        return got;
+    }
+
+   private:
+    struct Frame {
+        std::uint64_t at;
+        FrameHeader header;
+    };
+
+    // Decompressed into data, the last frame stays there
+    inline bool Load(const std::ptrdiff_t index) noexcept {
+        if (index == cached) {
+            return true;
+        }
+        const auto& frame = frames[index];
+        stored.resize(frame.header.stored_size);
+        if (pread(fd, stored.data(), stored.size(),
+                  frame.at + sizeof(FrameHeader)) !=
+            static_cast<ssize_t>(stored.size())) {
+            return false;
+        }
+        data.resize(frame.header.size);
+        if (frame.header.codec == Compression::None) {
+            if (stored.size() != data.size()) {
+                return false;
+            }
+            data = stored;
+        } else if (frame.header.codec != Compression::Lz ||
+                   !LzCodec::Decompress(stored.data(), stored.size(),
+                                        data.data(), data.size())) {
+            fprintf(stderr, "Logger: damaged frame at %lu\n",
+                    static_cast<unsigned long>(frame.at));
+            return false;
+        }
+        cached = index;
+        return true;
+    }
+
+    int fd = -1;
+    std::vector<Frame> frames;
+    std::uint64_t size{};
+    std::ptrdiff_t cached = -1;
+    std::vector<unsigned char> stored;
+    std::vector<unsigned char> data;
+};
+
+#endif /* COMPRESSEDFRAMES_H_ */
@@ -0,0 +1,665 @@
+#ifndef FILEWRAPPER_H_
+#define FILEWRAPPER_H_
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "CompressedFrames.h"
+#include "IoUring.h"
+#include "MmapSegments.h"
+
+enum class SinkType {
+    // pwrite from the backend thread
+    Sync = 0,
+    // Filled buffers are handed to io_uring and the backend moves on to the
+    // next buffer while the kernel writes, falls back to Sync when io_uring
+    // is not available
+    IoUring = 1,
+    // Messages are formatted straight into mmaped, fallocated and prefaulted
+    // segment files of FileOptions::segment_size, the next one is prepared
+    // in the background so moving to it is a pointer swap, and whatever was
+    // written survives the process crashing
+    Mmap = 2,
+    // Log calls write binary records into a shared memory ring and a
+    // separate logd process formats them and writes the files, see ShmRing.h
+    SharedMemory = 3,
+    // The backend writes compact binary records instead of text, written
+    // like Sync, logdecode renders them, see BinaryLog.h
+    Binary = 4,
+};
+
+struct FileOptions {
+    // Size of the write buffer, rounded up to a multiple of page_size
+    std::size_t buffer_size = 1 << 20;
+    // Buffered data older than this gets written even if the buffer is not
+    // full and the queue has not drained
+    std::chrono::nanoseconds flush_interval = std::chrono::milliseconds(100);
+    // Open the file with O_DIRECT, only whole pages are written until the
+    // file is closed
+    bool direct_io = false;
+    // Size of each file with the mmap sink, a multiple of page_size, and
+    // about the size of each segment with the binary sink
+    std::size_t segment_size = 1 << 26;
+    // Every flushed buffer goes to the file as a frame compressed on its own,
+    // see CompressedFrames.h, logdecode reads them back, not for the mmap sink
+    // and written with pwrite even with the io_uring sink, no O_DIRECT
+    Compression compression = Compression::None;
+    // Compress and write on a helper thread of the file instead of the
+    // backend, formatting continues in the next buffer meanwhile
+    bool compression_thread = false;
+};
+
+// Messages are formatted straight into one large page aligned buffer which
+// goes to the file with a single write when it fills up, when the flush
+// interval passes or when the backend runs out of messages
+// With the io_uring sink there are three such buffers, formatting continues
+// in the next one while the kernel writes the previous, the same with the
+// compression helper thread
+struct FileWrapper {
+    static constexpr std::size_t page_size = 4096;
+    static constexpr std::size_t max_buffers = 3;
+
+    // pid goes into the file name, logd names files after the producer
+    explicit FileWrapper(std::string_view filename_,
+                         const FileOptions& options_ = {},
+                         const SinkType sink = SinkType::Sync,
+                         const pid_t pid = getpid()) noexcept
+        : options(options_),
+          buffer_size(((sink == SinkType::Mmap ? options_.segment_size
+                                               : options_.buffer_size) +
+                       page_size - 1) /
+                      page_size * page_size),
+          last_flush(std::chrono::steady_clock::now()) {
+        filename = filename_;
+        filename += "_";
+        filename += std::to_string(pid);
+        filename += "_";
+        if (sink == SinkType::SharedMemory) {
+            // Nothing is written from this process
+            buffer_count = 0;
+            buffer = nullptr;
+            return;
+        }
+        if (sink == SinkType::Mmap) {
+            roller = std::make_unique<SegmentRoller>(filename, buffer_size);
+            segment = roller->First();
+            if (segment) {
+                buffer_count = 0;
+                buffer = segment->base;
+                return;
+            }
+            fprintf(stderr, "Logger: mmap segments failed, using pwrite\n");
+            roller->Close(nullptr, 0);
+            roller.reset();
+        }
+        if (options.compression != Compression::None) {
+            if (sink == SinkType::IoUring) {
+                fprintf(stderr,
+                        "Logger: compressed files are written with pwrite\n");
+            }
+            options.direct_io = false;
+            frames = std::make_unique<FrameWriter>(
+                options.compression, buffer_size, options.compression_thread);
+            if (frames->Threaded()) {
+                buffer_count = max_buffers;
+            }
+        } else if (sink == SinkType::IoUring) {
+            if (ring.Init(max_buffers * 2)) {
+                buffer_count = max_buffers;
+            } else {
+                fprintf(stderr,
+                        "Logger: io_uring not available, using pwrite\n");
+            }
+        }
+        for (std::size_t i = 0; i < buffer_count; i++) {
+            buffers[i] = AllocateBuffer();
+        }
+        buffer = buffers[0];
+        createFile();
+    }
+    FileWrapper() = delete;
+    FileWrapper(const FileWrapper&) = delete;
+    FileWrapper(const FileWrapper&&) = delete;
+    FileWrapper operator=(const FileWrapper&) = delete;
+    FileWrapper operator=(const FileWrapper&&) = delete;
+    ~FileWrapper() noexcept {
+        closeFile();
+        for (std::size_t i = 0; i < buffer_count; i++) {
+            std::free(buffers[i]);
+        }
+    }
+
+    // Marks where the current message starts, a flush forced by a message
+    // that does not fit only writes up to here so messages are never split
+    // across files on rotation
+    inline void BeginMessage() noexcept { message_start = buffer_used; }
+
+    inline void Append(char data) noexcept {
+        appended++;
+        if (buffer_used == buffer_size) [[unlikely]] {
+            AppendSlow(&data, 1);
+            return;
+        }
+        buffer[buffer_used++] = data;
+    }
+
+    inline void Append(const char* data, std::size_t length) noexcept {
+        appended += length;
+        if (length <= buffer_size - buffer_used) [[likely]] {
+            std::memcpy(buffer + buffer_used, data, length);
+            buffer_used += length;
+            return;
+        }
+        AppendSlow(data, length);
+    }
+
+    inline void Append(std::string_view data) noexcept {
+        Append(data.data(), data.size());
+    }
+
+    // std::format directly into the buffer, formats a second time only if
+    // the result did not fit in what was left
+    // args are only read, formatting twice sees them unchanged
+    template <typename... Args>
+    inline void AppendFormatted(std::format_string<const Args&...> fmt,
+                                const Args&... args) noexcept {
+        const auto remaining = buffer_size - buffer_used;
+        const auto result =
+            std::format_to_n(buffer + buffer_used, remaining, fmt, args...);
+        if (static_cast<std::size_t>(result.size) <= remaining) [[likely]] {
+            buffer_used += result.size;
+            appended += result.size;
+            return;
+        }
+        Append(std::format(fmt, args...));
+    }
+
+    // Bytes given to Append since the file was opened
+    inline unsigned long Appended() const noexcept { return appended; }
+
+    // Where in the current file the next Append lands, not for the mmap sink
+    inline unsigned long Position() const noexcept {
+        return size_used + buffer_used;
+    }
+
+    // What the current file takes on disk once the buffer is written, the
+    // buffer and frames the helper thread has yet to write count uncompressed
+    inline unsigned long StoredSize() const noexcept {
+        return FileSize() + buffer_used;
+    }
+
+    inline bool HasPendingData() const noexcept {
+        return !roller && buffer_used != 0;
+    }
+
+    inline void Flush() noexcept { FlushUpTo(buffer_used); }
+
+    // Appended but not yet handed to a write, empty for the mmap sink where
+    // it is already in the file
+    inline std::string_view Unwritten() const noexcept {
+        return roller ? std::string_view{}
+                      : std::string_view{buffer, buffer_used};
+    }
+
+    // From a signal handler while nothing else touches the file, pwrites
+    // the buffer where the next flush would have put it and leaves the
+    // FileWrapper as it was, false when the file is compressed or O_DIRECT
+    // and the buffer cannot go there as it is
+    inline bool WriteUnwritten() const noexcept {
+        if (fd < 0 || roller || frames || options.direct_io) {
+            return false;
+        }
+        const char* data = buffer;
+        auto length = buffer_used;
+        auto offset = size_used;
+        while (length) {
+            const auto written = pwrite(fd, data, length, offset);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            data += written;
+            length -= written;
+            offset += written;
+        }
+        return true;
+    }
+
+    inline void FlushIfDue(
+        const std::chrono::steady_clock::time_point now) noexcept {
+        if (buffer_used && now - last_flush >= options.flush_interval) {
+            Flush();
+        }
+    }
+
+    inline void closeFile() noexcept {
+        if (roller) {
+            roller->Close(segment, buffer_used);
+            roller.reset();
+            segment = nullptr;
+            buffer_used = 0;
+            return;
+        }
+        if (fd < 0) {
+            return;
+        }
+        Flush();
+        WaitForAllWrites();
+        if (buffer_used) {
+            // O_DIRECT leftovers that are not a whole page
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            WriteAll(buffer, buffer_used);
+            buffer_used = 0;
+        }
+        close(fd);
+        fd = -1;
+    }
+    // Everything appended so far stays in this file and the next Append
+    // goes to a new one, not for the mmap sink
+    inline void Rotate() noexcept {
+        closeFile();
+        count++;
+        rotations.fetch_add(1, std::memory_order_relaxed);
+        createFile();
+    }
+
+    // Rotation goes through here directly, whatever is buffered is written
+    // to the new file
+    inline void createFile() noexcept {
+        if (fd >= 0) {
+            WaitForAllWrites();
+            close(fd);
+            fd = -1;
+        }
+        size_used = 0;
+        const auto name =
+            filename +
+            (count < 10 ? '0' + std::to_string(count) : std::to_string(count));
+        static constexpr int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        if (options.direct_io) {
+            fd = open(name.c_str(), flags | O_DIRECT, 0644);
+            if (fd < 0 && errno == EINVAL) {
+                fprintf(stderr, "Logger: O_DIRECT not supported for %s\n",
+                        name.c_str());
+                options.direct_io = false;
+            }
+        }
+        if (fd < 0) {
+            fd = open(name.c_str(), flags, 0644);
+        }
+        if (fd < 0) {
+            perror(name.c_str());
+        }
+        if (frames) {
+            frames->SetFile(fd);
+        }
+    }
+
+    int count{};
+    // Across every file
+    static inline std::atomic<unsigned long> rotations{};
+    static constexpr unsigned long max_size = 2251799813;
+    std::string filename;
+    unsigned long size_used{};
+    int fd = -1;
+
+   private:
+    // Writes buffer[0, length), with O_DIRECT only whole pages, whatever was
+    // not written ends up at the front of the buffer formatting continues in
+    inline void FlushUpTo(std::size_t length) noexcept {
+        last_flush = std::chrono::steady_clock::now();
+        if (roller) {
+            // Already in the page cache
+            return;
+        }
+        if (options.direct_io) {
+            length = length / page_size * page_size;
+        }
+        if (!length) {
+            return;
+        }
+        if (FileSize() && FileSize() + length > max_size) {
+            count++;
+            rotations.fetch_add(1, std::memory_order_relaxed);
+            createFile();
+        }
+        WriteBuffer(length);
+        message_start = message_start > length ? message_start - length : 0;
+    }
+
+    // The part of the current message that is already in this segment moves
+    // to the next one along with the rest of it, unless the message is
+    // bigger than a whole segment
+    inline void AppendToNextSegment(const char* data,
+                                    std::size_t length) noexcept {
+        while (true) {
+            const auto partial = buffer_used - message_start;
+            if (message_start && partial + length <= buffer_size) {
+                auto next = roller->TakeNext();
+                if (!next) [[unlikely]] {
+                    LeaveSegments(message_start, data, length);
+                    return;
+                }
+                std::memcpy(next->base, buffer + message_start, partial);
+                std::memcpy(next->base + partial, data, length);
+                roller->Retire(segment, message_start);
+                SwitchSegment(next, partial + length);
+                return;
+            }
+            const auto chunk = std::min(length, buffer_size - buffer_used);
+            std::memcpy(buffer + buffer_used, data, chunk);
+            buffer_used += chunk;
+            data += chunk;
+            length -= chunk;
+            if (!length) {
+                return;
+            }
+            auto next = roller->TakeNext();
+            if (!next) [[unlikely]] {
+                LeaveSegments(buffer_used, data, length);
+                return;
+            }
+            roller->Retire(segment, buffer_used);
+            SwitchSegment(next, 0);
+        }
+    }
+
+    // The next segment could not be created, the current one keeps its
+    // first used bytes and the rest of the message goes to a file written
+    // like Sync, named like the next segment
+    inline void LeaveSegments(std::size_t used, const char* data,
+                              std::size_t length) noexcept {
+        fprintf(stderr, "Logger: mmap segments failed, using pwrite\n");
+        buffers[0] = AllocateBuffer();
+        buffer_count = 1;
+        const auto partial = buffer_used - used;
+        std::memcpy(buffers[0], buffer + used, partial);
+        roller->Close(segment, used);
+        roller.reset();
+        segment = nullptr;
+        buffer = buffers[0];
+        buffer_used = partial;
+        message_start = 0;
+        count++;
+        rotations.fetch_add(1, std::memory_order_relaxed);
+        createFile();
+        AppendSlow(data, length);
+    }
+
+    inline void SwitchSegment(MappedSegment* next, std::size_t used) noexcept {
+        segment = next;
+        buffer = next->base;
+        buffer_used = used;
+        message_start = 0;
+        count++;
+        rotations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline void WriteBuffer(std::size_t length) noexcept {
+        const auto remaining = buffer_used - length;
+        if (frames) {
+            WriteFrame(length, remaining);
+            return;
+        }
+        if (!ring.IsActive()) {
+            WriteAll(buffer, length);
+            if (remaining) {
+                std::memmove(buffer, buffer + length, remaining);
+            }
+            buffer_used = remaining;
+            return;
+        }
+        while (true) {
+            const auto submitted =
+                ring.SubmitWrite(fd, buffer, length, size_used, current);
+            if (submitted == IoUring::Submit::Done) {
+                break;
+            }
+            if (submitted == IoUring::Submit::Failed || !in_flight_count ||
+                !ReapWrite(true)) {
+                StopRing();
+                WriteBuffer(length);
+                return;
+            }
+        }
+        in_flight[current] = {true, length, size_used};
+        in_flight_count++;
+        size_used += length;
+        while (ReapWrite(false));
+        const auto next = (current + 1) % buffer_count;
+        while (in_flight[next].active) {
+            if (!ReapWrite(true)) {
+                StopRing();
+            }
+        }
+        if (remaining) {
+            std::memcpy(buffers[next], buffer + length, remaining);
+        }
+        current = next;
+        buffer = buffers[next];
+        buffer_used = remaining;
+    }
+
+    // io_uring failed to take a write or to report one, what is still in
+    // flight is written again with pwrite, the same bytes at the same offset,
+    // and from here on the file is written like Sync
+    inline void StopRing() noexcept {
+        if (!ring.IsActive()) {
+            return;
+        }
+        perror("Logger io_uring, using pwrite");
+        for (std::size_t i = 0; i < buffer_count; i++) {
+            auto& write = in_flight[i];
+            if (write.active) {
+                WriteAt(buffers[i], write.length, write.offset);
+                write.active = false;
+            }
+        }
+        in_flight_count = 0;
+        ring.Close();
+    }
+
+    // size_used stays the offset in the uncompressed stream, the frame
+    // records it
+    inline void WriteFrame(std::size_t length, std::size_t remaining) noexcept {
+        frames->Write(buffer, length, size_used, current);
+        size_used += length;
+        if (!frames->Threaded()) {
+            if (remaining) {
+                std::memmove(buffer, buffer + length, remaining);
+            }
+            buffer_used = remaining;
+            return;
+        }
+        const auto next = (current + 1) % buffer_count;
+        frames->WaitSlot(next);
+        if (remaining) {
+            std::memcpy(buffers[next], buffer + length, remaining);
+        }
+        current = next;
+        buffer = buffers[next];
+        buffer_used = remaining;
+    }
+
+    inline char* AllocateBuffer() const noexcept {
+        auto allocated =
+            static_cast<char*>(std::aligned_alloc(page_size, buffer_size));
+        if (!allocated) {
+            perror("Logger buffer");
+            std::abort();
+        }
+        ThreadPlacement::BindToMemoryNode(allocated, buffer_size);
+        return allocated;
+    }
+
+    inline unsigned long FileSize() const noexcept {
+        return frames ? frames->StoredSize() : size_used;
+    }
+
+    inline bool ReapWrite(bool wait) noexcept {
+        unsigned long long index;
+        int result;
+        if (!ring.GetCompletion(wait, &index, &result)) {
+            return false;
+        }
+        auto& write = in_flight[index];
+        if (result < 0) {
+            // Nothing of it is known to be written, all of it again
+            WriteAt(buffers[index], write.length, write.offset);
+        } else if (static_cast<std::size_t>(result) < write.length) {
+            // Short write, finish it here
+            WriteAt(buffers[index] + result, write.length - result,
+                    write.offset + result);
+        }
+        write.active = false;
+        in_flight_count--;
+        // The ring cannot write this file at all, the caller sees it as a
+        // failed completion
+        if (result == -EINVAL || result == -EOPNOTSUPP) {
+            errno = -result;
+            StopRing();
+            return false;
+        }
+        return true;
+    }
+
+    inline void WaitForAllWrites() noexcept {
+        while (in_flight_count) {
+            if (!ReapWrite(true)) {
+                StopRing();
+            }
+        }
+        if (frames) {
+            frames->WaitAll();
+        }
+    }
+
+    inline void AppendSlow(const char* data, std::size_t length) noexcept {
+        if (roller) {
+            AppendToNextSegment(data, length);
+            return;
+        }
+        FlushUpTo(message_start);
+        if (length <= buffer_size - buffer_used) {
+            std::memcpy(buffer + buffer_used, data, length);
+            buffer_used += length;
+            return;
+        }
+        if (!options.direct_io && !frames) {
+            // Still does not fit, one pwritev for the buffer and the data
+            if (size_used && size_used + buffer_used + length > max_size) {
+                count++;
+                rotations.fetch_add(1, std::memory_order_relaxed);
+                createFile();
+            }
+            iovec iov[2] = {{buffer, buffer_used},
+                            {const_cast<char*>(data), length}};
+            WriteAll(iov, 2, buffer_used + length);
+            buffer_used = 0;
+            message_start = 0;
+            last_flush = std::chrono::steady_clock::now();
+            return;
+        }
+        // O_DIRECT needs aligned memory and frames are at most a buffer, go
+        // through the buffer in pieces
+        while (length) {
+            const auto chunk = std::min(length, buffer_size - buffer_used);
+            std::memcpy(buffer + buffer_used, data, chunk);
+            buffer_used += chunk;
+            data += chunk;
+            length -= chunk;
+            if (buffer_used == buffer_size) {
+                message_start = 0;
+                FlushUpTo(buffer_used);
+            }
+        }
+    }
+
+    inline void WriteAll(const char* data, std::size_t length) noexcept {
+        WriteAt(data, length, size_used);
+        size_used += length;
+    }
+
+    inline void WriteAt(const char* data, std::size_t length,
+                        unsigned long offset) noexcept {
+        while (length) {
+            const auto written = pwrite(fd, data, length, offset);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("Logger pwrite");
+                return;
+            }
+            data += written;
+            length -= written;
+            offset += written;
+        }
+    }
+
+    inline void WriteAll(iovec* iov, int iov_count,
+                         std::size_t length) noexcept {
+        while (length) {
+            const auto written = pwritev(fd, iov, iov_count, size_used);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("Logger pwritev");
+                return;
+            }
+            length -= written;
+            size_used += written;
+            auto consumed = static_cast<std::size_t>(written);
+            while (iov_count && consumed >= iov->iov_len) {
+                consumed -= iov->iov_len;
+                iov++;
+                iov_count--;
+            }
+            if (iov_count) {
+                iov->iov_base = static_cast<char*>(iov->iov_base) + consumed;
+                iov->iov_len -= consumed;
+            }
+        }
+    }
+
+    struct PendingWrite {
+        bool active;
+        std::size_t length;
+        unsigned long offset;
+    };
+
+    FileOptions options;
+    const std::size_t buffer_size;
+    IoUring ring;
+    std::size_t buffer_count = 1;
+    char* buffers[max_buffers]{};
+    PendingWrite in_flight[max_buffers]{};
+    std::size_t in_flight_count{};
+    std::size_t current{};
+    std::unique_ptr<FrameWriter> frames;
+    std::unique_ptr<SegmentRoller> roller;
+    MappedSegment* segment{};
+    char* buffer;
+    std::size_t buffer_used{};
+    std::size_t message_start{};
+    unsigned long appended{};
+    std::chrono::steady_clock::time_point last_flush;
+};
+
+#endif /* FILEWRAPPER_H_ */
@@ -0,0 +1,281 @@
+#ifndef FLIGHTRECORDER_H_
+#define FLIGHTRECORDER_H_
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string_view>
+
+#include "CallSite.h"
+#include "LogBuffer.h"
+#include "LogLevel.h"
+#include "ThreadPlacement.h"
+
+// What the Logger keeps around for when the process dies, the last messages
+// of each Logger in memory and what a signal handler needs to write them out
+// with nothing but write(2), no malloc, no locks, no stdio
+
+// The last records messages of one Logger, added by whichever thread
+// renders for the Logger, read by the crash handler
+// Messages are kept as rendered, the header is rendered again from the call
+// site when they are written out
+class FlightRecorder {
+   public:
+    // Bytes per entry, longer messages are cut
+    static constexpr std::size_t entry_size = 256;
+
+    struct Entry {
+        std::int64_t epoch_ns;
+        CallSiteId call_site;
+        std::uint32_t length;
+        char text[entry_size - 16];
+    };
+    static_assert(sizeof(Entry) == entry_size);
+
+    explicit FlightRecorder(const std::size_t records_) noexcept
+        : records(std::max<std::size_t>(records_, 2)),
+          entries(static_cast<Entry*>(
+              std::aligned_alloc(entry_size, records * entry_size))) {
+        // Nothing is allocated or faulted in once messages come in
+        ThreadPlacement::Prefault(entries, records * entry_size);
+    }
+    FlightRecorder() = delete;
+    FlightRecorder(const FlightRecorder&) = delete;
+    FlightRecorder(const FlightRecorder&&) = delete;
+    FlightRecorder operator=(const FlightRecorder&) = delete;
+    FlightRecorder operator=(const FlightRecorder&&) = delete;
+    ~FlightRecorder() noexcept { std::free(entries); }
+
+    // Single writer, overwrites the oldest entry
+    inline void Add(const std::int64_t epoch_ns, const CallSiteId call_site,
+                    const std::string_view text) noexcept {
+        const auto index = written.load(std::memory_order_relaxed);
+        auto& entry = entries[index % records];
+        entry.epoch_ns = epoch_ns;
+        entry.call_site = call_site;
+        entry.length = static_cast<std::uint32_t>(
+            std::min(text.size(), sizeof(entry.text)));
+        std::memcpy(entry.text, text.data(), entry.length);
+        written.store(index + 1, std::memory_order_release);
+    }
+
+    // Oldest first, once the ring has wrapped the oldest entry is left out,
+    // the writer may be in the middle of overwriting it
+    template <typename Visit>
+    inline void ForEach(Visit&& visit) const noexcept {
+        const auto end = written.load(std::memory_order_acquire);
+        const auto begin = end >= records ? end - records + 1 : 0;
+        for (auto index = begin; index < end; index++) {
+            visit(entries[index % records]);
+        }
+    }
+
+   private:
+    const std::size_t records;
+    Entry* const entries;
+    std::atomic<std::uint64_t> written{};
+};
+
+// Output of a signal handler, collects into a buffer on the stack and hands
+// it to write(2) whenever it fills up and on Flush
+class CrashWriter {
+   public:
+    explicit CrashWriter(const int fd_) noexcept : fd(fd_) {}
+    CrashWriter() = delete;
+    CrashWriter(const CrashWriter&) = delete;
+    CrashWriter(const CrashWriter&&) = delete;
+    CrashWriter operator=(const CrashWriter&) = delete;
+    CrashWriter operator=(const CrashWriter&&) = delete;
+    ~CrashWriter() noexcept { Flush(); }
+
+    inline void Append(const char* data, std::size_t length) noexcept {
+        while (length) {
+            const auto chunk = std::min(length, sizeof(buffer) - used);
+            std::memcpy(buffer + used, data, chunk);
+            used += chunk;
+            data += chunk;
+            length -= chunk;
+            if (used == sizeof(buffer)) {
+                Flush();
+            }
+        }
+    }
+
+    inline void Append(const std::string_view text) noexcept {
+        Append(text.data(), text.size());
+    }
+
+    inline void Append(const char c) noexcept { Append(&c, 1); }
+
+    inline void AppendInteger(const std::uint64_t value) noexcept {
+        char digits[20];
+        const auto length = DecimalDigits(value);
+        WriteDecimal(digits, value, length);
+        Append(digits, length);
+    }
+
+    // "[time] [LEVEL] [file function line] " the way LogHelper writes it,
+    // always with the time
+    inline void AppendHeader(const std::int64_t epoch_ns,
+                             const CallSiteId call_site) noexcept {
+        char time[timestamp_length];
+        WriteTimestamp(time, epoch_ns);
+        Append('[');
+        Append(time, sizeof(time));
+        Append("] ");
+        const auto& site = CallSiteRegistry::Get(call_site);
+        Append(LevelPrefix(site.level));
+        if (site.log_location) {
+            Append('[');
+            Append(site.location.file_name());
+            Append(' ');
+            Append(site.location.function_name());
+            Append(' ');
+            AppendInteger(site.location.line());
+            Append("] ");
+        }
+    }
+
+    inline void Flush() noexcept {
+        const char* data = buffer;
+        while (used) {
+            const auto written = write(fd, data, used);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                break;
+            }
+            data += written;
+            used -= written;
+        }
+        used = 0;
+    }
+
+   private:
+    const int fd;
+    std::size_t used{};
+    char buffer[4096];
+};
+
+// Signals the crash handler takes over, whatever was installed before gets
+// the signal once the handler is done
+inline constexpr int crash_signals[] = {SIGSEGV, SIGBUS, SIGABRT, SIGTERM};
+
+class CrashSignals {
+   public:
+    // Stack of each thread's handler, a stack overflow leaves none
+    static constexpr std::size_t alt_stack_size = 1 << 16;
+
+    static inline void Install(void (*handler)(int)) noexcept {
+        if (installed) {
+            return;
+        }
+        struct sigaction action {};
+        action.sa_handler = handler;
+        action.sa_flags = SA_ONSTACK;
+        sigemptyset(&action.sa_mask);
+        for (std::size_t i = 0; i < std::size(crash_signals); i++) {
+            sigaction(crash_signals[i], &action, &previous[i]);
+        }
+        installed = true;
+    }
+
+    static inline void Restore() noexcept {
+        if (!installed) {
+            return;
+        }
+        for (std::size_t i = 0; i < std::size(crash_signals); i++) {
+            sigaction(crash_signals[i], &previous[i], nullptr);
+        }
+        installed = false;
+    }
+
+    static inline bool Installed() noexcept { return installed; }
+
+    // From the handler, the signal is blocked until the handler returns and
+    // is then delivered to what was installed before
+    static inline void Reraise(const int signal) noexcept {
+        for (std::size_t i = 0; i < std::size(crash_signals); i++) {
+            if (crash_signals[i] == signal) {
+                sigaction(signal, &previous[i], nullptr);
+            }
+        }
+        raise(signal);
+    }
+
+    // Passes signal on the way Reraise does if StopWatchdog does not come
+    // within seconds, for the parts of a handler that are not async signal
+    // safe and may hang
+    static inline void StartWatchdog(const int signal,
+                                     const unsigned seconds) noexcept {
+        watchdog_signal = signal;
+        struct sigaction action {};
+        action.sa_handler = OnWatchdog;
+        action.sa_flags = SA_ONSTACK;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGALRM, &action, &previous_alarm);
+        alarm(seconds);
+    }
+
+    static inline void StopWatchdog() noexcept {
+        alarm(0);
+        sigaction(SIGALRM, &previous_alarm, nullptr);
+    }
+
+    // Gives the calling thread an alternate signal stack, once per thread
+    static inline void UseAltStack() noexcept {
+        thread_local AltStack stack;
+        if (stack.base) {
+            return;
+        }
+        stack.base = static_cast<char*>(std::malloc(alt_stack_size));
+        stack_t alt{};
+        alt.ss_sp = stack.base;
+        alt.ss_size = alt_stack_size;
+        if (!stack.base || sigaltstack(&alt, nullptr) != 0) {
+            std::free(stack.base);
+            stack.base = nullptr;
+        }
+    }
+
+   private:
+    // SIGALRM may land on any thread, the one in the handler has the signal
+    // blocked, so it is unblocked for the raise to take effect right away
+    static inline void OnWatchdog(int) noexcept {
+        const int signal = watchdog_signal;
+        Reraise(signal);
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, signal);
+        pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+    }
+
+    struct AltStack {
+        char* base{};
+        ~AltStack() noexcept {
+            if (base) {
+                stack_t alt{};
+                alt.ss_flags = SS_DISABLE;
+                sigaltstack(&alt, nullptr);
+                std::free(base);
+            }
+        }
+    };
+
+    static inline bool installed{};
+    static inline struct sigaction previous[std::size(crash_signals)]{};
+    static inline struct sigaction previous_alarm{};
+    static inline volatile sig_atomic_t watchdog_signal{};
+};
+
+#endif /* FLIGHTRECORDER_H_ */
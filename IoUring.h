@@ -0,0 +1,197 @@
+#ifndef IOURING_H_
+#define IOURING_H_
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+// Minimal io_uring on top of the raw syscalls, only what the file sink needs
+// one submitter and one reaper, both the calling thread
+class IoUring {
+   public:
+    IoUring() noexcept = default;
+    IoUring(const IoUring&) = delete;
+    IoUring(const IoUring&&) = delete;
+    IoUring operator=(const IoUring&) = delete;
+    IoUring operator=(const IoUring&&) = delete;
+    ~IoUring() noexcept { Close(); }
+
+    // Returns false when the kernel does not support io_uring or its write
+    // opcode, or it is not allowed (seccomp, containers), caller should fall
+    // back to pwrite
+    inline bool Init(unsigned entries) noexcept {
+        io_uring_params params{};
+        ring_fd = static_cast<int>(
+            syscall(__NR_io_uring_setup, entries, &params));
+        if (ring_fd < 0) {
+            return false;
+        }
+        sq_ring_size =
+            params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size =
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+        sq_ring = Map(sq_ring_size, IORING_OFF_SQ_RING);
+        cq_ring = single_mmap ? sq_ring : Map(cq_ring_size, IORING_OFF_CQ_RING);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(Map(sqes_size, IORING_OFF_SQES));
+        if (!sq_ring || !cq_ring || !sqes) {
+            Close();
+            return false;
+        }
+        auto sq = static_cast<char*>(sq_ring);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sq_entries = params.sq_entries;
+        auto cq = static_cast<char*>(cq_ring);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        if (!SupportsWrite()) {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    inline bool IsActive() const noexcept { return ring_fd >= 0; }
+
+    enum class Submit {
+        Done,
+        // Nothing was queued, reap a completion and try again
+        Full,
+        // The entry is queued but io_uring_enter failed, the ring cannot be
+        // trusted with the write, Close it and write with pwrite
+        Failed,
+    };
+
+    inline Submit SubmitWrite(int fd, const void* data, unsigned length,
+                              unsigned long long offset,
+                              unsigned long long user_data) noexcept {
+        const auto tail = *sq_tail;
+        if (tail - std::atomic_ref<unsigned>(*sq_head).load(
+                       std::memory_order_acquire) ==
+            sq_entries) {
+            return Submit::Full;
+        }
+        const auto index = tail & sq_mask;
+        auto sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<unsigned long long>(data);
+        sqe->len = length;
+        sqe->off = offset;
+        sqe->user_data = user_data;
+        sq_array[index] = index;
+        std::atomic_ref<unsigned>(*sq_tail).store(tail + 1,
+                                                  std::memory_order_release);
+        return Enter(1, 0, 0) >= 0 ? Submit::Done : Submit::Failed;
+    }
+
+    // Takes one completion, blocking for it if wait is set
+    inline bool GetCompletion(bool wait, unsigned long long* user_data,
+                              int* result) noexcept {
+        if (!IsActive()) {
+            return false;
+        }
+        while (true) {
+            const auto head = *cq_head;
+            if (head != std::atomic_ref<unsigned>(*cq_tail).load(
+                            std::memory_order_acquire)) {
+                const auto& cqe = cqes[head & cq_mask];
+                *user_data = cqe.user_data;
+                *result = cqe.res;
+                std::atomic_ref<unsigned>(*cq_head).store(
+                    head + 1, std::memory_order_release);
+                return true;
+            }
+            if (!wait || Enter(0, 1, IORING_ENTER_GETEVENTS) < 0) {
+                return false;
+            }
+        }
+    }
+
+    inline void Close() noexcept {
+        if (sqes) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_ring && !single_mmap) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        if (sq_ring) {
+            munmap(sq_ring, sq_ring_size);
+        }
+        if (ring_fd >= 0) {
+            close(ring_fd);
+        }
+        sqes = nullptr;
+        sq_ring = cq_ring = nullptr;
+        ring_fd = -1;
+    }
+
+   private:
+    // IORING_OP_WRITE came with the probe in 5.6, a kernel without the probe
+    // does not have it either
+    inline bool SupportsWrite() noexcept {
+        alignas(io_uring_probe) unsigned char
+            storage[sizeof(io_uring_probe) +
+                    (IORING_OP_WRITE + 1) * sizeof(io_uring_probe_op)]{};
+        auto probe = reinterpret_cast<io_uring_probe*>(storage);
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE,
+                    probe, IORING_OP_WRITE + 1) < 0) {
+            return false;
+        }
+        return probe->last_op >= IORING_OP_WRITE &&
+               (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    inline void* Map(std::size_t size, long long offset) noexcept {
+        auto pointer = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+        return pointer == MAP_FAILED ? nullptr : pointer;
+    }
+
+    inline int Enter(unsigned to_submit, unsigned min_complete,
+                     unsigned flags) noexcept {
+        int ret;
+        do {
+            ret = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd,
+                                           to_submit, min_complete, flags,
+                                           nullptr, 0));
+        } while (ret < 0 && errno == EINTR);
+        return ret;
+    }
+
+    int ring_fd = -1;
+    bool single_mmap{};
+    void* sq_ring{};
+    void* cq_ring{};
+    std::size_t sq_ring_size{};
+    std::size_t cq_ring_size{};
+    std::size_t sqes_size{};
+    io_uring_sqe* sqes{};
+    unsigned* sq_head{};
+    unsigned* sq_tail{};
+    unsigned* sq_array{};
+    unsigned sq_mask{};
+    unsigned sq_entries{};
+    unsigned* cq_head{};
+    unsigned* cq_tail{};
+    unsigned cq_mask{};
+    io_uring_cqe* cqes{};
+};
+
+#endif /* IOURING_H_ */
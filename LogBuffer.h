@@ -0,0 +1,267 @@
+#ifndef LOGBUFFER_H_
+#define LOGBUFFER_H_
+
+#include <algorithm>
+#include <charconv>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string_view>
+#include <type_traits>
+
+// Formatting kernels the backend renders numbers and times with instead of
+// std::format, no locale, no allocation, digits two at a time from a table
+
+// "00" to "99" back to back
+inline constexpr struct DigitPairs {
+    char text[200];
+
+    constexpr DigitPairs() noexcept : text() {
+        for (int i = 0; i < 100; i++) {
+            text[i * 2] = static_cast<char>('0' + i / 10);
+            text[i * 2 + 1] = static_cast<char>('0' + i % 10);
+        }
+    }
+} digit_pairs;
+
+inline void WriteTwoDigits(char* out, const unsigned value) noexcept {
+    std::memcpy(out, digit_pairs.text + value * 2, 2);
+}
+
+inline std::size_t DecimalDigits(std::uint64_t value) noexcept {
+    std::size_t digits = 1;
+    while (value >= 100) {
+        value /= 100;
+        digits += 2;
+    }
+    return digits + (value >= 10);
+}
+
+// Exactly digits digits of value, zero padded at the front, value has to fit
+inline void WriteDecimal(char* out, std::uint64_t value,
+                         std::size_t digits) noexcept {
+    auto p = out + digits;
+    while (digits >= 2) {
+        p -= 2;
+        WriteTwoDigits(p, static_cast<unsigned>(value % 100));
+        value /= 100;
+        digits -= 2;
+    }
+    if (digits) {
+        *--p = static_cast<char>('0' + value);
+    }
+}
+
+// "YYYY-MM-DD HH:MM:SS" of epoch seconds in UTC, 19 characters, days to
+// date with the civil calendar arithmetic instead of gmtime_r
+inline void WriteCivilTime(char* out, const std::int64_t seconds) noexcept {
+    auto days = seconds / 86400;
+    auto second_of_day = seconds % 86400;
+    if (second_of_day < 0) {
+        second_of_day += 86400;
+        days--;
+    }
+    days += 719468;
+    const auto era = (days >= 0 ? days : days - 146096) / 146097;
+    const auto day_of_era = static_cast<unsigned>(days - era * 146097);
+    const auto year_of_era =
+        (day_of_era - day_of_era / 1460 + day_of_era / 36524 -
+         day_of_era / 146096) /
+        365;
+    const auto day_of_year =
+        day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    const auto shifted_month = (5 * day_of_year + 2) / 153;
+    const auto day = day_of_year - (153 * shifted_month + 2) / 5 + 1;
+    const auto month =
+        shifted_month < 10 ? shifted_month + 3 : shifted_month - 9;
+    const auto year = static_cast<std::int64_t>(year_of_era) + era * 400 +
+                      (month <= 2);
+    WriteDecimal(out, static_cast<std::uint64_t>(year) % 10000, 4);
+    out[4] = '-';
+    WriteTwoDigits(out + 5, month);
+    out[7] = '-';
+    WriteTwoDigits(out + 8, day);
+    out[10] = ' ';
+    const auto time = static_cast<unsigned>(second_of_day);
+    WriteTwoDigits(out + 11, time / 3600);
+    out[13] = ':';
+    WriteTwoDigits(out + 14, time / 60 % 60);
+    out[16] = ':';
+    WriteTwoDigits(out + 17, time % 60);
+}
+
+// "YYYY-MM-DD HH:MM:SS.nnnnnnnnn"
+inline constexpr std::size_t timestamp_length = 29;
+
+// No second rendered yet, for WriteTimestamp's rendered_second
+inline constexpr std::int64_t no_second =
+    std::numeric_limits<std::int64_t>::min();
+
+// Epoch nanoseconds as "YYYY-MM-DD HH:MM:SS.nnnnnnnnn" in UTC, same as
+// std::format of a system_clock time point, timestamp_length characters
+// Everything up to the seconds is only written when the second differs from
+// rendered_second, for callers that keep out between calls
+inline void WriteTimestamp(char* out, const std::int64_t epoch_ns,
+                           std::int64_t& rendered_second) noexcept {
+    auto seconds = epoch_ns / 1000000000;
+    auto nanos = epoch_ns % 1000000000;
+    if (nanos < 0) {
+        nanos += 1000000000;
+        seconds--;
+    }
+    if (seconds != rendered_second) {
+        rendered_second = seconds;
+        WriteCivilTime(out, seconds);
+        out[19] = '.';
+    }
+    WriteDecimal(out + 20, static_cast<std::uint64_t>(nanos), 9);
+}
+
+inline void WriteTimestamp(char* out, const std::int64_t epoch_ns) noexcept {
+    auto rendered_second = no_second;
+    WriteTimestamp(out, epoch_ns, rendered_second);
+}
+
+// Append only text buffer that print(LogBuffer&) methods and the backend
+// format into, it only grows, so one reused per thread stops allocating
+// once it has seen the longest message
+// Usable with std::back_inserter for anything the kernels do not cover
+class LogBuffer {
+   public:
+    using value_type = char;
+
+    static constexpr std::size_t initial_capacity = 256;
+
+    LogBuffer() noexcept
+        : data(static_cast<char*>(std::malloc(initial_capacity))),
+          capacity(initial_capacity) {}
+    LogBuffer(const LogBuffer&) = delete;
+    LogBuffer(const LogBuffer&&) = delete;
+    LogBuffer operator=(const LogBuffer&) = delete;
+    LogBuffer operator=(const LogBuffer&&) = delete;
+    ~LogBuffer() noexcept { std::free(data); }
+
+    inline const char* Data() const noexcept { return data; }
+    inline std::size_t Size() const noexcept { return size; }
+    inline std::string_view View() const noexcept { return {data, size}; }
+    inline void Clear() noexcept { size = 0; }
+    // Back to an earlier Size()
+    inline void Truncate(const std::size_t size_) noexcept { size = size_; }
+
+    inline void Append(const char c) noexcept {
+        Reserve(1);
+        data[size++] = c;
+    }
+
+    inline void Append(const char* text, const std::size_t length) noexcept {
+        Reserve(length);
+        std::memcpy(data + size, text, length);
+        size += length;
+    }
+
+    inline void Append(std::string_view text) noexcept {
+        Append(text.data(), text.size());
+    }
+
+    inline void push_back(const char c) noexcept { Append(c); }
+
+    // Same digits as std::format "{}"
+    template <std::integral T>
+    inline void AppendInteger(const T value) noexcept {
+        std::uint64_t magnitude = static_cast<std::uint64_t>(value);
+        if constexpr (std::is_signed_v<T>) {
+            if (value < 0) {
+                Append('-');
+                magnitude = 0 - magnitude;
+            }
+        }
+        const auto digits = DecimalDigits(magnitude);
+        Reserve(digits);
+        WriteDecimal(data + size, magnitude, digits);
+        size += digits;
+    }
+
+    // A fixed point value, mantissa 12345 with 2 decimals is "123.45", for
+    // prices and quantities kept as scaled integers
+    inline void AppendFixed(const std::int64_t mantissa,
+                            const unsigned decimals) noexcept {
+        std::uint64_t magnitude = static_cast<std::uint64_t>(mantissa);
+        if (mantissa < 0) {
+            Append('-');
+            magnitude = 0 - magnitude;
+        }
+        if (!decimals) {
+            AppendInteger(magnitude);
+            return;
+        }
+        const auto digits = std::max<std::size_t>(DecimalDigits(magnitude),
+                                                  decimals + 1);
+        Reserve(digits + 1);
+        WriteDecimal(data + size, magnitude, digits);
+        const auto point = data + size + digits - decimals;
+        std::memmove(point + 1, point, decimals);
+        *point = '.';
+        size += digits + 1;
+    }
+
+    // Shortest text that reads back as the same value, std::format "{}"
+    template <std::floating_point T>
+    inline void AppendFloat(const T value) noexcept {
+        AppendChars([&](char* first, char* last) {
+            return std::to_chars(first, last, value);
+        });
+    }
+
+    // precision digits after the point, std::format "{:.6f}"
+    template <std::floating_point T>
+    inline void AppendFloat(const T value, const int precision) noexcept {
+        AppendChars([&](char* first, char* last) {
+            return std::to_chars(first, last, value, std::chars_format::fixed,
+                                 precision);
+        });
+    }
+
+    // WriteTimestamp of epoch_ns
+    inline void AppendTimestamp(const std::int64_t epoch_ns) noexcept {
+        Reserve(timestamp_length);
+        WriteTimestamp(data + size, epoch_ns);
+        size += timestamp_length;
+    }
+
+   private:
+    inline void Reserve(const std::size_t length) noexcept {
+        if (length > capacity - size) [[unlikely]] {
+            Grow(size + length);
+        }
+    }
+
+    [[gnu::noinline]] void Grow(const std::size_t needed) noexcept {
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        data = static_cast<char*>(std::realloc(data, capacity));
+    }
+
+    // Retries with more room until the conversion fits
+    template <typename Convert>
+    inline void AppendChars(Convert&& convert) noexcept {
+        Reserve(32);
+        while (true) {
+            const auto result = convert(data + size, data + capacity);
+            if (result.ec == std::errc{}) {
+                size = result.ptr - data;
+                return;
+            }
+            Grow(capacity * 2);
+        }
+    }
+
+    char* data;
+    std::size_t size{};
+    std::size_t capacity;
+};
+
+#endif /* LOGBUFFER_H_ */
@@ -0,0 +1,290 @@
+#ifndef LOGDICTIONARY_H_
+#define LOGDICTIONARY_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "CallSite.h"
+#include "LogFormat.h"
+#include "LogLevel.h"
+#include "TscClock.h"
+
+// Records written for another process (SharedMemory sink) or for later
+// (Binary sink) only carry ids, these entries say what the ids stand for
+// Both write them with WriteLogDictEntry and read them back into a
+// LogDictionary, which renders records the way Logger::LogHelper does
+
+enum class LogDictKind : std::uint32_t {
+    // fields line, flags (time, location, new line bits, level << 8),
+    // file name length, text file name then function name
+    CallSite = 1,
+    // fields argument count, text the FormatArgType codes then the format
+    Format = 2,
+    // fields buffer_size, segment_size, flush_interval ns, flags (direct_io,
+    // compression << 8, compression_thread << 16), text the file name
+    Logger = 3,
+    // fields size, text the type name, id is the LoggerTypeId
+    Type = 4,
+};
+
+// Followed by text_size bytes, size includes both and is a multiple of 8
+struct LogDictEntry {
+    std::uint32_t size;
+    LogDictKind kind;
+    std::uint32_t id;
+    std::uint32_t text_size;
+    std::uint64_t fields[4];
+};
+
+// Call site of messages the Logger writes itself, like drop reports, they
+// get a time and a new line
+inline constexpr std::uint32_t no_call_site = 0xffffffff;
+
+inline constexpr std::size_t LogDictEntrySize(
+    const std::size_t text_size) noexcept {
+    return (sizeof(LogDictEntry) + text_size + 7) / 8 * 8;
+}
+
+// to has room for LogDictEntrySize of both texts
+inline void WriteLogDictEntry(unsigned char* to, const LogDictKind kind,
+                              const std::uint32_t id,
+                              const std::uint64_t (&fields)[4],
+                              std::string_view text_1,
+                              std::string_view text_2 = {}) noexcept {
+    const auto text_size = text_1.size() + text_2.size();
+    auto entry = reinterpret_cast<LogDictEntry*>(to);
+    entry->size = static_cast<std::uint32_t>(LogDictEntrySize(text_size));
+    entry->kind = kind;
+    entry->id = id;
+    entry->text_size = static_cast<std::uint32_t>(text_size);
+    std::memcpy(entry->fields, fields, sizeof(entry->fields));
+    auto text = reinterpret_cast<char*>(entry + 1);
+    text_1.copy(text, text_1.size());
+    text_2.copy(text + text_1.size(), text_2.size());
+}
+
+inline void CallSiteDictFields(const CallSite& site,
+                               std::uint64_t (&fields)[4]) noexcept {
+    fields[0] = site.location.line();
+    fields[1] = site.log_time | site.log_location << 1 | site.new_line << 2 |
+                static_cast<std::uint64_t>(site.level) << 8;
+    fields[2] = std::string_view(site.location.file_name()).size();
+    fields[3] = 0;
+}
+
+// Calls handle(entry, text) for every entry of size bytes written back to
+// back, stops at one that does not fit
+template <typename Handle>
+inline void ForEachLogDictEntry(const unsigned char* data,
+                                const std::size_t size, Handle&& handle) {
+    std::size_t offset = 0;
+    while (offset + sizeof(LogDictEntry) <= size) {
+        LogDictEntry entry;
+        std::memcpy(&entry, data + offset, sizeof(entry));
+        if (entry.size < sizeof(LogDictEntry) || offset + entry.size > size ||
+            sizeof(LogDictEntry) + entry.text_size > entry.size) {
+            return;
+        }
+        handle(entry,
+               std::string_view(reinterpret_cast<const char*>(data + offset) +
+                                    sizeof(LogDictEntry),
+                                entry.text_size));
+        offset += entry.size;
+    }
+}
+
+// What a record holds after its header
+enum class LogPayload { Object, Format, Text };
+
+// Reader side, Types is the RegisteredLoggerTypes the reader was built with,
+// objects are only printed when the writer's type with that id has the
+// same size and, when the writer sent it, the same name
+template <typename Types>
+class LogDictionary {
+   public:
+    // false for kinds the caller handles itself
+    inline bool Add(const LogDictEntry& entry, std::string_view text) {
+        switch (entry.kind) {
+            case LogDictKind::CallSite: {
+                const auto flags = entry.fields[1];
+                const auto file_size = std::min<std::size_t>(entry.fields[2],
+                                                             text.size());
+                At(call_sites, entry.id) = {
+                    true,
+                    (flags & 1) != 0,
+                    (flags & 2) != 0,
+                    (flags & 4) != 0,
+                    static_cast<LogLevel>(
+                        std::min<std::uint64_t>(flags >> 8, 6)),
+                    std::format("[{} {} {}] ", text.substr(0, file_size),
+                                text.substr(file_size), entry.fields[0])};
+                return true;
+            }
+            case LogDictKind::Format: {
+                const auto count =
+                    std::min<std::size_t>(entry.fields[0], text.size());
+                auto& format = At(formats, entry.id);
+                format.known = true;
+                format.types.resize(count);
+                std::memcpy(format.types.data(), text.data(), count);
+                format.format = text.substr(count);
+                return true;
+            }
+            case LogDictKind::Type: {
+                auto& type = At(types, entry.id);
+                type.known = true;
+                type.size = entry.fields[0];
+                type.name = text;
+                return true;
+            }
+            case LogDictKind::Logger:
+                break;
+        }
+        return false;
+    }
+
+    // Whether the entries Render needs for these ids have been added, a
+    // reader following a live writer reads on and asks again when not
+    inline bool Knows(const std::uint32_t call_site, const LogPayload payload,
+                      const std::uint32_t format) const noexcept {
+        if (call_site != no_call_site &&
+            (call_site >= call_sites.size() || !call_sites[call_site].known)) {
+            return false;
+        }
+        return payload != LogPayload::Format ||
+               (format < formats.size() && formats[format].known);
+    }
+
+    // Appends the message as LogHelper would have written it, returns false
+    // when something in it could not be rendered, nothing is appended for
+    // an unknown call site
+    template <typename Out>
+    inline bool Render(Out& out, const std::uint32_t call_site,
+                       const std::int64_t epoch_ns, const LogPayload payload,
+                       const std::uint16_t type, const std::uint32_t format,
+                       const unsigned char* data, const std::size_t size) {
+        static const CallSiteInfo internal{true, true, false, true,
+                                           LogLevel::Off, {}};
+        const CallSiteInfo* site = &internal;
+        if (call_site != no_call_site) {
+            if (call_site >= call_sites.size() ||
+                !call_sites[call_site].known) {
+                return false;
+            }
+            site = &call_sites[call_site];
+        }
+        if (site->log_time) {
+            out.Append('[');
+            out.Append(timestamp_formatter.Format(epoch_ns));
+            out.Append("] ", 2);
+        }
+        out.Append(LevelPrefix(site->level));
+        if (site->log_location) {
+            out.Append(site->location_prefix);
+        }
+        bool rendered = true;
+        switch (payload) {
+            case LogPayload::Object:
+                rendered = RenderObject(type, data, size);
+                out.Append(text.View());
+                break;
+            case LogPayload::Format:
+                text.Clear();
+                if (format < formats.size() && formats[format].known &&
+                    RenderCodedFormat(formats[format].format,
+                                      formats[format].types.data(),
+                                      formats[format].types.size(), data,
+                                      size, &text)) {
+                    out.Append(text.View());
+                } else {
+                    rendered = false;
+                    out.Append("<format not known>");
+                }
+                break;
+            case LogPayload::Text:
+                out.Append(reinterpret_cast<const char*>(data), size);
+                break;
+        }
+        if (site->new_line) {
+            out.Append('\n');
+        }
+        return rendered;
+    }
+
+   private:
+    struct CallSiteInfo {
+        bool known;
+        bool log_time;
+        bool log_location;
+        bool new_line;
+        LogLevel level;
+        // "[file function line] "
+        std::string location_prefix;
+    };
+
+    struct FormatInfo {
+        bool known;
+        std::string format;
+        std::vector<FormatArgType> types;
+    };
+
+    struct TypeInfo {
+        bool known;
+        std::uint64_t size;
+        std::string name;
+    };
+
+    static constexpr std::size_t max_type_size =
+        *std::max_element(std::begin(Types::sizes), std::end(Types::sizes));
+
+    template <typename T>
+    static inline T& At(std::vector<T>& table, const std::uint32_t id) {
+        if (id >= table.size()) {
+            table.resize(id + 1);
+        }
+        return table[id];
+    }
+
+    // Into text, types this reader does not have as PlainBytes are dumped
+    // as hex
+    inline bool RenderObject(const std::uint16_t type,
+                             const unsigned char* data,
+                             const std::size_t size) {
+        const bool described = type < types.size() && types[type].known;
+        text.Clear();
+        if (type < Types::size && Types::plain_bytes[type] &&
+            size == Types::sizes[type] &&
+            (!described || types[type].name == Types::names[type])) {
+            // The bytes in a record are not aligned
+            std::memcpy(object, data, size);
+            Types::Print(type, object, text);
+            return true;
+        }
+        if (!described) {
+            text.Append("<type not known>");
+            return false;
+        }
+        std::format_to(std::back_inserter(text), "<{}", types[type].name);
+        for (std::size_t i = 0; i < size; i++) {
+            std::format_to(std::back_inserter(text), " {:02x}", data[i]);
+        }
+        text.Append('>');
+        return false;
+    }
+
+    std::vector<CallSiteInfo> call_sites;
+    std::vector<FormatInfo> formats;
+    std::vector<TypeInfo> types;
+    TimestampFormatter timestamp_formatter;
+    LogBuffer text;
+    alignas(64) unsigned char object[max_type_size];
+};
+
+#endif /* LOGDICTIONARY_H_ */
@@ -0,0 +1,374 @@
+#ifndef LOGFORMAT_H_
+#define LOGFORMAT_H_
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "LogBuffer.h"
+
+// String literal usable as a template argument, LogFmt<"value {}">
+template <std::size_t N>
+struct FixedString {
+    char data[N]{};
+
+    constexpr FixedString(const char (&str)[N]) noexcept {
+        std::copy_n(str, N, data);
+    }
+
+    constexpr std::string_view view() const noexcept { return {data, N - 1}; }
+};
+
+// Arguments are copied byte wise on the producer and read back on the
+// backend, so they have to be plain values, anything that points somewhere
+// else could be gone by the time the backend formats it
+// Arrays are out too, a string literal would otherwise be copied whole and
+// could not be rebuilt as a value on the backend
+template <typename T>
+concept DeferredFormatArg =
+    std::is_trivially_copyable_v<T> && !std::is_pointer_v<T> &&
+    !std::is_array_v<T> && !std::is_same_v<T, std::string_view>;
+
+// What a LogFmt argument is, for rendering the packed bytes in another
+// process that only has the format string and these codes
+// None is anything else, those messages are rendered on the producer
+enum class FormatArgType : std::uint8_t {
+    None,
+    Bool,
+    Char,
+    Int8,
+    UInt8,
+    Int16,
+    UInt16,
+    Int32,
+    UInt32,
+    Int64,
+    UInt64,
+    Float,
+    Double,
+    LongDouble,
+};
+
+template <typename T>
+inline constexpr FormatArgType format_arg_type = [] {
+    if constexpr (std::is_same_v<T, bool>) {
+        return FormatArgType::Bool;
+    } else if constexpr (std::is_same_v<T, char>) {
+        return FormatArgType::Char;
+    } else if constexpr (std::is_integral_v<T>) {
+        constexpr bool is_signed = std::is_signed_v<T>;
+        switch (sizeof(T)) {
+            case 1:
+                return is_signed ? FormatArgType::Int8 : FormatArgType::UInt8;
+            case 2:
+                return is_signed ? FormatArgType::Int16
+                                 : FormatArgType::UInt16;
+            case 4:
+                return is_signed ? FormatArgType::Int32
+                                 : FormatArgType::UInt32;
+            case 8:
+                return is_signed ? FormatArgType::Int64
+                                 : FormatArgType::UInt64;
+        }
+        return FormatArgType::None;
+    } else if constexpr (std::is_same_v<T, float>) {
+        return FormatArgType::Float;
+    } else if constexpr (std::is_same_v<T, double>) {
+        return FormatArgType::Double;
+    } else if constexpr (std::is_same_v<T, long double>) {
+        return FormatArgType::LongDouble;
+    } else {
+        return FormatArgType::None;
+    }
+}();
+
+// Upper bound for the arguments a format can be rendered with by type code
+inline constexpr std::size_t max_coded_format_args = 32;
+
+template <typename... Args>
+inline constexpr bool format_args_coded =
+    sizeof...(Args) <= max_coded_format_args &&
+    ((format_arg_type<Args> != FormatArgType::None) && ...);
+
+// One static instance per format string and argument types, its address is
+// what travels through the queue
+struct FormatDescriptor {
+    // Appends to the buffer
+    using RenderFunction = void (*)(const unsigned char*, LogBuffer&) noexcept;
+
+    std::string_view format;
+    std::size_t args_size;
+    RenderFunction render;
+    // Code of every argument, nullptr when one of them has none and only
+    // render knows how to format them
+    const FormatArgType* arg_types;
+    std::size_t arg_count;
+};
+
+template <typename... Args>
+inline constexpr std::size_t packed_args_size = (0 + ... + sizeof(Args));
+
+// Where each argument starts in the packed bytes
+template <typename... Args>
+inline constexpr auto packed_args_offsets = [] {
+    std::array<std::size_t, sizeof...(Args) + 1> offsets{};
+    std::size_t index = 0;
+    std::size_t offset = 0;
+    ((offsets[index++] = offset, offset += sizeof(Args)), ...);
+    return offsets;
+}();
+
+// A packed argument back as a value, without T having to be default
+// constructible
+template <typename T>
+inline T UnpackFormatArg(const unsigned char* bytes) noexcept {
+    struct Bytes {
+        unsigned char data[sizeof(T)];
+    } raw;
+    std::memcpy(raw.data, bytes, sizeof(T));
+    return std::bit_cast<T>(raw);
+}
+
+// Copies the arguments back to back, no padding
+template <typename... Args>
+inline void PackFormatArgs(unsigned char* buffer,
+                           const Args&... args) noexcept {
+    std::size_t offset = 0;
+    ((std::memcpy(buffer + offset, &args, sizeof(Args)),
+      offset += sizeof(Args)),
+     ...);
+}
+
+inline constexpr std::size_t FormatArgSize(const FormatArgType type) noexcept {
+    switch (type) {
+        case FormatArgType::None:
+            return 0;
+        case FormatArgType::Bool:
+        case FormatArgType::Char:
+        case FormatArgType::Int8:
+        case FormatArgType::UInt8:
+            return 1;
+        case FormatArgType::Int16:
+        case FormatArgType::UInt16:
+            return 2;
+        case FormatArgType::Int32:
+        case FormatArgType::UInt32:
+        case FormatArgType::Float:
+            return 4;
+        case FormatArgType::Int64:
+        case FormatArgType::UInt64:
+        case FormatArgType::Double:
+            return 8;
+        case FormatArgType::LongDouble:
+            return sizeof(long double);
+    }
+    return 0;
+}
+
+// Digits of a ".6f" spec, -1 for any other spec
+inline int FixedPrecision(std::string_view spec) noexcept {
+    if (spec.size() < 3 || spec.front() != '.' || spec.back() != 'f' ||
+        spec.size() > 5) {
+        return -1;
+    }
+    int precision = 0;
+    for (const char digit : spec.substr(1, spec.size() - 2)) {
+        if (digit < '0' || digit > '9') {
+            return -1;
+        }
+        precision = precision * 10 + (digit - '0');
+    }
+    return precision;
+}
+
+// The plain "{}" and "{:.Nf}" fields go through the LogBuffer kernels,
+// anything else through std::format
+template <typename T>
+inline void AppendFormatArg(const unsigned char* bytes, std::string_view spec,
+                            LogBuffer* out) {
+    T value;
+    std::memcpy(&value, bytes, sizeof(T));
+    if constexpr (std::is_same_v<T, bool>) {
+        if (spec.empty()) {
+            out->Append(value ? std::string_view("true")
+                              : std::string_view("false"));
+            return;
+        }
+    } else if constexpr (std::is_same_v<T, char>) {
+        if (spec.empty()) {
+            out->Append(value);
+            return;
+        }
+    } else if constexpr (std::is_integral_v<T>) {
+        if (spec.empty() || spec == "d") {
+            out->AppendInteger(value);
+            return;
+        }
+    } else if constexpr (std::is_same_v<T, float> ||
+                         std::is_same_v<T, double>) {
+        if (spec.empty()) {
+            out->AppendFloat(value);
+            return;
+        }
+        if (const auto precision = FixedPrecision(spec); precision >= 0) {
+            out->AppendFloat(value, precision);
+            return;
+        }
+    }
+    std::string field = "{";
+    if (!spec.empty()) {
+        field += ':';
+        field += spec;
+    }
+    field += '}';
+    std::vformat_to(std::back_inserter(*out), field,
+                    std::make_format_args(value));
+}
+
+inline void AppendFormatArg(const FormatArgType type,
+                            const unsigned char* bytes, std::string_view spec,
+                            LogBuffer* out) {
+    switch (type) {
+        case FormatArgType::None:
+            return;
+        case FormatArgType::Bool:
+            return AppendFormatArg<bool>(bytes, spec, out);
+        case FormatArgType::Char:
+            return AppendFormatArg<char>(bytes, spec, out);
+        case FormatArgType::Int8:
+            return AppendFormatArg<std::int8_t>(bytes, spec, out);
+        case FormatArgType::UInt8:
+            return AppendFormatArg<std::uint8_t>(bytes, spec, out);
+        case FormatArgType::Int16:
+            return AppendFormatArg<std::int16_t>(bytes, spec, out);
+        case FormatArgType::UInt16:
+            return AppendFormatArg<std::uint16_t>(bytes, spec, out);
+        case FormatArgType::Int32:
+            return AppendFormatArg<std::int32_t>(bytes, spec, out);
+        case FormatArgType::UInt32:
+            return AppendFormatArg<std::uint32_t>(bytes, spec, out);
+        case FormatArgType::Int64:
+            return AppendFormatArg<std::int64_t>(bytes, spec, out);
+        case FormatArgType::UInt64:
+            return AppendFormatArg<std::uint64_t>(bytes, spec, out);
+        case FormatArgType::Float:
+            return AppendFormatArg<float>(bytes, spec, out);
+        case FormatArgType::Double:
+            return AppendFormatArg<double>(bytes, spec, out);
+        case FormatArgType::LongDouble:
+            return AppendFormatArg<long double>(bytes, spec, out);
+    }
+}
+
+// Same output as the FormatDescriptorHolder render for the same format,
+// from the packed argument bytes and their type codes
+// Appends to out, returns false and leaves it partly rendered if the format
+// refers to an argument that is not there
+inline bool RenderCodedFormat(std::string_view format,
+                              const FormatArgType* types, std::size_t count,
+                              const unsigned char* args, std::size_t args_size,
+                              LogBuffer* out) noexcept {
+    if (count > max_coded_format_args) {
+        return false;
+    }
+    std::size_t offsets[max_coded_format_args];
+    std::size_t offset = 0;
+    for (std::size_t i = 0; i < count; i++) {
+        offsets[i] = offset;
+        offset += FormatArgSize(types[i]);
+    }
+    if (offset > args_size) {
+        return false;
+    }
+    std::size_t next_arg = 0;
+    for (std::size_t i = 0; i < format.size(); i++) {
+        const char c = format[i];
+        if ((c == '{' || c == '}') && i + 1 < format.size() &&
+            format[i + 1] == c) {
+            out->Append(c);
+            i++;
+            continue;
+        }
+        if (c != '{') {
+            out->Append(c);
+            continue;
+        }
+        const auto end = format.find('}', i);
+        if (end == std::string_view::npos) {
+            return false;
+        }
+        auto field = format.substr(i + 1, end - i - 1);
+        std::string_view spec;
+        if (const auto colon = field.find(':');
+            colon != std::string_view::npos) {
+            spec = field.substr(colon + 1);
+            field = field.substr(0, colon);
+        }
+        std::size_t index = next_arg++;
+        if (!field.empty()) {
+            index = 0;
+            for (const char digit : field) {
+                index = index * 10 + (digit - '0');
+            }
+        }
+        if (index >= count) {
+            return false;
+        }
+        try {
+            AppendFormatArg(types[index], args + offsets[index], spec, out);
+        } catch (...) {
+            return false;
+        }
+        i = end;
+    }
+    return true;
+}
+
+template <FixedString format, typename... Args>
+struct FormatDescriptorHolder {
+    // Through the formatting kernels when every argument has a type code,
+    // std::format for whatever RenderCodedFormat does not handle
+    static void Render(const unsigned char* buffer, LogBuffer& out) noexcept {
+        if constexpr (format_args_coded<Args...>) {
+            const auto start = out.Size();
+            if (RenderCodedFormat(format.view(), arg_types, sizeof...(Args),
+                                  buffer, packed_args_size<Args...>, &out)) {
+                return;
+            }
+            out.Truncate(start);
+        }
+        [&]<std::size_t... index>(std::index_sequence<index...>) {
+            const std::tuple<Args...> values{UnpackFormatArg<Args>(
+                buffer + packed_args_offsets<Args...>[index])...};
+            std::apply(
+                [&](const auto&... value) {
+                    std::vformat_to(std::back_inserter(out), format.view(),
+                                    std::make_format_args(value...));
+                },
+                values);
+        }(std::index_sequence_for<Args...>{});
+    }
+
+    // Rejects a format string that does not match the arguments at compile
+    // time, same check std::format does
+    static constexpr std::format_string<Args...> checked{format.view()};
+
+    static constexpr FormatArgType arg_types[sizeof...(Args) + 1] = {
+        format_arg_type<Args>...};
+
+    static constexpr FormatDescriptor descriptor{
+        format.view(), packed_args_size<Args...>, &Render,
+        format_args_coded<Args...> ? arg_types : nullptr, sizeof...(Args)};
+};
+
+#endif /* LOGFORMAT_H_ */
@@ -0,0 +1,40 @@
+#ifndef LOGLEVEL_H_
+#define LOGLEVEL_H_
+
+#include <cstdint>
+#include <string_view>
+
+enum class LogLevel : std::uint8_t {
+    Trace = 0,
+    Debug = 1,
+    Info = 2,
+    Warning = 3,
+    Error = 4,
+    Critical = 5,
+    // As a threshold nothing is logged, on a call site it means the call
+    // site has no level and is never filtered
+    Off = 6
+};
+
+// Levels below this are compiled out, -DLOGGER_COMPILE_MIN_LEVEL=2 drops
+// Trace and Debug
+#ifndef LOGGER_COMPILE_MIN_LEVEL
+#define LOGGER_COMPILE_MIN_LEVEL 0
+#endif
+
+inline constexpr LogLevel compile_min_level =
+    static_cast<LogLevel>(LOGGER_COMPILE_MIN_LEVEL);
+
+template <LogLevel level>
+inline constexpr bool level_compiled_in =
+    level >= compile_min_level && level != LogLevel::Off;
+
+// "[LEVEL] " as written in front of the message
+inline constexpr std::string_view LevelPrefix(const LogLevel level) noexcept {
+    constexpr std::string_view prefixes[] = {
+        "[TRACE] ", "[DEBUG] ", "[INFO] ", "[WARN] ", "[ERROR] ", "[CRIT] ",
+        ""};
+    return prefixes[static_cast<std::uint8_t>(level)];
+}
+
+#endif /* LOGLEVEL_H_ */
@@ -1,17 +1,288 @@
 #include "Logger.h"
 
-volatile bool Logger::run = false;
-std::deque<DataForLog*> Logger::log_queue = {};
-SpinLock Logger::sp = {};
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <ctime>
+#include <cstdlib>
+
+std::atomic<bool> Logger::run = false;
+Logger::Worker Logger::workers[Logger::max_workers] = {};
+std::size_t Logger::worker_count = 1;
+std::atomic<std::size_t> Logger::next_worker = 0;
 bool Logger::use_thread = false;
 Mempool Logger::mempool = {};
 int Logger::core_id = -1;
-std::thread Logger::thread = {};
+SinkType Logger::sink_type = SinkType::Sync;
+std::string Logger::placement_report = {};
+std::size_t Logger::queue_capacity = 1 << 16;
+std::atomic<unsigned long> Logger::total_dropped = 0;
+SharedStats Logger::shared_stats = {};
+std::chrono::nanoseconds Logger::stats_interval = std::chrono::seconds(1);
+bool Logger::use_shm = false;
+ShmRegion Logger::shm_region = {};
+std::uint32_t Logger::shm_generation = 0;
+std::uint32_t Logger::shm_next_format = 1;
+std::uint32_t Logger::shm_next_logger = 0;
+SpinLock Logger::shm_dictionary_lock = {};
+std::atomic<std::uint32_t> Logger::shm_call_sites[CallSiteRegistry::capacity] =
+    {};
+std::size_t Logger::flight_records = 0;
+std::atomic<Logger*> Logger::live_loggers[Logger::max_live_loggers] = {};
+std::chrono::nanoseconds Logger::crash_flush_timeout = std::chrono::seconds(1);
+bool Logger::crash_dump_queued = false;
+std::atomic<bool> Logger::crashing = false;
+std::atomic<bool> Logger::crash_stop = false;
+LogBuffer Logger::crash_text = {};
+thread_local Logger::Worker* Logger::current_worker = nullptr;
+thread_local bool Logger::handling_crash = false;
+thread_local bool Logger::producer_exiting = false;
 
 #ifdef LATENCY_FINDING
-LatencyProfilingStats Logger::latency_1 = LatencyProfilingStats("GetObjMethod");
-LatencyProfilingStats Logger::latency_2 = LatencyProfilingStats("LogMethod");
-LatencyProfilingStats Logger::latency_3 = LatencyProfilingStats("PopQueue");
-LatencyProfilingStats Logger::latency_4 = LatencyProfilingStats("FileWriting");
-LatencyProfilingStats Logger::latency_5 = LatencyProfilingStats("Dellocate");
+LatencyStage Logger::latency_1("GetObjMethod");
+LatencyStage Logger::latency_2("LogMethod");
+LatencyStage Logger::latency_3("PopQueue");
+LatencyStage Logger::latency_4("FileWriting");
+LatencyStage Logger::latency_5("Dellocate");
 #endif
+
+// Queues the calling thread registered, trivially destructible so it is
+// still there for Logs from thread_local destructors that run after
+// ProducerExit's
+struct Logger::ProducerQueues {
+    struct Registered {
+        Worker* worker;
+        std::size_t index;
+        LogQueue** queue;
+    };
+    Registered registered[max_workers * 2];
+    std::size_t count;
+};
+
+thread_local Logger::ProducerQueues Logger::producer_queues = {};
+
+// Retires the thread's queues when it exits, the backend frees each once it
+// has drained it
+struct Logger::ProducerExit {
+    ~ProducerExit() noexcept {
+        producer_exiting = true;
+        RetireProducerQueues();
+    }
+};
+
+void Logger::RetireProducerQueues() noexcept {
+    for (std::size_t i = 0; i < producer_queues.count; i++) {
+        auto& entry = producer_queues.registered[i];
+        // The next Log registers again
+        *entry.queue = nullptr;
+        entry.worker->queue_states[entry.index].store(
+            QueueState::Retired, std::memory_order_release);
+    }
+    producer_queues.count = 0;
+}
+
+void Logger::RegisterProducerQueue(Worker& worker, const bool stealable,
+                                   LogQueue*& queue) noexcept {
+    if (!producer_exiting) {
+        thread_local ProducerExit exit;
+    }
+    auto index = max_producer_threads;
+    const auto number_of_queues =
+        std::min(worker.queue_count.load(std::memory_order_acquire),
+                 max_producer_threads);
+    for (std::size_t i = 0; i < number_of_queues; i++) {
+        auto state = QueueState::Free;
+        if (worker.queue_states[i].load(std::memory_order_relaxed) ==
+                QueueState::Free &&
+            worker.queue_states[i].compare_exchange_strong(
+                state, QueueState::Setup, std::memory_order_acquire)) {
+            index = i;
+            queue = worker.queues[i].load(std::memory_order_relaxed);
+            queue->SetStealable(stealable);
+            break;
+        }
+    }
+    if (index == max_producer_threads) {
+        index = worker.queue_count.fetch_add(1, std::memory_order_relaxed);
+        if (index >= max_producer_threads) {
+            fprintf(stderr, "Logger: more than %zu live producer threads\n",
+                    max_producer_threads);
+            std::abort();
+        }
+        queue = new LogQueue(queue_capacity, stealable);
+        worker.queues[index].store(queue, std::memory_order_release);
+    }
+    worker.queue_states[index].store(QueueState::Used,
+                                     std::memory_order_release);
+    if (producer_queues.count < std::size(producer_queues.registered)) {
+        producer_queues.registered[producer_queues.count++] = {&worker, index,
+                                                               &queue};
+    }
+}
+
+// Later signals on the thread writing the dumps end the process at once,
+// there is nobody left to finish them
+void Logger::OnCrashSignal(const int signal) noexcept {
+    const int saved_errno = errno;
+    if (!handling_crash) {
+        handling_crash = true;
+        if (crashing.exchange(true, std::memory_order_acq_rel)) {
+            // Another thread is writing the dumps, its signal usually ends
+            // the process before this one gets to go on
+            while (crashing.load(std::memory_order_acquire)) {
+                const timespec pause{0, 1000000};
+                nanosleep(&pause, nullptr);
+            }
+        } else {
+            WriteCrashDumps(signal);
+            crashing.store(false, std::memory_order_release);
+        }
+        handling_crash = false;
+    }
+    errno = saved_errno;
+    CrashSignals::Reraise(signal);
+}
+
+// Waits for the workers and writes with write(2), the flight recorder holds
+// messages already rendered
+// Only crash_dump_queued renders anything here, which is not async signal
+// safe
+void Logger::WriteCrashDumps(const int signal) noexcept {
+    if (use_thread) {
+        // Workers that did not crash format and write as usual
+        auto deadline = std::chrono::steady_clock::now() + crash_flush_timeout;
+        for (auto& live : live_loggers) {
+            auto logger = live.load(std::memory_order_acquire);
+            if (logger && logger->worker != current_worker) {
+                logger->FlushUntil(deadline);
+            }
+        }
+        // Then they hold still, so their queues and buffers can be read
+        crash_stop.store(true, std::memory_order_release);
+        deadline = std::chrono::steady_clock::now() + crash_stop_timeout;
+        for (std::size_t i = 0; i < worker_count; i++) {
+            auto& worker = workers[i];
+            if (&worker == current_worker) {
+                continue;
+            }
+            worker.waiter.Wake();
+            while (!worker.crash_stopped.load(std::memory_order_acquire) &&
+                   std::chrono::steady_clock::now() < deadline) {
+                const timespec pause{0, 100000};
+                nanosleep(&pause, nullptr);
+            }
+        }
+    }
+    for (auto& live : live_loggers) {
+        if (auto logger = live.load(std::memory_order_acquire)) {
+            logger->WriteCrashDump(signal);
+        }
+    }
+    if (!crash_dump_queued) {
+        crash_stop.store(false, std::memory_order_release);
+        return;
+    }
+    CrashSignals::StartWatchdog(
+        signal,
+        std::max<unsigned>(
+            1, std::chrono::ceil<std::chrono::seconds>(crash_flush_timeout)
+                   .count()));
+    for (auto& live : live_loggers) {
+        auto logger = live.load(std::memory_order_acquire);
+        if (logger && use_thread && logger->HoldsStill() &&
+            logger->message_count.load(std::memory_order_acquire) > 0) {
+            logger->WriteQueuedEntries();
+        }
+    }
+    CrashSignals::StopWatchdog();
+    crash_stop.store(false, std::memory_order_release);
+}
+
+void Logger::WriteCrashDump(const int signal) noexcept {
+    const bool holds_still = HoldsStill();
+    const auto queued = message_count.load(std::memory_order_acquire);
+    const auto unwritten =
+        holds_still ? filewrapper.Unwritten() : std::string_view{};
+    if (!recorder && holds_still && queued <= 0 && unwritten.empty()) {
+        return;
+    }
+    const int fd = open(crash_path.c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    {
+        CrashWriter out(fd);
+        out.Append("Logger crash dump of ");
+        out.Append(filewrapper.filename);
+        out.Append(" on signal ");
+        out.AppendInteger(signal);
+        out.Append('\n');
+        if (recorder) {
+            out.Append("-- flight recorder, oldest first\n");
+            recorder->ForEach([&](const FlightRecorder::Entry& entry) {
+                out.AppendHeader(entry.epoch_ns, entry.call_site);
+                out.Append(entry.text, entry.length);
+                out.Append('\n');
+            });
+        }
+        if (!holds_still) {
+            out.Append("-- the backend did not stop, its buffer and queues ");
+            out.Append("are left out\n");
+        }
+        if (!unwritten.empty()) {
+            out.Append("-- ");
+            out.AppendInteger(unwritten.size());
+            if (filewrapper.WriteUnwritten()) {
+                out.Append(" buffered bytes written to the end of the file\n");
+            } else if (binary) {
+                out.Append(" bytes of binary records lost\n");
+            } else {
+                out.Append(" bytes never written to the file\n");
+                out.Append(unwritten);
+                if (unwritten.back() != '\n') {
+                    out.Append('\n');
+                }
+            }
+        }
+        if (holds_still && queued > 0 && use_thread) {
+            out.Append("-- ");
+            out.AppendInteger(queued);
+            out.Append(" messages still queued\n");
+        }
+    }
+    close(fd);
+}
+
+// crash_dump_queued, after every Logger's dump, so a hang here costs only
+// queued entries
+void Logger::WriteQueuedEntries() noexcept {
+    const int fd = open(crash_path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    {
+        CrashWriter out(fd);
+        const auto number_of_queues =
+            std::min(worker->queue_count.load(std::memory_order_acquire),
+                     max_producer_threads);
+        for (std::size_t i = 0; i < number_of_queues; i++) {
+            auto queue = worker->queues[i].load(std::memory_order_acquire);
+            if (!queue) {
+                continue;
+            }
+            queue->ForEachPending([&](DataForLog* data_log) {
+                if (data_log->logger_pointer != this) {
+                    return;
+                }
+                out.AppendHeader(TscClock::ToEpochNanos(data_log->time_now),
+                                 data_log->call_site);
+                RenderMessage(data_log, crash_text);
+                out.Append(crash_text.View());
+                out.Append('\n');
+            });
+        }
+    }
+    close(fd);
+}
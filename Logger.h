@@ -4,18 +4,41 @@
 #include <sched.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <concepts>
 #include <cstdio>
-#include <deque>
+#include <cstring>
 #include <format>
+#include <limits>
+#include <memory>
 #include <source_location>
 #include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
-#include "LoggerTypes.h"
+#ifndef LOGGER_TYPES_HEADER
+#define LOGGER_TYPES_HEADER "LoggerTypes.h"
+#endif
+#include LOGGER_TYPES_HEADER
+
+#include "BinaryLogWriter.h"
+#include "CallSite.h"
+#include "FileWrapper.h"
+#include "FlightRecorder.h"
+#include "LogFormat.h"
+#include "LogLevel.h"
+#include "LoggerStats.h"
+#include "LoggerTypeRegistry.h"
 #include "Mempool.h"
+#include "SPSCQueue.h"
+#include "ShmRing.h"
 #include "SpinLock.h"
+#include "ThreadPlacement.h"
+#include "TscClock.h"
+#include "WaitStrategy.h"
 
 #ifdef LATENCY_FINDING
 
@@ -26,80 +49,56 @@
 
 class Logger;
 
-struct FileWrapper {
-    explicit FileWrapper(std::string_view filename_) noexcept {
-        filename = filename_;
-        filename += "_";
-        filename += std::to_string(getpid());
-        filename += "_";
-        createFile();
-    }
-    FileWrapper() = delete;
-    FileWrapper(const FileWrapper&) = delete;
-    FileWrapper(const FileWrapper&&) = delete;
-    FileWrapper operator=(const FileWrapper&) = delete;
-    FileWrapper operator=(const FileWrapper&&) = delete;
-    ~FileWrapper() noexcept { closeFile(); }
-
-    inline void closeFile() noexcept {
-        if (file) {
-            fclose(file);
-            file = nullptr;
-        }
-    }
-    inline void createFile() noexcept {
-        closeFile();
-        size_used = 0;
-        file = fopen((filename + (count < 10 ? '0' + std::to_string(count)
-                                             : std::to_string(count)))
-                         .c_str(),
-                     "w");
-    }
-
-    inline void WritetoFile(const std::string& data) noexcept {
-        const unsigned long length_of_string = data.length();
-        if (length_of_string + size_used > max_size) {
-            count++;
-            createFile();
-        }
-        static constexpr auto size_of_character = sizeof(char);
-        fwrite(data.c_str(), size_of_character, length_of_string, file);
-        size_used += length_of_string;
-    }
-
-    int count{};
-    static constexpr unsigned long max_size = 2251799813;
-    std::string filename;
-    unsigned long size_used{};
-    FILE* file{};
-};
+// One queue slot, two cache lines
+struct alignas(64) DataForLog {
+    static constexpr std::size_t slot_size = 128;
+    // What is left of the slot after the header, holds the arguments of a
+    // LogFmt entry or the object of a LogEmplace entry
+    static constexpr std::size_t payload_capacity = slot_size - 48;
 
-struct DataForLog {
-    const bool log_time;
-    const bool log_location;
-    const bool new_line;
-    std::source_location location;
+    // Location and flags live in the CallSiteRegistry
+    const CallSiteId call_site;
+    const LoggerTypeId logger_type;
+    // pointer points at payload and the object is destroyed in place
+    // instead of going back to the mempool
+    const bool in_place;
     Logger* const logger_pointer;
-    const EnumLoggerTypes logger_type;
     const void* const pointer;
-    std::chrono::system_clock::time_point time_now;
+    // Set only for LogFmt entries, pointer then points at payload
+    const FormatDescriptor* const format;
+    // TscClock ticks
+    const std::uint64_t time_now;
+    alignas(16) unsigned char payload[payload_capacity];
 
-    DataForLog(Logger* const logger_pointer, const EnumLoggerTypes _logger_type,
-               void* _pointer, const bool _log_time, const bool _log_location,
-               const bool _new_line,
-               const std::source_location& location_) noexcept
-        : logger_type(_logger_type),
-          pointer(_pointer),
+    template <typename T>
+    static constexpr bool fits_inline =
+        sizeof(T) <= payload_capacity && alignof(T) <= 16;
+
+    DataForLog(Logger* const logger_pointer, const LoggerTypeId _logger_type,
+               void* _pointer, const FormatDescriptor* _format,
+               const CallSiteId _call_site,
+               const bool _in_place = false) noexcept
+        : call_site(_call_site),
+          logger_type(_logger_type),
+          in_place(_in_place),
           logger_pointer(logger_pointer),
-          log_time(_log_time),
-          log_location(_log_location),
-          new_line(_new_line) {
-        if (log_location) {
-            location = location_;
-        }
-        if (log_time) {
-            time_now = std::chrono::system_clock::now();
-        }
+          pointer(_pointer),
+          format(_format),
+          time_now(TscClock::Now()) {}
+    template <typename... Args>
+    DataForLog(Logger* const logger_pointer, const FormatDescriptor* _format,
+               const CallSiteId _call_site, const Args&... args) noexcept
+        : DataForLog(logger_pointer, 0, payload, _format, _call_site) {
+        PackFormatArgs(payload, args...);
+    }
+    // Builds the T inside the entry
+    template <HasPrintMethod T, typename... Args>
+    DataForLog(Logger* const logger_pointer, std::in_place_type_t<T>,
+               const CallSiteId _call_site, Args&&... args) noexcept
+        : DataForLog(logger_pointer, RegisteredLoggerTypes::id<T>, payload,
+                     nullptr, _call_site, true) {
+        static_assert(fits_inline<T>, "Type too large for the payload");
+        new (payload) T(std::forward<Args>(args)...);
     }
     DataForLog() = delete;
     DataForLog(const DataForLog&) = delete;
@@ -109,18 +108,161 @@ struct DataForLog {
     ~DataForLog() noexcept {}
 };
 
-template <typename T>
-concept HasPrintMethod = requires(T t, std::string* s) {
-    { t.print(s) } -> std::same_as<void>;
+static_assert(sizeof(DataForLog) == DataForLog::slot_size);
+
+// What a producer does when its queue is full, set per Logger
+// Block           sleeps until the backend has made room
+// SpinWait        spins until there is room
+// DropNewest      drops the message being logged
+// OverwriteOldest drops the oldest message in the queue instead, or the new
+//                 one while the backend is busy with the oldest or the
+//                 oldest belongs to another Logger
+// OverwriteOldest Loggers share a stealable queue per producer thread and
+// worker, so their drops never touch messages of the other policies
+// DropNewest and OverwriteOldest never wait, drops are counted and reported
+// in the log of the Logger the message belonged to
+enum class BackpressurePolicy { Block, SpinWait, DropNewest, OverwriteOldest };
+
+struct LoggerOptions {
+    // Run formatting and file writes on a backend thread
+    bool start_thread = false;
+    // Core the first backend thread is pinned to, worker i goes to
+    // core_id + i, -1 leaves them to the scheduler
+    int core_id = -1;
+    // SCHED_FIFO priority for the backend thread, 0 keeps the normal
+    // scheduler
+    int realtime_priority = 0;
+    // Backend buffers, queues and mempool blocks come from the numa node of
+    // core_id
+    bool numa_local = true;
+    // Page size of the mempool slabs, see HugePages
+    HugePages huge_pages = HugePages::Off;
+    // What the backend does while the queues are empty
+    WaitStrategy wait_strategy = WaitStrategy::BusySpin;
+    // Entries in each producer thread's queue, rounded up to a power of two
+    std::size_t queue_capacity = 1 << 16;
+    // Backend threads, every Logger is handled by one of them so messages
+    // of one file stay in order while different files go in parallel
+    std::size_t worker_count = 1;
+    // How every Logger created after StartLogger writes its file
+    SinkType sink = SinkType::Sync;
+    // Publish Logger::Stats() into this POSIX shared memory object every
+    // stats_interval for tools like logstat, empty to not publish
+    std::string stats_shm_name;
+    std::chrono::nanoseconds stats_interval = std::chrono::seconds(1);
+    // SinkType::SharedMemory, name of the shared memory object logd attaches
+    // to and the bytes of ring each producer thread gets
+    std::string shm_name = "/logger_shm";
+    std::size_t shm_ring_size = 1 << 20;
+    // Every Logger created after StartLogger keeps its last
+    // flight_recorder_records messages in a FlightRecorder, 0 for none
+    std::size_t flight_recorder_records = 0;
+    // On SIGSEGV, SIGBUS, SIGABRT and SIGTERM the backend gets up to
+    // crash_flush_timeout to drain and flush as usual and up to 100ms to
+    // stop between two entries, then each Logger's flight recorder and
+    // whatever never left the write buffer go to <file>_<pid>_crash with
+    // write(2), with the number of messages still queued, and the signal is
+    // passed on to what was installed before
+    // Other threads that crash meanwhile wait for the first one
+    // Not for the SharedMemory sink, the rings outlive the process and logd
+    // keeps reading them
+    bool crash_handler = false;
+    std::chrono::nanoseconds crash_flush_timeout = std::chrono::seconds(1);
+    // Also renders the queued messages into the dump, with print and
+    // std::format inside the signal handler
+    // Not async signal safe, it deadlocks when the crashing thread holds the
+    // malloc lock, a SIGALRM watchdog then passes the signal on after
+    // crash_flush_timeout and the rest of the dump is lost
+    bool crash_dump_queued = false;
 };
 
 class Logger {
+    using LogQueue = SPSCQueue<DataForLog>;
+    static constexpr std::size_t max_producer_threads = 256;
+    static constexpr std::size_t max_workers = 16;
+    // Loggers the crash handler can find
+    static constexpr std::size_t max_live_loggers = 1024;
+    // Drop counts go into the log at most this often
+    static constexpr auto drop_report_interval = std::chrono::seconds(1);
+    // Backend counters are made visible to Stats at least this often
+    static constexpr unsigned long stats_batch = 1024;
+
+    // Queues of producer threads that exited are drained and handed to the
+    // next new producer thread
+    enum class QueueState : std::uint8_t {
+        // Being handed to a producer thread, the backend leaves it alone
+        Setup,
+        Used,
+        // The producer thread exited, the backend drains what is left
+        Retired,
+        // Drained, for the next producer thread that registers
+        Free,
+    };
+
+    // One backend thread and everything only it touches, producers have a
+    // queue per worker they log to
+    struct Worker {
+        std::atomic<std::size_t> queue_count{};
+        std::atomic<LogQueue*> queues[max_producer_threads]{};
+        std::atomic<QueueState> queue_states[max_producer_threads]{};
+        // Loggers written to since the queues last drained
+        std::vector<Logger*> flush_list;
+        // Set by Flush, the worker flushes its files at the end of the pass
+        // even though the queues have not drained
+        std::atomic<bool> flush_requested{};
+        // The worker is holding still for the crash handler
+        std::atomic<bool> crash_stopped{};
+        BackendWaiter waiter;
+        QueueSpaceWaiter space_waiter;
+        std::thread thread;
+        // Written by the worker once per pass, read by Stats
+        alignas(64) std::atomic<unsigned long> messages_written{};
+        std::atomic<unsigned long> bytes_written{};
+        std::atomic<unsigned long> backend_lag_ns{};
+        std::atomic<unsigned long> max_backend_lag_ns{};
+    };
+
    public:
-    explicit Logger(std::string_view filename_)
-        : filewrapper(filename_), message_count(0) {}
+    // Loggers are spread round robin over the workers StartLogger started
+    explicit Logger(
+        std::string_view filename_, const FileOptions& file_options = {},
+        BackpressurePolicy backpressure_ = BackpressurePolicy::SpinWait)
+        : filewrapper(filename_, file_options, sink_type),
+          binary(sink_type == SinkType::Binary
+                     ? std::make_unique<
+                           BinaryLogWriter<RegisteredLoggerTypes>>(
+                           filewrapper, file_options.segment_size)
+                     : nullptr),
+          worker(&workers[next_worker.fetch_add(1, std::memory_order_relaxed) %
+                          worker_count]),
+          backpressure(backpressure_),
+          shm_logger(use_shm ? RegisterShmLogger(filename_, file_options)
+                             : 0),
+          recorder(flight_records && !use_shm
+                       ? std::make_unique<FlightRecorder>(flight_records)
+                       : nullptr),
+          crash_path(filewrapper.filename + "crash"),
+          message_count(0) {
+        for (auto& live : live_loggers) {
+            Logger* empty = nullptr;
+            if (live.compare_exchange_strong(empty, this,
+                                             std::memory_order_release)) {
+                live_slot = &live;
+                break;
+            }
+        }
+    }
 
     ~Logger() noexcept {
-        while (message_count != 0);
+        // Queued entries point at this Logger, so however long it takes
+        while (!Flush(destructor_report_interval)) {
+            fprintf(stderr, "Logger: %s still has %ld messages queued\n",
+                    filewrapper.filename.c_str(),
+                    message_count.load(std::memory_order_relaxed));
+        }
+        if (live_slot) {
+            live_slot->store(nullptr, std::memory_order_release);
+        }
         printf("Logger Destructed Properly\n");
     }
 
@@ -134,14 +276,171 @@ class Logger {
     // Can do multi threading based logging
     static inline void StartLogger(bool start_thread = false,
                                    int _core_id = -1) noexcept {
-        RegisterLogDerivedTypes(mempool);
-        if (start_thread) {
-            mempool.Register<DataForLog>();
-            StartThreadProcessing(_core_id);
+        StartLogger(LoggerOptions{start_thread, _core_id});
+    }
+
+    static inline void StartLogger(const LoggerOptions& options) noexcept {
+        // Before anything is allocated so it all lands on the backend node
+        if (options.start_thread && options.numa_local &&
+            options.core_id >= 0) {
+            ThreadPlacement::memory_node.store(
+                ThreadPlacement::NumaNodeOfCpu(options.core_id),
+                std::memory_order_relaxed);
+        }
+        mempool.SetHugePages(options.huge_pages);
+        RegisteredLoggerTypes::Register(mempool);
+        TscClock::Calibrate();
+        sink_type = options.sink;
+        flight_records = options.flight_recorder_records;
+        if (sink_type == SinkType::SharedMemory) {
+            if (const int error = shm_region.Create(
+                    options.shm_name, options.shm_ring_size,
+                    max_producer_threads, shm_dictionary_size,
+                    RegisteredLoggerTypes::size)) {
+                fprintf(stderr, "Logger: shared memory %s failed (%s)\n",
+                        options.shm_name.c_str(), strerror(error));
+                sink_type = SinkType::Sync;
+            } else {
+                // logd does the rest, there is no backend here
+                shm_generation++;
+                shm_next_format = 1;
+                shm_next_logger = 0;
+                use_shm = true;
+                return;
+            }
+        }
+        queue_capacity = options.queue_capacity;
+        worker_count = std::clamp<std::size_t>(options.worker_count, 1,
+                                               max_workers);
+        if (options.crash_handler) {
+            crash_flush_timeout = options.crash_flush_timeout;
+            crash_dump_queued = options.crash_dump_queued;
+            CrashSignals::Install(OnCrashSignal);
+            CrashSignals::UseAltStack();
+        }
+        if (options.start_thread) {
+            stats_interval = options.stats_interval;
+            if (!options.stats_shm_name.empty()) {
+                if (const int error =
+                        shared_stats.Create(options.stats_shm_name)) {
+                    fprintf(stderr, "Logger: stats in %s failed (%s)\n",
+                            options.stats_shm_name.c_str(), strerror(error));
+                }
+            }
+            StartThreadProcessing(options);
+            printf("%s\n", placement_report.c_str());
         }
     }
 
-    static inline void StopLogger() noexcept { StopThreadProcessing(); }
+    // Call on every producer thread after StartLogger and before its
+    // latency matters, fills the thread's mempool free lists for every
+    // registered type and creates its queue to every worker, or claims its
+    // shared memory ring, all prefaulted, so the first messages take no
+    // page faults and no slow paths, and with the crash handler gives the
+    // thread a stack to run it on
+    static inline void Warmup() noexcept {
+        RegisteredLoggerTypes::Register(mempool);
+        if (CrashSignals::Installed()) {
+            CrashSignals::UseAltStack();
+        }
+        if (use_shm) {
+            ShmProducerRing().Prefault();
+            return;
+        }
+        if (use_thread && !producer_exiting) {
+            for (std::size_t i = 0; i < worker_count; i++) {
+                GetProducerQueue(workers[i]);
+            }
+        }
+    }
+
+    // Waits until every message logged to this Logger so far has left the
+    // queues and the write buffer has been handed to the file, false when
+    // that did not happen within timeout
+    // Messages other threads log meanwhile count too, a Logger that never
+    // stops getting messages never drains, not for the backend thread
+    // Without a backend thread the buffer is written right away, call it
+    // from the thread that logs
+    inline bool Flush(const std::chrono::nanoseconds timeout =
+                          std::chrono::seconds(5)) noexcept {
+        return FlushUntil(std::chrono::steady_clock::now() + timeout);
+    }
+
+    // Flush of every Logger with one deadline, not while Loggers are being
+    // created or destroyed
+    static inline bool FlushAll(
+        const std::chrono::nanoseconds timeout) noexcept {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        bool flushed = true;
+        for (auto& live : live_loggers) {
+            if (auto logger = live.load(std::memory_order_acquire)) {
+                flushed &= logger->FlushUntil(deadline);
+            }
+        }
+        return flushed;
+    }
+
+    // Messages dropped by the backpressure policy so far
+    inline unsigned long DroppedMessages() const noexcept {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+    // What StartLogger managed to apply to the backend threads, a line per
+    // worker
+    static inline const std::string& PlacementReport() noexcept {
+        return placement_report;
+    }
+
+    static inline void StopLogger() noexcept {
+        StopThreadProcessing();
+        CrashSignals::Restore();
+        shared_stats.Close();
+        if (use_shm) {
+            use_shm = false;
+            shm_region.Header().stopped.store(1, std::memory_order_release);
+            shm_region.Close();
+        }
+    }
+
+    // Every Logger in the process, cheap enough to poll but not meant for
+    // the hot path, messages and bytes only count what went through a
+    // backend thread
+    static inline LoggerStats Stats() noexcept {
+        LoggerStats stats{};
+        stats.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now().time_since_epoch())
+                            .count();
+        stats.messages_dropped = total_dropped.load(std::memory_order_relaxed);
+        stats.workers = worker_count;
+        for (std::size_t i = 0; i < worker_count; i++) {
+            auto& worker = workers[i];
+            stats.messages_written +=
+                worker.messages_written.load(std::memory_order_relaxed);
+            stats.bytes_written +=
+                worker.bytes_written.load(std::memory_order_relaxed);
+            stats.backend_lag_ns = std::max<std::uint64_t>(
+                stats.backend_lag_ns,
+                worker.backend_lag_ns.load(std::memory_order_relaxed));
+            stats.max_backend_lag_ns = std::max<std::uint64_t>(
+                stats.max_backend_lag_ns,
+                worker.max_backend_lag_ns.load(std::memory_order_relaxed));
+            const auto number_of_queues =
+                std::min(worker.queue_count.load(std::memory_order_acquire),
+                         max_producer_threads);
+            for (std::size_t j = 0; j < number_of_queues; j++) {
+                auto queue = worker.queues[j].load(std::memory_order_acquire);
+                if (queue) {
+                    stats.queue_depth += queue->Size();
+                    stats.queue_capacity += queue->Capacity();
+                }
+            }
+        }
+        stats.pool_in_use = mempool.InUse();
+        stats.pool_slots = mempool.Slots();
+        stats.rotations =
+            FileWrapper::rotations.load(std::memory_order_relaxed);
+        return stats;
+    }
 
 #ifdef LATENCY_FINDING
     static inline void PrintLatencies() noexcept {
@@ -162,14 +461,36 @@ class Logger {
 #ifdef LATENCY_FINDING
         LatencyProfilingHelper l(latency_1);
 #endif
-        if (use_thread) {
-            sp.lock();
+        return mempool.allocate<T>();
+    }
+
+    // Same with a level, nullptr when the level is compiled out or below
+    // the logger's threshold, Log with a level skips a nullptr
+    // auto data = Logger::getObj<LogLevel::Debug, LoggerType1>(&logger);
+    template <LogLevel level, HasPrintMethod T>
+    static inline T* getObj(Logger* logger) noexcept {
+        if (!logger->ShouldLog<level>()) {
+            return nullptr;
         }
-        auto pointer = mempool.allocate<T>();
-        if (use_thread) {
-            sp.unlock();
+        return getObj<T>();
+    }
+
+    // Runtime threshold, can be changed from any thread while logging
+    inline void SetLevel(const LogLevel level) noexcept {
+        threshold.store(level, std::memory_order_relaxed);
+    }
+
+    inline LogLevel Level() const noexcept {
+        return threshold.load(std::memory_order_relaxed);
+    }
+
+    template <LogLevel level>
+    inline bool ShouldLog() const noexcept {
+        if constexpr (!level_compiled_in<level>) {
+            return false;
+        } else {
+            return level >= threshold.load(std::memory_order_relaxed);
         }
-        return pointer;
     }
 
     // After the values for the print object has been assigned
@@ -179,117 +500,1019 @@ class Logger {
     // (from where the obj is passed to logger)
     // whether to print new line or not
     // pointer that has been taken for the printing purpose
+    // The call site is looked up in a per thread cache on every call, with
+    // constant flags LOGGER_CALLSITE below skips that
     template <HasPrintMethod T>
     static inline void Log(Logger* logger, bool log_time_, bool log_location_,
                            bool new_line_, T* data,
                            const std::source_location& location =
                                std::source_location::current()) noexcept {
+        Log(logger,
+            CallSiteRegistry::InternCached(location, log_time_, log_location_,
+                                           new_line_),
+            data);
+    }
+
+    // Same as above with the call site interned up front, skips the lookup
+    // Logger::Log(&logger, LOGGER_CALLSITE(true, true, true), data);
+    template <HasPrintMethod T>
+    static inline void Log(Logger* logger, const CallSiteId call_site,
+                           T* data) noexcept {
 #ifdef LATENCY_FINDING
         LatencyProfilingHelper l(latency_2);
 #endif
-        logger->message_count++;
+        if (use_shm) {
+            ShmLogObject(logger, call_site, *data);
+            mempool.deallocate(data);
+            return;
+        }
+        logger->message_count.fetch_add(1, std::memory_order_relaxed);
         if (use_thread) {
-            sp.lock();
-            auto pointer = mempool.allocate<DataForLog>(
-                logger, getType<T>(), data, log_time_, log_location_, new_line_,
-                location);
-            log_queue.push_back(pointer);
-            sp.unlock();
+            if (!Enqueue(logger, RegisteredLoggerTypes::id<T>, data, nullptr,
+                         call_site)) {
+                mempool.deallocate(data);
+            }
         } else {
-            DataForLog data_log(logger, getType<T>(), data, log_time_,
-                                log_location_, new_line_, location);
-            logger->LogHelper(&data_log);
+            DataForLog data_log(logger, RegisteredLoggerTypes::id<T>, data,
+                                nullptr, call_site);
+            logger->LogDirect(&data_log);
             mempool.deallocate(data);
         }
     }
 
+    // Log with a level, data from getObj<level, T>
+    // Logger::Log<LogLevel::Info>(&logger, true, false, true, data);
+    template <LogLevel level, HasPrintMethod T>
+    static inline void Log(Logger* logger, bool log_time_, bool log_location_,
+                           bool new_line_, T* data,
+                           const std::source_location& location =
+                               std::source_location::current()) noexcept {
+        if constexpr (level_compiled_in<level>) {
+            if (data) {
+                Log(logger,
+                    LevelCallSiteId<level>{CallSiteRegistry::InternCached(
+                        location, log_time_, log_location_, new_line_,
+                        level)},
+                    data);
+            }
+        }
+    }
+
+    // Logger::Log(&logger,
+    //             LOGGER_LEVEL_CALLSITE(LogLevel::Info, true, true, true),
+    //             data);
+    template <LogLevel level, HasPrintMethod T>
+    static inline void Log(Logger* logger,
+                           const LevelCallSiteId<level> call_site,
+                           T* data) noexcept {
+        if constexpr (level_compiled_in<level>) {
+            if (!data) {
+                return;
+            }
+            // The threshold may have changed since getObj
+            if (!logger->ShouldLog<level>()) {
+                mempool.deallocate(data);
+                return;
+            }
+            Log(logger, call_site.id, data);
+        }
+    }
+
+    // printf style logging without a getObj
+    // Only the raw argument bytes are copied on the calling thread, the
+    // std::format runs on the backend thread
+    // The format string is checked against the arguments at compile time
+    // Logs with time and a new line, arguments have to be trivially copyable
+    // values (no pointers, arrays or string_views) and fit in
+    // DataForLog::payload_capacity bytes
+    // Logger::LogFmt<"order {} filled at {}">(&logger, id, price);
+    template <FixedString format, DeferredFormatArg... Args>
+    static inline void LogFmt(Logger* logger, const Args&... args) noexcept {
+        static const CallSiteId call_site =
+            CallSiteRegistry::Intern(std::source_location{}, true, false, true);
+        LogFmt<format>(logger, call_site, args...);
+    }
+
+    // With flags and location of your choice
+    // Logger::LogFmt<"order {}">(&logger, LOGGER_CALLSITE(true, true, true),
+    //                            id);
+    template <FixedString format, DeferredFormatArg... Args>
+    static inline void LogFmt(Logger* logger, const CallSiteId call_site,
+                              const Args&... args) noexcept {
+        using Holder = FormatDescriptorHolder<format, Args...>;
+        static_assert(packed_args_size<Args...> <= DataForLog::payload_capacity,
+                      "Arguments too large for LogFmt");
+        static_cast<void>(Holder::checked);
+#ifdef LATENCY_FINDING
+        LatencyProfilingHelper l(latency_2);
+#endif
+        if (use_shm) {
+            ShmLogFormat<Holder>(logger, call_site, args...);
+            return;
+        }
+        logger->message_count.fetch_add(1, std::memory_order_relaxed);
+        if (use_thread) {
+            Enqueue(logger, &Holder::descriptor, call_site, args...);
+        } else {
+            DataForLog data_log(logger, &Holder::descriptor, call_site,
+                                args...);
+            logger->LogDirect(&data_log);
+        }
+    }
+
+    // Logger::LogFmt<"order {}">(
+    //     &logger, LOGGER_LEVEL_CALLSITE(LogLevel::Info, true, false, true),
+    //     id);
+    template <FixedString format, LogLevel level, DeferredFormatArg... Args>
+    static inline void LogFmt(Logger* logger,
+                              const LevelCallSiteId<level> call_site,
+                              const Args&... args) noexcept {
+        if constexpr (level_compiled_in<level>) {
+            if (logger->ShouldLog<level>()) {
+                LogFmt<format>(logger, call_site.id, args...);
+            }
+        }
+    }
+
+    // Log without a getObj, the object is built from args straight inside the
+    // queue entry so there is no mempool allocation or free
+    // Types larger than DataForLog::payload_capacity fall back to the mempool
+    // Logger::LogEmplace<LoggerType2>(
+    //     &logger, LOGGER_CALLSITE(true, false, true), 1, 'a');
+    template <HasPrintMethod T, typename... Args>
+    static inline void LogEmplace(Logger* logger, const CallSiteId call_site,
+                                  Args&&... args) noexcept {
+        if constexpr (!DataForLog::fits_inline<T>) {
+            Log(logger, call_site,
+                mempool.allocate<T>(std::forward<Args>(args)...));
+        } else {
+#ifdef LATENCY_FINDING
+            LatencyProfilingHelper l(latency_2);
+#endif
+            if (use_shm) {
+                ShmLogObject(logger, call_site,
+                             T(std::forward<Args>(args)...));
+                return;
+            }
+            logger->message_count.fetch_add(1, std::memory_order_relaxed);
+            if (use_thread) {
+                Enqueue(logger, std::in_place_type<T>, call_site,
+                        std::forward<Args>(args)...);
+            } else {
+                DataForLog data_log(logger, std::in_place_type<T>, call_site,
+                                    std::forward<Args>(args)...);
+                logger->LogDirect(&data_log);
+                RegisteredLoggerTypes::Destroy(data_log.logger_type,
+                                               data_log.pointer);
+            }
+        }
+    }
+
+    template <HasPrintMethod T, LogLevel level, typename... Args>
+    static inline void LogEmplace(Logger* logger,
+                                  const LevelCallSiteId<level> call_site,
+                                  Args&&... args) noexcept {
+        if constexpr (level_compiled_in<level>) {
+            if (logger->ShouldLog<level>()) {
+                LogEmplace<T>(logger, call_site.id,
+                              std::forward<Args>(args)...);
+            }
+        }
+    }
+
    private:
     inline void LogHelper(DataForLog* data_log) noexcept {
-        std::string s;
-        if (data_log->log_time) {
-            s += std::format("[{}] ", data_log->time_now);
-        }
-        if (data_log->log_location) {
-            s += std::format("[{} {} {}] ", data_log->location.file_name(),
-                             data_log->location.function_name(),
-                             data_log->location.line());
-        }
-        std::string data_to_actually_print;
-        PrintType(data_log->logger_type, data_log->pointer,
-                  &data_to_actually_print);
-        s += data_to_actually_print;
-        if (data_log->new_line) {
-            s += '\n';
-        }
-        filewrapper.WritetoFile(s);
-        message_count--;
-    }
-    static void* Process(void*) noexcept {
-        int size_of_the_queue = 0;
+        if (binary) {
+            if (data_log->format) {
+                binary->WriteFormat(data_log->call_site, *data_log->format,
+                                    data_log->payload, data_log->time_now);
+            } else {
+                binary->WriteObject(data_log->call_site, data_log->logger_type,
+                                    data_log->pointer, data_log->time_now);
+            }
+            if (recorder) [[unlikely]] {
+                RenderMessage(data_log, data_to_actually_print);
+                Record(data_log);
+            }
+            message_count.fetch_sub(1, std::memory_order_release);
+            return;
+        }
+        const auto& call_site = CallSiteRegistry::Get(data_log->call_site);
+        filewrapper.BeginMessage();
+        if (call_site.log_time) {
+            filewrapper.Append('[');
+            filewrapper.Append(timestamp_formatter.Format(
+                TscClock::ToEpochNanos(data_log->time_now)));
+            filewrapper.Append("] ", 2);
+        }
+        filewrapper.Append(LevelPrefix(call_site.level));
+        if (call_site.log_location) {
+            filewrapper.Append(LocationPrefix(data_log->call_site));
+        }
+        RenderMessage(data_log, data_to_actually_print);
+        filewrapper.Append(data_to_actually_print.View());
+        if (call_site.new_line) {
+            filewrapper.Append('\n');
+        }
+        if (recorder) [[unlikely]] {
+            Record(data_log);
+        }
+        message_count.fetch_sub(1, std::memory_order_release);
+    }
+
+    // What print or the format makes of the entry, without time, level and
+    // location
+    static inline void RenderMessage(const DataForLog* data_log,
+                                     LogBuffer& out) noexcept {
+        out.Clear();
+        if (data_log->format) {
+            data_log->format->render(data_log->payload, out);
+        } else {
+            RegisteredLoggerTypes::Print(data_log->logger_type,
+                                         data_log->pointer, out);
+        }
+    }
+
+    // The rendered message into the flight recorder
+    inline void Record(const DataForLog* data_log) noexcept {
+        recorder->Add(TscClock::ToEpochNanos(data_log->time_now),
+                      data_log->call_site, data_to_actually_print.View());
+    }
+
+    // Waits for message_count, then asks the worker to flush if this
+    // Logger's buffer has not been flushed since
+    inline bool FlushUntil(
+        const std::chrono::steady_clock::time_point deadline) noexcept {
+        if (!use_thread) {
+            if (!use_shm) {
+                filewrapper.Flush();
+            }
+            return true;
+        }
+        const auto wait = [deadline](auto&& done) {
+            while (!done()) {
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    return false;
+                }
+                std::this_thread::yield();
+            }
+            return true;
+        };
+        if (!wait([this] {
+                return message_count.load(std::memory_order_acquire) == 0;
+            })) {
+            return false;
+        }
+        if (!flush_pending.load(std::memory_order_acquire)) {
+            return true;
+        }
+        worker->flush_requested.store(true, std::memory_order_release);
+        worker->waiter.Wake();
+        return wait([this] {
+            return !flush_pending.load(std::memory_order_acquire);
+        });
+    }
+
+    // Whether the crash handler can read the buffer and the queues, no
+    // backend is moving them
+    inline bool HoldsStill() const noexcept {
+        return !use_thread || worker == current_worker ||
+               worker->crash_stopped.load(std::memory_order_acquire);
+    }
+
+    // Backend side, waits between two entries while the crash handler reads
+    // the queues and buffers
+    static inline void StopForCrash(Worker& worker) noexcept {
+        worker.crash_stopped.store(true, std::memory_order_release);
+        while (crash_stop.load(std::memory_order_acquire)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        worker.crash_stopped.store(false, std::memory_order_relaxed);
+    }
+
+    // Crash handler, in Logger.cpp
+    static void OnCrashSignal(int signal) noexcept;
+    static void WriteCrashDumps(int signal) noexcept;
+    void WriteCrashDump(int signal) noexcept;
+    void WriteQueuedEntries() noexcept;
+
+    // Writes how many messages were dropped since the last report
+    inline void ReportDrops(const std::chrono::steady_clock::time_point now,
+                            const bool force = false) noexcept {
+        const auto dropped_ = dropped.load(std::memory_order_relaxed);
+        if (dropped_ == dropped_reported ||
+            (!force && now < next_drop_report)) {
+            return;
+        }
+        if (binary) {
+            binary->WriteText(no_call_site,
+                              std::format("Logger dropped {} messages",
+                                          dropped_ - dropped_reported),
+                              TscClock::Now());
+        } else {
+            filewrapper.BeginMessage();
+            filewrapper.Append('[');
+            filewrapper.Append(timestamp_formatter.Format(
+                TscClock::ToEpochNanos(TscClock::Now())));
+            filewrapper.AppendFormatted("] Logger dropped {} messages\n",
+                                        dropped_ - dropped_reported);
+        }
+        dropped_reported = dropped_;
+        next_drop_report = now + drop_report_interval;
+    }
+
+    // "[file function line] " rendered once per call site per thread
+    static inline std::string_view LocationPrefix(
+        const CallSiteId call_site) noexcept {
+        thread_local std::vector<std::string> prefixes;
+        if (call_site.value >= prefixes.size()) {
+            prefixes.resize(call_site.value + 1);
+        }
+        auto& prefix = prefixes[call_site.value];
+        if (prefix.empty()) {
+            const auto& location = CallSiteRegistry::Get(call_site).location;
+            prefix = std::format("[{} {} {}] ", location.file_name(),
+                                 location.function_name(), location.line());
+        }
+        return prefix;
+    }
+
+    // Without the backend thread there is nobody to notice the queue
+    // draining, so only the buffer filling up and the interval flush
+    inline void LogDirect(DataForLog* data_log) noexcept {
+        TscClock::MaybeResync(TscClock::Now());
+        LogHelper(data_log);
+        filewrapper.FlushIfDue(std::chrono::steady_clock::now());
+    }
+
+    // Backend keeps the loggers it has written to since the last time the
+    // queues drained
+    static inline void AddToFlushList(Worker& worker, Logger* logger) noexcept {
+        if (!logger->flush_pending.load(std::memory_order_relaxed)) {
+            logger->flush_pending.store(true, std::memory_order_relaxed);
+            worker.flush_list.push_back(logger);
+        }
+    }
+
+    // final reports drops regardless of the interval
+    static inline void FlushPendingFiles(Worker& worker,
+                                         const bool final = false) noexcept {
+        // Before the files, a Flush asking meanwhile gets another round
+        worker.flush_requested.store(false, std::memory_order_relaxed);
+        const auto now = std::chrono::steady_clock::now();
+        for (auto logger : worker.flush_list) {
+            logger->ReportDrops(now, final);
+            logger->filewrapper.Flush();
+            logger->flush_pending.store(false, std::memory_order_release);
+        }
+        worker.flush_list.clear();
+    }
+
+    // SharedMemory sink, the record goes straight into this thread's ring
+    // PlainBytes objects travel as bytes and logd prints them, anything else
+    // is printed here
+    template <HasPrintMethod T>
+    static inline void ShmLogObject(Logger* logger, const CallSiteId call_site,
+                                    const T& object) noexcept {
+        if constexpr (PlainBytes<T>) {
+            ShmWrite(logger, call_site, ShmRecordKind::Object,
+                     RegisteredLoggerTypes::id<T>, 0, sizeof(T),
+                     [&](unsigned char* payload) {
+                         std::memcpy(payload, &object, sizeof(T));
+                     });
+        } else {
+            thread_local LogBuffer text;
+            text.Clear();
+            PrintObject(object, text);
+            ShmLogText(logger, call_site, text.View());
+        }
+    }
+
+    // Arguments logd can not decode from type codes are formatted here
+    template <typename Holder, typename... Args>
+    static inline void ShmLogFormat(Logger* logger, const CallSiteId call_site,
+                                    const Args&... args) noexcept {
+        if constexpr (format_args_coded<Args...>) {
+            const auto format = ShmFormatId<Holder, Args...>();
+            if (!format) {
+                ShmDrop(logger);
+                return;
+            }
+            ShmWrite(logger, call_site, ShmRecordKind::Format, 0, format,
+                     packed_args_size<Args...>, [&](unsigned char* payload) {
+                         PackFormatArgs(payload, args...);
+                     });
+        } else {
+            unsigned char packed[packed_args_size<Args...>];
+            PackFormatArgs(packed, args...);
+            thread_local LogBuffer text;
+            text.Clear();
+            Holder::Render(packed, text);
+            ShmLogText(logger, call_site, text.View());
+        }
+    }
+
+    // Cut short if it does not fit in a record
+    static inline void ShmLogText(Logger* logger, const CallSiteId call_site,
+                                  std::string_view text) noexcept {
+        text = text.substr(0, ShmProducerRing().MaxRecord() -
+                                  sizeof(ShmRecord));
+        ShmWrite(logger, call_site, ShmRecordKind::Text, 0, 0, text.size(),
+                 [&](unsigned char* payload) {
+                     std::memcpy(payload, text.data(), text.size());
+                 });
+    }
+
+    template <typename Fill>
+    static inline void ShmWrite(Logger* logger, const CallSiteId call_site,
+                                const ShmRecordKind kind,
+                                const std::uint16_t type,
+                                const std::uint32_t format,
+                                const std::size_t payload_size,
+                                Fill&& fill) noexcept {
+        const auto tsc = TscClock::Now();
+        auto& ring = ShmProducerRing();
+        const auto size = (sizeof(ShmRecord) + payload_size + 7) / 8 * 8;
+        if (size > ring.MaxRecord() || !PublishShmCallSite(call_site)) {
+            ShmDrop(logger);
+            return;
+        }
+        unsigned char* slot;
+        while (!(slot = ring.Reserve(size))) {
+            // Entries already in shared memory belong to logd, there is
+            // nothing to overwrite
+            if (logger->backpressure == BackpressurePolicy::DropNewest ||
+                logger->backpressure == BackpressurePolicy::OverwriteOldest) {
+                ShmDrop(logger);
+                return;
+            }
+            if (logger->backpressure == BackpressurePolicy::Block) {
+                std::this_thread::yield();
+            } else {
+                CpuRelax();
+            }
+        }
+        auto record = new (slot) ShmRecord{
+            static_cast<std::uint32_t>(size),
+            kind,
+            type,
+            call_site.value,
+            logger->shm_logger,
+            format,
+            static_cast<std::uint32_t>(payload_size),
+            tsc};
+        fill(reinterpret_cast<unsigned char*>(record + 1));
+        ring.Commit();
+    }
+
+    static inline void ShmDrop(Logger* logger) noexcept {
+        logger->dropped.fetch_add(1, std::memory_order_relaxed);
+        total_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Each producer thread claims a ring of the region on its first log
+    static inline ShmByteRing& ShmProducerRing() noexcept {
+        thread_local std::uint32_t generation = 0;
+        thread_local ShmByteRing ring;
+        if (generation != shm_generation) [[unlikely]] {
+            ring = ClaimShmRing(generation);
+        }
+        return ring;
+    }
+
+    // A ring of a thread that exited or else a new one, given up again when
+    // the calling thread exits
+    static inline ShmByteRing ClaimShmRing(std::uint32_t& generation) noexcept {
+        struct Exit {
+            ShmByteRing ring;
+            std::uint32_t* generation{};
+            ~Exit() noexcept {
+                if (generation && use_shm && *generation == shm_generation) {
+                    ring.Disown();
+                    // A Log from a later thread_local destructor claims again
+                    *generation = 0;
+                }
+            }
+        };
+        thread_local Exit exit;
+        auto& header = shm_region.Header();
+        while (true) {
+            const auto ring_count =
+                std::min(header.ring_count.load(std::memory_order_acquire),
+                         header.max_rings);
+            auto index = ring_count;
+            for (std::uint32_t i = 0; i < ring_count; i++) {
+                if (shm_region.Ring(i).TryOwn()) {
+                    index = i;
+                    break;
+                }
+            }
+            if (index == ring_count) {
+                index =
+                    header.ring_count.fetch_add(1, std::memory_order_acq_rel);
+                if (index >= header.max_rings) {
+                    fprintf(stderr,
+                            "Logger: more than %u live producer threads\n",
+                            header.max_rings);
+                    std::abort();
+                }
+                // A thread that scanned meanwhile may have taken it
+                if (!shm_region.Ring(index).TryOwn()) {
+                    continue;
+                }
+            }
+            exit.ring = shm_region.Ring(index);
+            exit.generation = &generation;
+            generation = shm_generation;
+            return exit.ring;
+        }
+    }
+
+    // Dictionary entries are written before the first record using them
+    static inline bool PublishShmCallSite(const CallSiteId call_site) noexcept {
+        auto& published = shm_call_sites[call_site.value];
+        if (published.load(std::memory_order_acquire) == shm_generation)
+            [[likely]] {
+            return true;
+        }
+        std::lock_guard guard(shm_dictionary_lock);
+        if (published.load(std::memory_order_relaxed) == shm_generation) {
+            return true;
+        }
+        const auto& site = CallSiteRegistry::Get(call_site);
+        std::uint64_t fields[4];
+        CallSiteDictFields(site, fields);
+        if (!shm_region.AddDictEntry(LogDictKind::CallSite, call_site.value,
+                                     fields, site.location.file_name(),
+                                     site.location.function_name())) {
+            return false;
+        }
+        published.store(shm_generation, std::memory_order_release);
+        return true;
+    }
+
+    // 0 when the dictionary is full
+    template <typename Holder, typename... Args>
+    static inline std::uint32_t ShmFormatId() noexcept {
+        // Generation in the upper half
+        static std::atomic<std::uint64_t> published{};
+        auto value = published.load(std::memory_order_acquire);
+        if (value >> 32 == shm_generation) [[likely]] {
+            return static_cast<std::uint32_t>(value);
+        }
+        std::lock_guard guard(shm_dictionary_lock);
+        value = published.load(std::memory_order_relaxed);
+        if (value >> 32 == shm_generation) {
+            return static_cast<std::uint32_t>(value);
+        }
+        const auto id = shm_next_format;
+        const std::uint64_t fields[4] = {sizeof...(Args), 0, 0, 0};
+        if (!shm_region.AddDictEntry(
+                LogDictKind::Format, id, fields,
+                {reinterpret_cast<const char*>(Holder::arg_types),
+                 sizeof...(Args)},
+                Holder::descriptor.format)) {
+            return 0;
+        }
+        shm_next_format++;
+        published.store(static_cast<std::uint64_t>(shm_generation) << 32 | id,
+                        std::memory_order_release);
+        return id;
+    }
+
+    static inline std::uint32_t RegisterShmLogger(
+        std::string_view filename, const FileOptions& options) noexcept {
+        std::lock_guard guard(shm_dictionary_lock);
+        const auto id = shm_next_logger++;
+        const std::uint64_t fields[4] = {
+            options.buffer_size, options.segment_size,
+            static_cast<std::uint64_t>(options.flush_interval.count()),
+            options.direct_io |
+                static_cast<std::uint64_t>(options.compression) << 8 |
+                static_cast<std::uint64_t>(options.compression_thread) << 16};
+        if (!shm_region.AddDictEntry(LogDictKind::Logger, id, fields,
+                                     filename)) {
+            fprintf(stderr, "Logger: shared memory dictionary full\n");
+        }
+        return id;
+    }
+
+    // Returns false when the message was dropped, the caller then still
+    // owns whatever the entry would have pointed to
+    // args are forwarded to every attempt, TryEmplace only touches them once
+    // it has a slot
+    template <typename... Args>
+    static inline bool Enqueue(Logger* logger, Args&&... args) noexcept {
+        auto& queue = GetProducerQueue(
+            *logger->worker,
+            logger->backpressure == BackpressurePolicy::OverwriteOldest);
+        if (!queue.TryEmplace(logger, std::forward<Args>(args)...) &&
+            !EnqueueFull(queue, logger, std::forward<Args>(args)...)) {
+            logger->dropped.fetch_add(1, std::memory_order_relaxed);
+            total_dropped.fetch_add(1, std::memory_order_relaxed);
+            logger->message_count.fetch_sub(1, std::memory_order_release);
+            return false;
+        }
+        if (producer_exiting) [[unlikely]] {
+            RetireProducerQueues();
+        }
+        logger->worker->waiter.Notify();
+        return true;
+    }
+
+    template <typename... Args>
+    static inline bool EnqueueFull(LogQueue& queue, Logger* logger,
+                                   Args&&... args) noexcept {
+        switch (logger->backpressure) {
+            case BackpressurePolicy::Block:
+                logger->worker->space_waiter.Wait([&] {
+                    return queue.TryEmplace(logger,
+                                            std::forward<Args>(args)...);
+                });
+                return true;
+            case BackpressurePolicy::SpinWait:
+                while (!queue.TryEmplace(logger, std::forward<Args>(args)...)) {
+                    CpuRelax();
+                }
+                return true;
+            case BackpressurePolicy::DropNewest:
+                return false;
+            case BackpressurePolicy::OverwriteOldest:
+                return queue.StealFront(
+                           [logger](const DataForLog* data_log) {
+                               return data_log->logger_pointer == logger;
+                           },
+                           DiscardEntry) &&
+                       queue.TryEmplace(logger, std::forward<Args>(args)...);
+        }
+        return false;
+    }
+
+    // Entry taken back out of the queue by OverwriteOldest
+    static inline void DiscardEntry(DataForLog* data_log) noexcept {
+        if (data_log->in_place) {
+            RegisteredLoggerTypes::Destroy(data_log->logger_type,
+                                           data_log->pointer);
+        } else if (!data_log->format) {
+            RegisteredLoggerTypes::Deallocate(mempool, data_log->logger_type,
+                                              data_log->pointer);
+        }
+        auto logger = data_log->logger_pointer;
+        logger->dropped.fetch_add(1, std::memory_order_relaxed);
+        total_dropped.fetch_add(1, std::memory_order_relaxed);
+        logger->message_count.fetch_sub(1, std::memory_order_release);
+    }
+
+    // Consumer side, whether any of the worker's queues has an entry
+    static inline bool HasPendingEntries(Worker& worker) noexcept {
+        const auto number_of_queues =
+            std::min(worker.queue_count.load(std::memory_order_acquire),
+                     max_producer_threads);
+        for (std::size_t i = 0; i < number_of_queues; i++) {
+            auto queue = worker.queues[i].load(std::memory_order_acquire);
+            if (queue && !queue->Empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Each producer thread gets its own queue for a worker on its first Log
+    // call to a Logger of that worker, and a stealable one on its first to
+    // an OverwriteOldest Logger
+    static inline LogQueue& GetProducerQueue(
+        Worker& worker, const bool stealable = false) noexcept {
+        thread_local LogQueue* thread_queues[max_workers][2]{};
+        auto& queue = thread_queues[&worker - workers][stealable];
+        if (!queue) [[unlikely]] {
+            RegisterProducerQueue(worker, stealable, queue);
+        }
+        return *queue;
+    }
+    // Sets queue to a free queue of the worker or a new one, it goes back
+    // to the worker when the calling thread exits, or right after the entry
+    // once the thread's exit has begun
+    static void RegisterProducerQueue(Worker& worker, bool stealable,
+                                      LogQueue*& queue) noexcept;
+    // Hands the calling thread's queues back to their workers
+    static void RetireProducerQueues() noexcept;
+    struct ProducerQueues;
+    struct ProducerExit;
+
+    // Drains every producer queue of the worker, no lock is taken on the
+    // queues themselves
+    static void Process(Worker& worker) noexcept {
+#ifdef LATENCY_FINDING
+        auto& pop_latency = latency_3.local();
+        auto& write_latency = latency_4.local();
+        auto& deallocate_latency = latency_5.local();
+#endif
+        unsigned long processed = 0;
+        bool running = true;
+        // Worker 0 also keeps the shared memory stats up to date
+        const bool publishes = &worker == workers && shared_stats.IsOpen();
+        auto next_publish = std::chrono::steady_clock::now();
         do {
+            // Read before the pass, so the last pass after StopLogger sees
+            // everything logged before it
+            running = run.load(std::memory_order_acquire);
+            if (crash_stop.load(std::memory_order_relaxed)) [[unlikely]] {
+                StopForCrash(worker);
+            }
+            processed = 0;
+            unsigned long appended = 0;
+            auto oldest = std::numeric_limits<std::uint64_t>::max();
+            TscClock::MaybeResync(TscClock::Now());
+            const auto number_of_queues =
+                std::min(worker.queue_count.load(std::memory_order_acquire),
+                         max_producer_threads);
+            for (std::size_t i = 0; i < number_of_queues; i++) {
+                // Before the queue, a Retired queue is then drained for good
+                // when Claim comes up empty
+                const auto state =
+                    worker.queue_states[i].load(std::memory_order_acquire);
+                auto queue = worker.queues[i].load(std::memory_order_acquire);
+                if (!queue || state == QueueState::Setup ||
+                    state == QueueState::Free) {
+                    continue;
+                }
+                while (true) {
 #ifdef LATENCY_FINDING
-            latency_3.start();
+                    pop_latency.start();
 #endif
-            sp.lock();
-            size_of_the_queue = log_queue.size();
-            if (size_of_the_queue) {
-                DataForLog* data_log = log_queue.front();
-                log_queue.pop_front();
-                sp.unlock();
+                    DataForLog* data_log = queue->Claim();
+                    if (!data_log) {
+                        break;
+                    }
 #ifdef LATENCY_FINDING
-                latency_3.end();
-                latency_4.start();
+                    pop_latency.end();
+                    write_latency.start();
 #endif
-                data_log->logger_pointer->LogHelper(data_log);
+                    auto logger = data_log->logger_pointer;
+                    auto& filewrapper = logger->filewrapper;
+                    AddToFlushList(worker, logger);
+                    const auto appended_before = filewrapper.Appended();
+                    logger->LogHelper(data_log);
+                    appended += filewrapper.Appended() - appended_before;
+                    oldest = std::min(oldest, data_log->time_now);
 #ifdef LATENCY_FINDING
-                latency_4.end();
-                latency_5.start();
+                    write_latency.end();
+                    deallocate_latency.start();
 #endif
-                sp.lock();
-                DellocateFromMempool(mempool, data_log->logger_type,
-                                     data_log->pointer);
-                mempool.deallocate(data_log);
-            }
-            sp.unlock();
+                    if (data_log->in_place) {
+                        RegisteredLoggerTypes::Destroy(data_log->logger_type,
+                                                       data_log->pointer);
+                    } else if (!data_log->format) {
+                        RegisteredLoggerTypes::Deallocate(
+                            mempool, data_log->logger_type, data_log->pointer);
+                    }
+                    data_log->~DataForLog();
+                    queue->Release();
+                    processed++;
+                    // A pass lasts as long as producers keep up with it
+                    if (processed % stats_batch == 0) {
+                        if (crash_stop.load(std::memory_order_relaxed)) {
+                            StopForCrash(worker);
+                        }
+                        PublishPass(worker, stats_batch, appended, oldest);
+                        appended = 0;
+                        oldest = std::numeric_limits<std::uint64_t>::max();
+                        if (publishes) {
+                            MaybePublishStats(next_publish);
+                        }
+                    }
 #ifdef LATENCY_FINDING
-            latency_5.end();
+                    deallocate_latency.end();
 #endif
-        } while (run || size_of_the_queue);
-        return nullptr;
+                }
+                if (state == QueueState::Retired) [[unlikely]] {
+                    worker.queue_states[i].store(QueueState::Free,
+                                                 std::memory_order_release);
+                }
+            }
+            if (processed % stats_batch) {
+                PublishPass(worker, processed % stats_batch, appended, oldest);
+            }
+            if (processed) {
+                worker.waiter.Busy();
+                worker.space_waiter.Notify();
+                const auto now = std::chrono::steady_clock::now();
+                for (auto logger : worker.flush_list) {
+                    logger->ReportDrops(now);
+                    logger->filewrapper.FlushIfDue(now);
+                }
+                if (worker.flush_requested.load(std::memory_order_acquire)) {
+                    FlushPendingFiles(worker);
+                }
+            } else {
+                if (worker.backend_lag_ns.load(std::memory_order_relaxed)) {
+                    worker.backend_lag_ns.store(0, std::memory_order_relaxed);
+                }
+                FlushPendingFiles(worker, !running);
+                worker.waiter.Idle([&] {
+                    return HasPendingEntries(worker) ||
+                           worker.flush_requested.load(
+                               std::memory_order_relaxed);
+                });
+            }
+            if (publishes) {
+                MaybePublishStats(next_publish);
+            }
+        } while (running || processed);
+        FlushPendingFiles(worker, true);
+        if (publishes) {
+            shared_stats.Publish(Stats());
+        }
     }
 
-    static inline void StartThreadProcessing(int _core_id) noexcept {
-        run = true;
+    static inline void MaybePublishStats(
+        std::chrono::steady_clock::time_point& next_publish) noexcept {
+        const auto now = std::chrono::steady_clock::now();
+        if (now >= next_publish) {
+            shared_stats.Publish(Stats());
+            next_publish = now + stats_interval;
+        }
+    }
+
+    // Single writer, so no locked instructions
+    static inline void PublishPass(Worker& worker,
+                                   const unsigned long processed,
+                                   const unsigned long appended,
+                                   const std::uint64_t oldest) noexcept {
+        worker.messages_written.store(
+            worker.messages_written.load(std::memory_order_relaxed) +
+                processed,
+            std::memory_order_relaxed);
+        worker.bytes_written.store(
+            worker.bytes_written.load(std::memory_order_relaxed) + appended,
+            std::memory_order_relaxed);
+        const auto lag = std::max<std::int64_t>(
+            TscClock::ToEpochNanos(TscClock::Now()) -
+                TscClock::ToEpochNanos(oldest),
+            0);
+        worker.backend_lag_ns.store(lag, std::memory_order_relaxed);
+        if (static_cast<unsigned long>(lag) >
+            worker.max_backend_lag_ns.load(std::memory_order_relaxed)) {
+            worker.max_backend_lag_ns.store(lag, std::memory_order_relaxed);
+        }
+    }
+
+    static inline void StartThreadProcessing(
+        const LoggerOptions& options) noexcept {
+        run.store(true, std::memory_order_release);
 
         use_thread = true;
-        core_id = _core_id;
-        thread = std::thread(Logger::Process, nullptr);
+        core_id = options.core_id;
+        placement_report.clear();
+        for (std::size_t i = 0; i < worker_count; i++) {
+            auto& worker = workers[i];
+            worker.waiter.SetStrategy(options.wait_strategy);
+            std::atomic<bool> placed{false};
+            worker.thread = std::thread([&options, &placed, &worker, i] {
+                current_worker = &worker;
+                if (CrashSignals::Installed()) {
+                    CrashSignals::UseAltStack();
+                }
+                ApplyPlacement(options, i);
+                placed.store(true, std::memory_order_release);
+                Process(worker);
+            });
+            // Also keeps the workers from writing placement_report at the
+            // same time
+            while (!placed.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+        }
+        placement_report.pop_back();
+    }
+
+    // Runs on the backend thread before it starts processing
+    static inline void ApplyPlacement(const LoggerOptions& options,
+                                      const std::size_t index) noexcept {
+        placement_report += std::format("Logger backend {}:", index);
+        const int cpu = options.core_id < 0
+                            ? -1
+                            : options.core_id + static_cast<int>(index);
+        if (cpu < 0) {
+            placement_report += " not pinned";
+        } else if (const int error = ThreadPlacement::PinCurrentThread(cpu)) {
+            placement_report += std::format(" pinning to cpu {} failed ({})",
+                                            cpu, strerror(error));
+        } else {
+            placement_report += std::format(" pinned to cpu {}", cpu);
+        }
+        const int node =
+            ThreadPlacement::memory_node.load(std::memory_order_relaxed);
+        if (node < 0) {
+            placement_report += ", no numa binding";
+        } else if (const int error =
+                       ThreadPlacement::PreferNodeForCurrentThread(node)) {
+            placement_report += std::format(", numa node {} failed ({})", node,
+                                            strerror(error));
+        } else {
+            placement_report += std::format(", memory on numa node {}", node);
+        }
+        if (options.realtime_priority <= 0) {
+            placement_report += ", normal scheduling";
+        } else if (const int error = ThreadPlacement::SetRealtime(
+                       options.realtime_priority)) {
+            placement_report += std::format(", SCHED_FIFO {} failed ({})",
+                                            options.realtime_priority,
+                                            strerror(error));
+        } else {
+            placement_report +=
+                std::format(", SCHED_FIFO {}", options.realtime_priority);
+        }
+        placement_report += '\n';
     }
 
     static inline void StopThreadProcessing() noexcept {
         if (use_thread) {
-            run = false;
-            thread.join();
+            run.store(false, std::memory_order_release);
+            for (std::size_t i = 0; i < worker_count; i++) {
+                workers[i].waiter.Wake();
+                workers[i].thread.join();
+            }
             use_thread = false;
         }
     }
 
     FileWrapper filewrapper;
-    int message_count;
-    static volatile bool run;
-    static std::deque<DataForLog*> log_queue;
-    static SpinLock sp;
+    // SinkType::Binary, writes through filewrapper, so declared after it
+    const std::unique_ptr<BinaryLogWriter<RegisteredLoggerTypes>> binary;
+    Worker* const worker;
+    // Reused by LogHelper for the output of print, stops growing after the
+    // longest message
+    LogBuffer data_to_actually_print;
+    TimestampFormatter timestamp_formatter;
+    const BackpressurePolicy backpressure;
+    // Id logd knows this Logger by
+    const std::uint32_t shm_logger;
+    // Only with LoggerOptions::flight_recorder_records
+    const std::unique_ptr<FlightRecorder> recorder;
+    // Where the crash handler writes, a string so it has nothing to build
+    const std::string crash_path;
+    std::atomic<Logger*>* live_slot{};
+    std::atomic<LogLevel> threshold{LogLevel::Trace};
+    std::atomic<long> message_count;
+    // Written by producers on a drop, the rest only by the backend
+    std::atomic<unsigned long> dropped{};
+    unsigned long dropped_reported{};
+    std::chrono::steady_clock::time_point next_drop_report{};
+    std::atomic<bool> flush_pending{};
+    // Release on StopLogger, acquire before each pass, so the last pass sees
+    // every entry published before StopLogger
+    static std::atomic<bool> run;
+    static Worker workers[max_workers];
+    static std::size_t worker_count;
+    static std::atomic<std::size_t> next_worker;
     static Mempool mempool;
     static bool use_thread;
     static int core_id;
-    static std::thread thread;
+    static SinkType sink_type;
+    static std::string placement_report;
+    static std::size_t queue_capacity;
+    static std::atomic<unsigned long> total_dropped;
+    static SharedStats shared_stats;
+    static std::chrono::nanoseconds stats_interval;
+    // SinkType::SharedMemory, the dictionary lock is only taken the first
+    // time a call site or format is used
+    static constexpr std::size_t shm_dictionary_size = 1 << 22;
+    static bool use_shm;
+    static ShmRegion shm_region;
+    static std::uint32_t shm_generation;
+    static std::uint32_t shm_next_format;
+    static std::uint32_t shm_next_logger;
+    static SpinLock shm_dictionary_lock;
+    static std::atomic<std::uint32_t>
+        shm_call_sites[CallSiteRegistry::capacity];
+    // Crash handler
+    static constexpr auto destructor_report_interval = std::chrono::seconds(5);
+    static constexpr auto crash_stop_timeout = std::chrono::milliseconds(100);
+    static std::size_t flight_records;
+    static std::atomic<Logger*> live_loggers[max_live_loggers];
+    static std::chrono::nanoseconds crash_flush_timeout;
+    static bool crash_dump_queued;
+    static std::atomic<bool> crashing;
+    // Workers stop at the next entry while it is set
+    static std::atomic<bool> crash_stop;
+    static LogBuffer crash_text;
+    // Set on each backend thread
+    static thread_local Worker* current_worker;
+    // This thread is in the crash handler
+    static thread_local bool handling_crash;
+    // This thread's thread_local destructors have started, Logs from the
+    // ones that run later still get written
+    static thread_local bool producer_exiting;
+    static thread_local ProducerQueues producer_queues;
 
 #ifdef LATENCY_FINDING
-    static LatencyProfilingStats latency_1;
-    static LatencyProfilingStats latency_2;
-    static LatencyProfilingStats latency_3;
-    static LatencyProfilingStats latency_4;
-    static LatencyProfilingStats latency_5;
+    // Per thread, merged by PrintLatencies
+    static LatencyStage latency_1;
+    static LatencyStage latency_2;
+    static LatencyStage latency_3;
+    static LatencyStage latency_4;
+    static LatencyStage latency_5;
 #endif
 };
 
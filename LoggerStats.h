@@ -0,0 +1,168 @@
+#ifndef LOGGERSTATS_H_
+#define LOGGERSTATS_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Point in time view of every Logger in the process, counters are totals
+// since the process started, rates come from the difference of two
+// snapshots
+// Only whole 64 bit words so the shared memory copy can be done word by word
+struct LoggerStats {
+    // steady_clock, for rates between snapshots
+    std::uint64_t time_ns;
+    // Rendered by the backend
+    std::uint64_t messages_written;
+    std::uint64_t bytes_written;
+    // Dropped by a backpressure policy
+    std::uint64_t messages_dropped;
+    // Entries waiting in producer queues and the room there is in them
+    std::uint64_t queue_depth;
+    std::uint64_t queue_capacity;
+    // Mempool objects handed out and not yet freed, and every slot the
+    // mempool has allocated
+    std::uint64_t pool_in_use;
+    std::uint64_t pool_slots;
+    // Files started after the first one, by size or by mmap segment
+    std::uint64_t rotations;
+    // Age of the oldest message the backend rendered in its last pass, 0
+    // once it has caught up, and the highest seen
+    std::uint64_t backend_lag_ns;
+    std::uint64_t max_backend_lag_ns;
+    std::uint64_t workers;
+};
+
+// LoggerStats published into a POSIX shared memory object so a tool can
+// poll it without going through the process, seqlock protected
+// The writer never waits for readers
+class SharedStats {
+   public:
+    static constexpr std::uint64_t magic = 0x4c4f47535441545aULL;
+    static constexpr std::size_t words = sizeof(LoggerStats) / 8;
+    static_assert(sizeof(LoggerStats) % 8 == 0);
+
+    SharedStats() noexcept = default;
+    SharedStats(const SharedStats&) = delete;
+    SharedStats(const SharedStats&&) = delete;
+    SharedStats operator=(const SharedStats&) = delete;
+    SharedStats operator=(const SharedStats&&) = delete;
+    ~SharedStats() noexcept { Close(); }
+
+    // Writer side, name as for shm_open ("/my_app_logger"), returns 0 or an
+    // errno value
+    inline int Create(const std::string& name) noexcept {
+        return Open(name, true);
+    }
+
+    // Reader side
+    inline int Attach(const std::string& name) noexcept {
+        return Open(name, false);
+    }
+
+    inline bool IsOpen() const noexcept { return page != nullptr; }
+
+    inline void Publish(const LoggerStats& stats) noexcept {
+        std::uint64_t source[words];
+        std::memcpy(source, &stats, sizeof(stats));
+        const auto sequence =
+            page->sequence.load(std::memory_order_relaxed) + 1;
+        page->sequence.store(sequence, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (std::size_t i = 0; i < words; i++) {
+            page->data[i].store(source[i], std::memory_order_relaxed);
+        }
+        page->sequence.store(sequence + 1, std::memory_order_release);
+    }
+
+    // False if the writer kept getting in the way
+    inline bool Read(LoggerStats* stats) const noexcept {
+        for (int attempt = 0; attempt < 1000; attempt++) {
+            const auto before = page->sequence.load(std::memory_order_acquire);
+            if (before & 1) {
+                continue;
+            }
+            std::uint64_t copy[words];
+            for (std::size_t i = 0; i < words; i++) {
+                copy[i] = page->data[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (page->sequence.load(std::memory_order_relaxed) == before &&
+                before) {
+                std::memcpy(stats, copy, sizeof(*stats));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The writer also removes the name
+    inline void Close() noexcept {
+        if (!page) {
+            return;
+        }
+        munmap(page, sizeof(Page));
+        page = nullptr;
+        if (owner) {
+            shm_unlink(name.c_str());
+        }
+    }
+
+   private:
+    struct Page {
+        std::uint64_t magic;
+        // Odd while the writer is in the middle of an update, 0 until the
+        // first one
+        std::atomic<std::uint64_t> sequence;
+        std::atomic<std::uint64_t> data[words];
+    };
+
+    inline int Open(const std::string& name_, const bool create) noexcept {
+        Close();
+        const int fd = create
+                           ? shm_open(name_.c_str(), O_RDWR | O_CREAT, 0644)
+                           : shm_open(name_.c_str(), O_RDONLY, 0);
+        if (fd < 0) {
+            return errno;
+        }
+        if (create && ftruncate(fd, sizeof(Page)) != 0) {
+            const int error = errno;
+            close(fd);
+            return error;
+        }
+        auto mapped =
+            mmap(nullptr, sizeof(Page), create ? PROT_READ | PROT_WRITE
+                                               : PROT_READ,
+                 MAP_SHARED, fd, 0);
+        const int error = errno;
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            return error;
+        }
+        page = static_cast<Page*>(mapped);
+        if (create) {
+            page->sequence.store(0, std::memory_order_relaxed);
+            page->magic = magic;
+        } else if (page->magic != magic) {
+            munmap(page, sizeof(Page));
+            page = nullptr;
+            return EINVAL;
+        }
+        name = name_;
+        owner = create;
+        return 0;
+    }
+
+    Page* page{};
+    std::string name;
+    bool owner{};
+};
+
+#endif /* LOGGERSTATS_H_ */
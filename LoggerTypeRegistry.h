@@ -0,0 +1,135 @@
+#ifndef LOGGERTYPEREGISTRY_H_
+#define LOGGERTYPEREGISTRY_H_
+
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "LogBuffer.h"
+#include "Mempool.h"
+
+// print(LogBuffer& out) appends straight to what the backend writes out,
+// print(std::string* s) replaces the contents of s which then gets copied
+template <typename T>
+concept HasPrintMethod = requires(T t, LogBuffer& out) {
+    { t.print(out) } -> std::same_as<void>;
+} || requires(T t, std::string* s) {
+    { t.print(s) } -> std::same_as<void>;
+};
+
+// Appends what object prints to out, whichever print it has
+template <HasPrintMethod T>
+inline void PrintObject(const T& object, LogBuffer& out) noexcept {
+    if constexpr (requires { object.print(out); }) {
+        object.print(out);
+    } else {
+        thread_local std::string text;
+        object.print(&text);
+        out.Append(text);
+    }
+}
+
+// Objects the SharedMemory and Binary sinks may write out as their bytes,
+// to be printed by logd or logdecode in another process
+// Being trivially copyable is not enough, a pointer member would point into
+// the producer, so the type says it is a plain value with
+// static constexpr bool plain_bytes = true;
+// Objects of any other type are printed on the producer and go out as text
+template <typename T>
+concept PlainBytes = std::is_trivially_copyable_v<T> && requires {
+    requires T::plain_bytes;
+};
+
+using LoggerTypeId = std::uint16_t;
+
+// Name of T as the compiler spells it, "LoggerType1"
+template <typename T>
+constexpr std::string_view TypeName() noexcept {
+    const std::string_view name = __PRETTY_FUNCTION__;
+    const auto start = name.find("T = ") + 4;
+    return name.substr(start, name.find_first_of(";]", start) - start);
+}
+
+// Compile time registry of every type that can be given to the Logger
+// The position of a type in the list is its id, and the print, deallocate
+// and destroy tables are indexed by that id, so dispatching a message is a
+// single indirect call
+// Declare your list as RegisteredLoggerTypes in your types header, see
+// LoggerTypes.h for an example
+template <HasPrintMethod... Types>
+struct LoggerTypeList {
+    using PrintFunction = void (*)(void const* const, LogBuffer&) noexcept;
+    using DeallocateFunction = void (*)(Mempool&, void const* const) noexcept;
+    using DestroyFunction = void (*)(void const* const) noexcept;
+
+    static constexpr std::size_t size = sizeof...(Types);
+    static_assert(size > 0, "Please register at least one type");
+
+    template <typename T>
+    static constexpr bool contains = (std::is_same_v<T, Types> || ...);
+
+    // By id, to check that bytes of a type from another process fit
+    static constexpr std::size_t sizes[] = {sizeof(Types)...};
+    static constexpr std::string_view names[] = {TypeName<Types>()...};
+    // Only these can be written out as bytes and printed elsewhere
+    static constexpr bool plain_bytes[] = {PlainBytes<Types>...};
+
+    template <typename T>
+    static constexpr LoggerTypeId id = [] {
+        static_assert(contains<T>, "Please Provide correct type");
+        LoggerTypeId index = 0;
+        ((std::is_same_v<T, Types> ? false : (index++, true)) && ...);
+        return index;
+    }();
+
+    static inline void Register(Mempool& mempool) noexcept {
+        (mempool.Register<Types>(), ...);
+    }
+
+    // Appends to out
+    static inline void Print(const LoggerTypeId type_id,
+                             void const* const pointer,
+                             LogBuffer& out) noexcept {
+        print_table[type_id](pointer, out);
+    }
+
+    static inline void Deallocate(Mempool& mempool, const LoggerTypeId type_id,
+                                  void const* const pointer) noexcept {
+        deallocate_table[type_id](mempool, pointer);
+    }
+
+    // For objects that live inside a queue entry rather than the mempool
+    static inline void Destroy(const LoggerTypeId type_id,
+                               void const* const pointer) noexcept {
+        destroy_table[type_id](pointer);
+    }
+
+   private:
+    template <typename T>
+    static void PrintHelper(void const* const pointer,
+                            LogBuffer& out) noexcept {
+        PrintObject(*static_cast<T const*>(pointer), out);
+    }
+
+    template <typename T>
+    static void DeallocateHelper(Mempool& mempool,
+                                 void const* const pointer) noexcept {
+        mempool.deallocate(const_cast<T*>(static_cast<T const*>(pointer)));
+    }
+
+    template <typename T>
+    static void DestroyHelper(void const* const pointer) noexcept {
+        static_cast<T const*>(pointer)->~T();
+    }
+
+    static constexpr PrintFunction print_table[] = {&PrintHelper<Types>...};
+    static constexpr DeallocateFunction deallocate_table[] = {
+        &DeallocateHelper<Types>...};
+    static constexpr DestroyFunction destroy_table[] = {
+        &DestroyHelper<Types>...};
+};
+
+#endif /* LOGGERTYPEREGISTRY_H_ */
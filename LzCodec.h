@@ -0,0 +1,192 @@
+#ifndef LZCODEC_H_
+#define LZCODEC_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Small LZ77 block codec in the LZ4 block format, greedy matching with a
+// single probe hash table, fast enough to keep up with the backend on log
+// text where whole prefixes and words repeat
+// A block is sequences of
+// token (literal length << 4 | match length - 4), more literal length
+// bytes, literals, 2 byte little endian offset, more match length bytes
+// where a length of 15 in the token continues in bytes that add up until
+// one is not 255, and the last sequence has literals only
+// As LZ4 requires, the last last_literals bytes are always literals and no
+// match starts later than match_start_limit bytes before the end
+class LzCodec {
+   public:
+    static constexpr std::size_t hash_bits = 14;
+    // Entries of the table Compress needs
+    static constexpr std::size_t table_size = std::size_t{1} << hash_bits;
+    static constexpr std::size_t min_match = 4;
+    static constexpr std::size_t max_offset = 65535;
+    static constexpr std::size_t last_literals = 5;
+    static constexpr std::size_t match_start_limit = 12;
+
+    // Room Compress may need for size bytes that do not compress
+    static constexpr std::size_t CompressBound(const std::size_t size) {
+        return size + size / 255 + 16;
+    }
+
+    // Returns the compressed size, out has CompressBound(size) bytes and
+    // table table_size entries, whatever is in the table is ignored
+    static inline std::size_t Compress(const unsigned char* in,
+                                       const std::size_t size,
+                                       unsigned char* out,
+                                       std::uint32_t* table) noexcept {
+        std::memset(table, 0, table_size * sizeof(*table));
+        const unsigned char* const end = in + size;
+        const unsigned char* ip = in;
+        const unsigned char* anchor = in;
+        unsigned char* op = out;
+        // Misses since the last match, the step grows on data that does
+        // not compress
+        unsigned misses = 0;
+        while (static_cast<std::size_t>(end - ip) >= match_start_limit) {
+            const auto word = Read32(ip);
+            auto& slot = table[Hash(word)];
+            const unsigned char* candidate = in + slot;
+            slot = static_cast<std::uint32_t>(ip - in);
+            if (candidate < ip &&
+                static_cast<std::size_t>(ip - candidate) <= max_offset &&
+                Read32(candidate) == word) {
+                const auto match_end = end - last_literals;
+                auto length = min_match;
+                while (ip + length < match_end &&
+                       candidate[length] == ip[length]) {
+                    length++;
+                }
+                op = Sequence(op, anchor, ip - anchor, ip - candidate,
+                              length - min_match);
+                ip += length;
+                anchor = ip;
+                misses = 0;
+                continue;
+            }
+            // Never past the end
+            const std::size_t step = 1 + (misses++ >> 6);
+            ip += std::min<std::size_t>(step, end - ip);
+        }
+        const auto literals = static_cast<std::size_t>(end - anchor);
+        *op++ = static_cast<unsigned char>(std::min<std::size_t>(literals, 15)
+                                           << 4);
+        op = Length(op, literals);
+        std::memcpy(op, anchor, literals);
+        return op + literals - out;
+    }
+
+    // false when the block is damaged or does not decompress to exactly
+    // size bytes
+    static inline bool Decompress(const unsigned char* in,
+                                  const std::size_t in_size,
+                                  unsigned char* out,
+                                  const std::size_t size) noexcept {
+        const unsigned char* ip = in;
+        const unsigned char* const in_end = in + in_size;
+        unsigned char* op = out;
+        unsigned char* const out_end = out + size;
+        while (ip < in_end) {
+            const unsigned token = *ip++;
+            std::size_t literals = token >> 4;
+            if (!ReadLength(ip, in_end, &literals) ||
+                literals > static_cast<std::size_t>(in_end - ip) ||
+                literals > static_cast<std::size_t>(out_end - op)) {
+                return false;
+            }
+            std::memcpy(op, ip, literals);
+            ip += literals;
+            op += literals;
+            if (ip == in_end) {
+                break;
+            }
+            if (in_end - ip < 2) {
+                return false;
+            }
+            const std::size_t offset = ip[0] | ip[1] << 8;
+            ip += 2;
+            std::size_t length = token & 15;
+            if (!offset || offset > static_cast<std::size_t>(op - out) ||
+                !ReadLength(ip, in_end, &length)) {
+                return false;
+            }
+            length += min_match;
+            if (length > static_cast<std::size_t>(out_end - op)) {
+                return false;
+            }
+            const unsigned char* match = op - offset;
+            if (offset >= length) {
+                std::memcpy(op, match, length);
+                op += length;
+            } else {
+                // Overlapping, repeats the last offset bytes
+                for (std::size_t i = 0; i < length; i++) {
+                    *op++ = match[i];
+                }
+            }
+        }
+        return op == out_end;
+    }
+
+   private:
+    static inline std::uint32_t Read32(const unsigned char* p) noexcept {
+        std::uint32_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static inline std::uint32_t Hash(const std::uint32_t word) noexcept {
+        return (word * 2654435761u) >> (32 - hash_bits);
+    }
+
+    // What is left of length after the 15 in the token
+    static inline unsigned char* Length(unsigned char* op,
+                                        std::size_t length) noexcept {
+        if (length < 15) {
+            return op;
+        }
+        length -= 15;
+        while (length >= 255) {
+            *op++ = 255;
+            length -= 255;
+        }
+        *op++ = static_cast<unsigned char>(length);
+        return op;
+    }
+
+    static inline bool ReadLength(const unsigned char*& ip,
+                                  const unsigned char* in_end,
+                                  std::size_t* length) noexcept {
+        if (*length != 15) {
+            return true;
+        }
+        unsigned char byte;
+        do {
+            if (ip == in_end) {
+                return false;
+            }
+            byte = *ip++;
+            *length += byte;
+        } while (byte == 255);
+        return true;
+    }
+
+    static inline unsigned char* Sequence(
+        unsigned char* op, const unsigned char* literals,
+        const std::size_t literal_length, const std::size_t offset,
+        const std::size_t match_length) noexcept {
+        *op++ = static_cast<unsigned char>(
+            std::min<std::size_t>(literal_length, 15) << 4 |
+            std::min<std::size_t>(match_length, 15));
+        op = Length(op, literal_length);
+        std::memcpy(op, literals, literal_length);
+        op += literal_length;
+        *op++ = static_cast<unsigned char>(offset);
+        *op++ = static_cast<unsigned char>(offset >> 8);
+        return Length(op, match_length);
+    }
+};
+
+#endif /* LZCODEC_H_ */
@@ -1,12 +1,24 @@
 #ifndef MEMPOOL_H_
 #define MEMPOOL_H_
 
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
 #include <cstdio>
-#include <deque>
-#include <unordered_map>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include "SpinLock.h"
+#include "ThreadPlacement.h"
+
 // #define DEBUG_MEM
 
 #ifdef DEBUG_MEM
@@ -20,75 +32,300 @@
 #define LOG_LOCATION_MEMPOOL
 #endif
 
+// Where Mempool slabs come from
+// Transparent asks for transparent huge pages with madvise, Explicit maps
+// MAP_HUGETLB pages reserved in /proc/sys/vm/nr_hugepages and falls back to
+// Transparent when there are none
+enum class HugePages { Off, Transparent, Explicit };
+
+// Objects live in power of two slots of at least a cache line, carved out
+// of mmaped and prefaulted slabs, so two objects never share a cache line
+// and the first use of a slot does not page fault
+// Every thread gets its own free list per size class, so allocate never
+// takes a lock or hashes anything, the free list runs through the free
+// slots themselves
+// Objects freed by a thread other than the one that allocated them are pushed
+// onto the owning thread's lock free remote free stack, the owner takes the
+// whole stack back in one exchange once its local free list runs dry
+// Caches of threads that exited are adopted by the next thread that needs
+// one of the same size, remote frees meanwhile wait on their stack
+// The pool has to outlive every thread that used it
 class Mempool {
+    struct ThreadCache;
+
+    // Sits in front of every object, next is only valid while the slot is
+    // free
+    struct alignas(16) SlotHeader {
+        ThreadCache* owner;
+        SlotHeader* next;
+    };
+
+    // Counters are only there for InUse, each has a single writer except
+    // remote_frees which shares a cache line with the CAS anyway
+    struct alignas(64) ThreadCache {
+        const Mempool* pool;
+        std::thread::id thread_id;
+        std::size_t slot_size;
+        SlotHeader* local_free{};
+        // Set when the owning thread exits, cleared under sp on adoption
+        std::atomic<bool> orphaned{};
+        // Caches are only ever added, so InUse walks them without sp
+        std::atomic<ThreadCache*> next_cache{};
+        std::atomic<unsigned long> allocations{};
+        std::atomic<unsigned long> local_frees{};
+        alignas(64) std::atomic<SlotHeader*> remote_free{};
+        std::atomic<unsigned long> remote_frees{};
+    };
+
+    // A cache line
+    static constexpr std::size_t min_slot_size = 64;
+
+    // Types whose slots round up to the same size share free lists
+    template <std::size_t type_size>
+    struct SizeClass {
+        static constexpr std::size_t slot_size = std::bit_ceil(
+            std::max(min_slot_size, sizeof(SlotHeader) + type_size));
+        // Last cache used by this thread for this size
+        static inline thread_local ThreadCache* cache = nullptr;
+    };
+
    public:
+    Mempool() noexcept = default;
+    Mempool(const Mempool&) = delete;
+    Mempool(const Mempool&&) = delete;
+    Mempool operator=(const Mempool&) = delete;
+    Mempool operator=(const Mempool&&) = delete;
+
     ~Mempool() {
-        for (int i = 0; i < memory_blocks.size(); i++) {
-            auto memory_block = memory_blocks[i];
-            delete[] memory_block;
+        for (std::size_t i = 0; i < memory_blocks.size(); i++) {
+            munmap(memory_blocks[i].base, memory_blocks[i].size);
+        }
+        auto cache = thread_caches.load(std::memory_order_relaxed);
+        while (cache) {
+            auto next = cache->next_cache.load(std::memory_order_relaxed);
+            delete cache;
+            cache = next;
         }
     }
 
     template <typename T, typename... Args>
-    inline T* allocate(Args... args) {
+    inline T* allocate(Args&&... args) {
         LOG_LOCATION_MEMPOOL;
-        static constexpr auto type_size = sizeof(T);
-        auto iter = mempools_mapper.find(type_size);
-        if (iter == mempools_mapper.end()) {
-            LOG_LOCATION_MEMPOOL;
-            mempools_mapper[type_size] = {};
-        }
-        iter = mempools_mapper.find(type_size);
-        if (mempools_mapper[type_size].empty()) {
-            LOG_LOCATION_MEMPOOL;
-            ExtendMemory<T>();
+        static_assert(alignof(T) <= alignof(SlotHeader),
+                      "Mempool supports alignment up to 16");
+        auto& cache = LocalCache<sizeof(T)>();
+        if (!cache.local_free) {
+            cache.local_free =
+                cache.remote_free.exchange(nullptr, std::memory_order_acquire);
+            if (!cache.local_free) {
+                LOG_LOCATION_MEMPOOL;
+                ExtendMemory(cache);
+            }
         }
-
-        auto data = iter->second.back();
-        iter->second.pop_back();
-        auto typecasted_data = new (data) T(std::forward<Args>(args)...);
+        auto slot = cache.local_free;
+        cache.local_free = slot->next;
+        Bump(cache.allocations);
+        auto typecasted_data = new (slot + 1) T(std::forward<Args>(args)...);
         return typecasted_data;
     }
 
+    // Can be called from any thread
     template <typename T>
     inline void deallocate(T* obj) {
-        // log();
         LOG_LOCATION_MEMPOOL;
-        static constexpr auto type_size = sizeof(T);
         obj->~T();
-        auto iter = mempools_mapper.find(type_size);
-        if (iter != mempools_mapper.end()) {
-            mempools_mapper[type_size].push_back(obj);
+        auto slot = reinterpret_cast<SlotHeader*>(obj) - 1;
+        auto owner = slot->owner;
+        if (owner == SizeClass<sizeof(T)>::cache) {
+            slot->next = owner->local_free;
+            owner->local_free = slot;
+            Bump(owner->local_frees);
+            return;
         }
+        owner->remote_frees.fetch_add(1, std::memory_order_relaxed);
+        auto head = owner->remote_free.load(std::memory_order_relaxed);
+        do {
+            slot->next = head;
+        } while (!owner->remote_free.compare_exchange_weak(
+            head, slot, std::memory_order_release, std::memory_order_relaxed));
     }
 
+    // Fills the calling thread's free list for T up front
     template <typename T>
     inline void Register() noexcept {
-        static constexpr auto type_size = sizeof(T);
-        if (auto iter = mempools_mapper.find(type_size);
-            iter == mempools_mapper.end()) {
-            mempools_mapper[type_size] = {};
-            ExtendMemory<T>();
+        auto& cache = LocalCache<sizeof(T)>();
+        if (!cache.local_free) {
+            ExtendMemory(cache);
+        }
+    }
+
+    // For slabs mapped from now on
+    inline void SetHugePages(const HugePages huge_pages_) noexcept {
+        huge_pages = huge_pages_;
+    }
+
+    // Objects allocated and not yet freed, any thread, takes no lock
+    inline unsigned long InUse() const noexcept {
+        unsigned long allocated = 0, freed = 0;
+        for (auto cache = thread_caches.load(std::memory_order_acquire);
+             cache;
+             cache = cache->next_cache.load(std::memory_order_acquire)) {
+            // Frees first, an object freed after this is never counted as
+            // freed but not allocated
+            freed += cache->local_frees.load(std::memory_order_relaxed) +
+                     cache->remote_frees.load(std::memory_order_relaxed);
+            allocated += cache->allocations.load(std::memory_order_relaxed);
         }
+        return allocated > freed ? allocated - freed : 0;
+    }
+
+    // Slots across every block, any thread, takes no lock
+    inline unsigned long Slots() const noexcept {
+        return slot_count.load(std::memory_order_relaxed);
     }
 
    private:
-    std::unordered_map<std::size_t, std::deque<void*>> mempools_mapper;
-    std::vector<char*> memory_blocks;
+    // Slots per slab, more when the slab is rounded up to a huge page
+    static constexpr std::size_t chunk_size_ = 1024;
+    static constexpr std::size_t huge_page_size = 2 << 20;
 
-    template <typename T>
-    inline void ExtendMemory() noexcept {
+    struct Slab {
+        void* base;
+        std::size_t size;
+    };
+
+    // Single writer counter, no locked instruction
+    static inline void Bump(std::atomic<unsigned long>& counter) noexcept {
+        counter.store(counter.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+    }
+
+    std::vector<Slab> memory_blocks;
+    // Newest first, added under sp
+    std::atomic<ThreadCache*> thread_caches{};
+    std::atomic<unsigned long> slot_count{};
+    HugePages huge_pages = HugePages::Off;
+    std::atomic<bool> huge_pages_failed{};
+    SpinLock sp;
+
+    template <std::size_t type_size>
+    inline ThreadCache& LocalCache() noexcept {
+        auto cache = SizeClass<type_size>::cache;
+        if (cache && cache->pool == this) [[likely]] {
+            return *cache;
+        }
+        cache = FindOrCreateCache(SizeClass<type_size>::slot_size);
+        SizeClass<type_size>::cache = cache;
+        return *cache;
+    }
+
+    // Caches of one thread across pools, orphaned when the thread exits
+    struct ThreadExit {
+        std::vector<ThreadCache*> caches;
+        ~ThreadExit() noexcept {
+            for (auto cache : caches) {
+                cache->orphaned.store(true, std::memory_order_release);
+            }
+        }
+    };
+
+    // Slow path, once per thread per size
+    inline ThreadCache* FindOrCreateCache(std::size_t slot_size) noexcept {
+        thread_local ThreadExit exit;
+        const auto thread_id = std::this_thread::get_id();
+        ThreadCache* orphan = nullptr;
+        sp.lock();
+        for (auto cache = thread_caches.load(std::memory_order_relaxed); cache;
+             cache = cache->next_cache.load(std::memory_order_relaxed)) {
+            if (cache->slot_size != slot_size) {
+                continue;
+            }
+            // Thread ids of exited threads get reused
+            if (cache->orphaned.load(std::memory_order_acquire)) {
+                orphan = orphan ? orphan : cache;
+            } else if (cache->thread_id == thread_id) {
+                sp.unlock();
+                return cache;
+            }
+        }
+        auto cache = orphan;
+        if (cache) {
+            cache->orphaned.store(false, std::memory_order_relaxed);
+            cache->thread_id = thread_id;
+        } else {
+            cache = new ThreadCache{this, thread_id, slot_size};
+            cache->next_cache.store(
+                thread_caches.load(std::memory_order_relaxed),
+                std::memory_order_relaxed);
+            thread_caches.store(cache, std::memory_order_release);
+        }
+        sp.unlock();
+        exit.caches.push_back(cache);
+        return cache;
+    }
+
+    inline void ExtendMemory(ThreadCache& cache) noexcept {
         LOG_LOCATION_MEMPOOL;
-        static constexpr auto type_size = sizeof(T);
-        auto iter = mempools_mapper.find(type_size);
-        static constexpr std::size_t chunk_size_ = 1024;
-        static constexpr auto size_to_create = type_size * chunk_size_;
-        auto memory_block = new char[size_to_create];
-        for (int i = 0; i < chunk_size_; i++) {
-            iter->second.push_back(
-                static_cast<void*>(memory_block + i * type_size));
-        }
-        memory_blocks.push_back(memory_block);
+        const auto slot_size = cache.slot_size;
+        auto slab_size = slot_size * chunk_size_;
+        if (huge_pages != HugePages::Off) {
+            slab_size = (slab_size + huge_page_size - 1) / huge_page_size *
+                        huge_page_size;
+        }
+        auto memory_block = static_cast<char*>(MapSlab(slab_size));
+        // The backend reads every object, keep them near it
+        ThreadPlacement::BindToMemoryNode(memory_block, slab_size);
+        ThreadPlacement::Prefault(memory_block, slab_size);
+        const auto slots = slab_size / slot_size;
+        for (std::size_t i = slots; i-- > 0;) {
+            auto slot =
+                reinterpret_cast<SlotHeader*>(memory_block + i * slot_size);
+            slot->owner = &cache;
+            slot->next = cache.local_free;
+            cache.local_free = slot;
+        }
+        sp.lock();
+        memory_blocks.push_back({memory_block, slab_size});
+        sp.unlock();
+        slot_count.fetch_add(slots, std::memory_order_relaxed);
+    }
+
+    inline void* MapSlab(const std::size_t size) noexcept {
+        static constexpr int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        if (huge_pages == HugePages::Explicit) {
+            auto slab = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                             flags | MAP_HUGETLB, -1, 0);
+            if (slab != MAP_FAILED) {
+                return slab;
+            }
+            if (!huge_pages_failed.exchange(true, std::memory_order_relaxed)) {
+                fprintf(stderr,
+                        "Logger: no huge pages for the mempool (%s), using "
+                        "transparent huge pages\n",
+                        strerror(errno));
+            }
+        }
+        // Transparent huge pages need huge page aligned ranges, one huge
+        // page more is mapped and the ends around the aligned range trimmed
+        const auto extra = huge_pages == HugePages::Off ? 0 : huge_page_size;
+        auto mapped = static_cast<char*>(mmap(
+            nullptr, size + extra, PROT_READ | PROT_WRITE, flags, -1, 0));
+        if (mapped == MAP_FAILED) {
+            perror("Logger mempool mmap");
+            std::abort();
+        }
+        if (!extra) {
+            return mapped;
+        }
+        const auto address = reinterpret_cast<std::uintptr_t>(mapped);
+        const auto aligned = reinterpret_cast<char*>(
+            (address + huge_page_size - 1) & ~(huge_page_size - 1));
+        if (aligned != mapped) {
+            munmap(mapped, aligned - mapped);
+        }
+        munmap(aligned + size, mapped + extra - aligned);
+        madvise(aligned, size, MADV_HUGEPAGE);
+        return aligned;
     }
 };
 
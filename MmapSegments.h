@@ -0,0 +1,296 @@
+#ifndef MMAPSEGMENTS_H_
+#define MMAPSEGMENTS_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// One fallocated, mmaped and prefaulted segment file
+struct MappedSegment {
+    int fd = -1;
+    char* base{};
+    std::size_t size{};
+    // Bytes actually written, set by the backend when it moves on
+    std::size_t used{};
+    std::string name;
+    MappedSegment* next_retired{};
+
+    // nullptr with errno set on failure, the caller reports it
+    static inline MappedSegment* Create(std::string name_,
+                                        std::size_t size_) noexcept {
+        const int fd_ =
+            open(name_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            return nullptr;
+        }
+        if (posix_fallocate(fd_, 0, size_) != 0 &&
+            ftruncate(fd_, size_) != 0) {
+            return Fail(fd_);
+        }
+        auto base_ = static_cast<char*>(mmap(
+            nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0));
+        if (base_ == MAP_FAILED) {
+            return Fail(fd_);
+        }
+        Prefault(base_, size_);
+        return new MappedSegment{fd_, base_, size_, 0, std::move(name_)};
+    }
+
+    static inline MappedSegment* Fail(const int fd_) noexcept {
+        const int error = errno;
+        close(fd_);
+        errno = error;
+        return nullptr;
+    }
+
+    // First write to a page of a shared file mapping faults even after
+    // MAP_POPULATE, so fault every page in for writing here
+    static inline void Prefault(char* base_, std::size_t size_) noexcept {
+#ifdef MADV_POPULATE_WRITE
+        if (madvise(base_, size_, MADV_POPULATE_WRITE) == 0) {
+            return;
+        }
+#endif
+        static constexpr std::size_t page_size = 4096;
+        for (std::size_t i = 0; i < size_; i += page_size) {
+            static_cast<volatile char*>(base_)[i] = 0;
+        }
+    }
+
+    // Cuts the file to what was written
+    inline void Finalize() noexcept {
+        munmap(base, size);
+        if (ftruncate(fd, used) != 0) {
+            perror(name.c_str());
+        }
+        close(fd);
+    }
+
+    // Segment that was prepared but never written to
+    inline void Discard() noexcept {
+        munmap(base, size);
+        close(fd);
+        unlink(name.c_str());
+    }
+};
+
+class SegmentPreparer;
+
+// Segments of one file
+// The preparer thread keeps one segment ready ahead of the backend and
+// finalizes the ones the backend is done with, so for the backend moving to
+// the next segment is a couple of atomic operations
+class SegmentRoller {
+   public:
+    SegmentRoller(std::string prefix_, std::size_t segment_size_) noexcept
+        : prefix(std::move(prefix_)), segment_size(segment_size_) {}
+    SegmentRoller() = delete;
+    SegmentRoller(const SegmentRoller&) = delete;
+    SegmentRoller(const SegmentRoller&&) = delete;
+    SegmentRoller operator=(const SegmentRoller&) = delete;
+    SegmentRoller operator=(const SegmentRoller&&) = delete;
+    ~SegmentRoller() noexcept = default;
+
+    // Creates the first segment on the calling thread
+    inline MappedSegment* First() noexcept;
+
+    // Returns the prepared segment, only waits when the preparer has fallen
+    // behind, nullptr when the preparer failed to create it
+    inline MappedSegment* TakeNext() noexcept {
+        auto next = prepared.exchange(nullptr, std::memory_order_acquire);
+        while (!next) {
+            if (failed.load(std::memory_order_acquire)) {
+                return nullptr;
+            }
+            stalls++;
+            std::this_thread::yield();
+            next = prepared.exchange(nullptr, std::memory_order_acquire);
+        }
+        return next;
+    }
+
+    // Hands a segment the backend is done with to the preparer to finalize
+    inline void Retire(MappedSegment* segment, std::size_t used) noexcept {
+        segment->used = used;
+        auto head = retired.load(std::memory_order_relaxed);
+        do {
+            segment->next_retired = head;
+        } while (!retired.compare_exchange_weak(head, segment,
+                                                std::memory_order_release,
+                                                std::memory_order_relaxed));
+    }
+
+    inline void Close(MappedSegment* current, std::size_t used) noexcept;
+
+    // Times the backend had to wait for a segment
+    unsigned long stalls{};
+
+   private:
+    friend class SegmentPreparer;
+
+    inline std::string SegmentName(int index) const noexcept {
+        return prefix + (index < 10 ? '0' + std::to_string(index)
+                                    : std::to_string(index));
+    }
+
+    // Preparer thread, returns whether there was anything to do
+    // A failure is reported once and retried after a delay that doubles up
+    // to max_retry_delay, until a segment can be created again
+    inline bool Service() noexcept {
+        bool did_work = false;
+        const auto now = std::chrono::steady_clock::now();
+        if (!prepared.load(std::memory_order_relaxed) && now >= retry_at) {
+            const auto name = SegmentName(next_index);
+            auto segment = MappedSegment::Create(name, segment_size);
+            if (segment) {
+                next_index++;
+                prepared.store(segment, std::memory_order_release);
+                retry_delay = min_retry_delay;
+                did_work = true;
+            } else {
+                if (!failed.load(std::memory_order_relaxed)) {
+                    perror(name.c_str());
+                }
+                retry_at = now + retry_delay;
+                retry_delay = std::min(retry_delay * 2, max_retry_delay);
+            }
+            failed.store(!segment, std::memory_order_release);
+        }
+        return FinalizeRetired() || did_work;
+    }
+
+    inline bool FinalizeRetired() noexcept {
+        auto segment = retired.exchange(nullptr, std::memory_order_acquire);
+        const bool did_work = segment;
+        while (segment) {
+            auto next = segment->next_retired;
+            segment->Finalize();
+            delete segment;
+            segment = next;
+        }
+        return did_work;
+    }
+
+    static constexpr std::chrono::milliseconds min_retry_delay{1};
+    static constexpr std::chrono::milliseconds max_retry_delay{1000};
+
+    const std::string prefix;
+    const std::size_t segment_size;
+    int next_index{};
+    // Preparer thread only
+    std::chrono::steady_clock::time_point retry_at{};
+    std::chrono::milliseconds retry_delay{min_retry_delay};
+    std::atomic<MappedSegment*> prepared{};
+    std::atomic<MappedSegment*> retired{};
+    // The last attempt to create the next segment failed
+    std::atomic<bool> failed{};
+};
+
+// One background thread for every mmap sink in the process
+// Polls every millisecond while idle, the backend never signals it so it
+// never makes a syscall for it
+class SegmentPreparer {
+   public:
+    static inline void Register(SegmentRoller* roller) noexcept {
+        std::lock_guard control_guard(control);
+        {
+            std::lock_guard guard(mutex);
+            rollers.push_back(roller);
+        }
+        if (!preparer.thread.joinable()) {
+            run = true;
+            preparer.thread = std::thread(Run);
+        }
+    }
+
+    // After this returns the preparer no longer touches roller
+    // control is held across the join, so a Register meanwhile starts the
+    // thread again afterwards and only one Unregister joins
+    static inline void Unregister(SegmentRoller* roller) noexcept {
+        std::lock_guard control_guard(control);
+        bool last;
+        {
+            std::lock_guard guard(mutex);
+            std::erase(rollers, roller);
+            last = rollers.empty();
+        }
+        if (last) {
+            preparer.Stop();
+        }
+    }
+
+   private:
+    static inline void Run() noexcept {
+        while (run.load(std::memory_order_relaxed)) {
+            bool did_work = false;
+            {
+                std::lock_guard guard(mutex);
+                for (auto roller : rollers) {
+                    did_work |= roller->Service();
+                }
+            }
+            if (!did_work) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+    // Stops the thread if a mmap sink is still open when statics are
+    // destroyed, a joinable std::thread would terminate the process
+    struct Thread {
+        std::thread thread;
+        inline void Stop() noexcept {
+            if (thread.joinable()) {
+                run = false;
+                thread.join();
+            }
+        }
+        ~Thread() noexcept { Stop(); }
+    };
+
+    // Register and Unregister, mutex guards rollers against the thread
+    static inline std::mutex control;
+    static inline std::mutex mutex;
+    static inline std::vector<SegmentRoller*> rollers;
+    static inline std::atomic<bool> run{};
+    // Last, so it is destroyed first
+    static inline Thread preparer;
+};
+
+inline MappedSegment* SegmentRoller::First() noexcept {
+    const auto name = SegmentName(next_index);
+    auto segment = MappedSegment::Create(name, segment_size);
+    if (!segment) {
+        perror(name.c_str());
+    }
+    next_index++;
+    SegmentPreparer::Register(this);
+    return segment;
+}
+
+inline void SegmentRoller::Close(MappedSegment* current,
+                                 std::size_t used) noexcept {
+    SegmentPreparer::Unregister(this);
+    if (current) {
+        current->used = used;
+        current->Finalize();
+        delete current;
+    }
+    FinalizeRetired();
+    if (auto segment = prepared.exchange(nullptr, std::memory_order_acquire)) {
+        segment->Discard();
+        delete segment;
+    }
+}
+
+#endif /* MMAPSEGMENTS_H_ */
@@ -0,0 +1,214 @@
+#ifndef SPSCQUEUE_H_
+#define SPSCQUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+#include "ThreadPlacement.h"
+
+inline constexpr std::size_t cache_line_size = 64;
+
+// Bounded single producer single consumer ring of T
+// Producer owns tail, consumer claims entries by moving head and frees them
+// by moving done, each side on its own cache line
+// Each side keeps a cached copy of the other side's index so that in the
+// common case it only touches its own cache line
+// A stealable ring lets the producer take the oldest entry back with
+// StealFront when it is full, head is then a CAS so exactly one side gets
+// each entry, otherwise the consumer moves head and done with plain stores
+template <typename T>
+class SPSCQueue {
+   public:
+    // capacity gets rounded up to a power of two
+    explicit SPSCQueue(std::size_t capacity_,
+                       const bool stealable_ = false) noexcept
+        : capacity(RoundUpToPowerOfTwo(capacity_)),
+          mask(capacity - 1),
+          stealable(stealable_),
+          slots(static_cast<Slot*>(::operator new(
+              capacity * sizeof(Slot), std::align_val_t{alignof(Slot)}))) {
+        // Producer writes each slot once per lap, the consumer reads it and
+        // sits on the backend node
+        ThreadPlacement::BindToMemoryNode(slots, capacity * sizeof(Slot));
+        // Here, on the producer's first log or in Logger::Warmup, rather than
+        // a page at a time during the first lap
+        ThreadPlacement::Prefault(slots, capacity * sizeof(Slot));
+    }
+
+    SPSCQueue() = delete;
+    SPSCQueue(const SPSCQueue&) = delete;
+    SPSCQueue(const SPSCQueue&&) = delete;
+    SPSCQueue operator=(const SPSCQueue&) = delete;
+    SPSCQueue operator=(const SPSCQueue&&) = delete;
+
+    ~SPSCQueue() noexcept {
+        while (auto data = Claim()) {
+            data->~T();
+            Release();
+        }
+        ::operator delete(slots, std::align_val_t{alignof(Slot)});
+    }
+
+    // Producer side
+    // Constructs the element in place, returns false when the ring is full
+    template <typename... Args>
+    inline bool TryEmplace(Args&&... args) noexcept {
+        const auto tail_ = producer.tail.load(std::memory_order_relaxed);
+        if (tail_ - producer.cached_done == capacity) {
+            producer.cached_done =
+                consumer.done.load(std::memory_order_acquire);
+            if (tail_ - producer.cached_done == capacity) {
+                return false;
+            }
+        }
+        new (slots[tail_ & mask].storage) T(std::forward<Args>(args)...);
+        producer.tail.store(tail_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Producer side, stealable rings only
+    // Takes the oldest entry out of a full ring if steal agrees to it,
+    // discard gets it before it is destroyed
+    // Fails when the consumer is in the middle of the oldest entry, its slot
+    // is the one the producer would write next
+    template <typename Steal, typename Discard>
+    inline bool StealFront(Steal&& steal, Discard&& discard) noexcept {
+        auto head_ = consumer.head.load(std::memory_order_acquire);
+        if (head_ != consumer.done.load(std::memory_order_acquire) ||
+            head_ == producer.tail.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        // Only the producer writes slots, so the entry stays readable even
+        // if the consumer claims it meanwhile, the CAS then fails
+        auto data = std::launder(
+            reinterpret_cast<T*>(slots[head_ & mask].storage));
+        if (!steal(static_cast<const T*>(data)) ||
+            !consumer.head.compare_exchange_strong(
+                head_, head_ + 1, std::memory_order_acquire)) {
+            return false;
+        }
+        discard(data);
+        data->~T();
+        consumer.done.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+
+    // Any thread, entries not yet released, only a hint while either side
+    // is moving
+    inline std::size_t Size() const noexcept {
+        const auto done_ = consumer.done.load(std::memory_order_relaxed);
+        return producer.tail.load(std::memory_order_relaxed) - done_;
+    }
+
+    // Consumer side
+    // Whether there is nothing to claim
+    inline bool Empty() const noexcept {
+        return consumer.head.load(std::memory_order_relaxed) ==
+               producer.tail.load(std::memory_order_acquire);
+    }
+
+    // Consumer side
+    // Takes the oldest element or returns nullptr when the ring is empty
+    // The slot stays out of the producer's reach until Release
+    inline T* Claim() noexcept {
+        auto head_ = consumer.head.load(std::memory_order_relaxed);
+        if (!stealable) {
+            if (head_ == consumer.cached_tail) {
+                consumer.cached_tail =
+                    producer.tail.load(std::memory_order_acquire);
+                if (head_ == consumer.cached_tail) {
+                    return nullptr;
+                }
+            }
+            // Nobody else moves head
+            consumer.head.store(head_ + 1, std::memory_order_relaxed);
+            return std::launder(
+                reinterpret_cast<T*>(slots[head_ & mask].storage));
+        }
+        do {
+            // Steals can move head past a stale cached_tail
+            if (head_ >= consumer.cached_tail) {
+                consumer.cached_tail =
+                    producer.tail.load(std::memory_order_acquire);
+                if (head_ >= consumer.cached_tail) {
+                    return nullptr;
+                }
+            }
+            // Only fails when the producer stole the entry, head_ is then
+            // reloaded
+        } while (!consumer.head.compare_exchange_weak(
+            head_, head_ + 1, std::memory_order_acquire,
+            std::memory_order_relaxed));
+        return std::launder(
+            reinterpret_cast<T*>(slots[head_ & mask].storage));
+    }
+
+    // Gives the slot returned by Claim back to the producer
+    // Caller is responsible for destroying the element before this
+    inline void Release() noexcept {
+        if (!stealable) {
+            consumer.done.store(
+                consumer.done.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+            return;
+        }
+        consumer.done.fetch_add(1, std::memory_order_release);
+    }
+
+    // Any thread, visits the entries nobody has claimed yet, oldest first
+    // Only consistent while neither side is moving, for a crash handler
+    template <typename Visit>
+    inline void ForEachPending(Visit&& visit) noexcept {
+        const auto tail_ = producer.tail.load(std::memory_order_acquire);
+        for (auto index = consumer.head.load(std::memory_order_acquire);
+             index < tail_; index++) {
+            visit(std::launder(
+                reinterpret_cast<T*>(slots[index & mask].storage)));
+        }
+    }
+
+    inline std::size_t Capacity() const noexcept { return capacity; }
+
+    // Only while the ring is empty and neither side uses it, for handing a
+    // ring over to a new producer
+    inline void SetStealable(const bool stealable_) noexcept {
+        stealable = stealable_;
+    }
+
+   private:
+    struct Slot {
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    static constexpr std::size_t RoundUpToPowerOfTwo(std::size_t n) noexcept {
+        std::size_t power = 1;
+        while (power < n) {
+            power <<= 1;
+        }
+        return power;
+    }
+
+    struct alignas(cache_line_size) ProducerSide {
+        std::atomic<std::size_t> tail{};
+        std::size_t cached_done{};
+    };
+
+    // Entries before head are claimed, entries before done are free again
+    // Both only differ while the consumer is working on an entry
+    struct alignas(cache_line_size) ConsumerSide {
+        std::atomic<std::size_t> head{};
+        std::atomic<std::size_t> done{};
+        std::size_t cached_tail{};
+    };
+
+    const std::size_t capacity;
+    const std::size_t mask;
+    bool stealable;
+    Slot* const slots;
+    ProducerSide producer;
+    ConsumerSide consumer;
+};
+
+#endif /* SPSCQUEUE_H_ */
@@ -0,0 +1,354 @@
+#ifndef SHMRING_H_
+#define SHMRING_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "LogDictionary.h"
+#include "ThreadPlacement.h"
+
+// Layout of the POSIX shared memory the SharedMemory sink logs into and
+// logd reads from
+// header | dictionary | ring 0 | ring 1 | ...
+// Every producer thread gets a byte ring of variable size records, the
+// dictionary is an append only list of LogDictEntry for the call sites,
+// formats and loggers records refer to by id, so records only carry ids and
+// raw bytes
+// Everything committed to a ring stays there for logd when the producer
+// process dies
+
+inline constexpr std::uint64_t shm_magic = 0x4c4f4752494e4731ULL;
+inline constexpr std::uint32_t shm_version = 1;
+
+enum class ShmRecordKind : std::uint16_t {
+    // Rest of the lap is unused
+    Wrap = 0,
+    // Bytes of a PlainBytes registered type
+    Object = 1,
+    // Packed LogFmt arguments
+    Format = 2,
+    // Already rendered on the producer
+    Text = 3,
+};
+
+// Followed by payload_size bytes, size includes both and is a multiple of 8
+struct ShmRecord {
+    std::uint32_t size;
+    ShmRecordKind kind;
+    std::uint16_t type;
+    std::uint32_t call_site;
+    std::uint32_t logger;
+    std::uint32_t format;
+    std::uint32_t payload_size;
+    // TscClock ticks
+    std::uint64_t tsc;
+};
+static_assert(sizeof(ShmRecord) == 32);
+
+struct alignas(64) ShmHeader {
+    // Written last by the producer, logd waits for it
+    std::atomic<std::uint64_t> magic;
+    std::uint32_t version;
+    std::int32_t pid;
+    std::uint64_t ring_bytes;
+    std::uint64_t dictionary_bytes;
+    std::uint32_t max_rings;
+    // Registered types of the producer, logd has to be built with the same
+    std::uint32_t type_count;
+    std::atomic<std::uint32_t> ring_count;
+    // Set by StopLogger, logd exits once the rings are drained
+    std::atomic<std::uint32_t> stopped;
+    std::atomic<std::uint64_t> dictionary_used;
+};
+
+// Indices count bytes since the start and never wrap, the record at a lap
+// boundary that does not fit is preceded by a Wrap record, or by nothing if
+// there is not even room for a ShmRecord
+struct ShmRingControl {
+    alignas(64) std::atomic<std::uint64_t> tail;
+    // Set while a producer thread owns the ring, rings of threads that
+    // exited go to the next new thread
+    std::atomic<std::uint32_t> owned;
+    alignas(64) std::atomic<std::uint64_t> head;
+};
+
+// One side's view of a ring, each side keeps its own copy
+class ShmByteRing {
+   public:
+    ShmByteRing() noexcept = default;
+    ShmByteRing(ShmRingControl* control_, unsigned char* data_,
+                std::uint64_t bytes_) noexcept
+        : control(control_), data(data_), bytes(bytes_), mask(bytes_ - 1) {}
+
+    // Largest record, so a record and the Wrap in front of it always fit
+    inline std::uint64_t MaxRecord() const noexcept { return bytes / 2; }
+
+    // Producer side, one thread at a time, the next owner goes on after the
+    // last record of the previous one whether logd has read it or not
+    inline bool TryOwn() noexcept {
+        std::uint32_t free = 0;
+        return control->owned.load(std::memory_order_relaxed) == 0 &&
+               control->owned.compare_exchange_strong(
+                   free, 1, std::memory_order_acquire);
+    }
+
+    inline void Disown() noexcept {
+        control->owned.store(0, std::memory_order_release);
+    }
+
+    // Producer side, before the first record
+    inline void Prefault() noexcept { ThreadPlacement::Prefault(data, bytes); }
+
+    // Producer side, size a multiple of 8, nullptr when full
+    inline unsigned char* Reserve(const std::uint64_t size) noexcept {
+        auto tail = control->tail.load(std::memory_order_relaxed);
+        const auto contiguous = bytes - (tail & mask);
+        const auto skip = contiguous < size ? contiguous : 0;
+        if (tail + skip + size - cached_head > bytes) {
+            cached_head = control->head.load(std::memory_order_acquire);
+            if (tail + skip + size - cached_head > bytes) {
+                return nullptr;
+            }
+        }
+        if (skip >= sizeof(ShmRecord)) {
+            auto wrap = reinterpret_cast<ShmRecord*>(data + (tail & mask));
+            wrap->size = static_cast<std::uint32_t>(skip);
+            wrap->kind = ShmRecordKind::Wrap;
+        }
+        tail += skip;
+        reserved_tail = tail + size;
+        return data + (tail & mask);
+    }
+
+    // Producer side, makes the reserved record visible
+    inline void Commit() noexcept {
+        control->tail.store(reserved_tail, std::memory_order_release);
+    }
+
+    // Consumer side, oldest record or nullptr
+    inline const ShmRecord* Peek() noexcept {
+        auto head = control->head.load(std::memory_order_relaxed);
+        while (true) {
+            if (head == cached_tail) {
+                cached_tail = control->tail.load(std::memory_order_acquire);
+                if (head == cached_tail) {
+                    return nullptr;
+                }
+            }
+            const auto contiguous = bytes - (head & mask);
+            if (contiguous < sizeof(ShmRecord)) {
+                head += contiguous;
+                control->head.store(head, std::memory_order_release);
+                continue;
+            }
+            auto record =
+                reinterpret_cast<const ShmRecord*>(data + (head & mask));
+            if (record->kind == ShmRecordKind::Wrap) {
+                head += record->size;
+                control->head.store(head, std::memory_order_release);
+                continue;
+            }
+            return record;
+        }
+    }
+
+    // Consumer side, after the record from Peek has been handled
+    inline void Pop(const ShmRecord* record) noexcept {
+        control->head.store(
+            control->head.load(std::memory_order_relaxed) + record->size,
+            std::memory_order_release);
+    }
+
+    inline bool Empty() const noexcept {
+        return control->head.load(std::memory_order_relaxed) ==
+               control->tail.load(std::memory_order_acquire);
+    }
+
+   private:
+    ShmRingControl* control{};
+    unsigned char* data{};
+    std::uint64_t bytes{};
+    std::uint64_t mask{};
+    std::uint64_t cached_head{};
+    std::uint64_t cached_tail{};
+    std::uint64_t reserved_tail{};
+};
+
+class ShmRegion {
+   public:
+    static constexpr std::size_t page_size = 4096;
+
+    ShmRegion() noexcept = default;
+    ShmRegion(const ShmRegion&) = delete;
+    ShmRegion(const ShmRegion&&) = delete;
+    ShmRegion operator=(const ShmRegion&) = delete;
+    ShmRegion operator=(const ShmRegion&&) = delete;
+    ~ShmRegion() noexcept { Close(); }
+
+    // Producer side, replaces whatever had the name before, a logd still
+    // reading the old region keeps it until it is done
+    // ring_bytes is rounded up to a power of two, returns 0 or an errno
+    inline int Create(const std::string& name, std::uint64_t ring_bytes,
+                      const std::uint32_t max_rings,
+                      const std::uint64_t dictionary_bytes,
+                      const std::uint32_t type_count) noexcept {
+        Close();
+        std::uint64_t rounded = page_size;
+        while (rounded < ring_bytes) {
+            rounded <<= 1;
+        }
+        ring_bytes = rounded;
+        const auto size =
+            Layout(ring_bytes, max_rings, dictionary_bytes).total;
+        shm_unlink(name.c_str());
+        const int fd =
+            shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            return errno;
+        }
+        if (ftruncate(fd, size) != 0) {
+            const int error = errno;
+            close(fd);
+            shm_unlink(name.c_str());
+            return error;
+        }
+        if (const int error = Map(fd, size)) {
+            shm_unlink(name.c_str());
+            return error;
+        }
+        header->version = shm_version;
+        header->pid = getpid();
+        header->ring_bytes = ring_bytes;
+        header->dictionary_bytes = dictionary_bytes;
+        header->max_rings = max_rings;
+        header->type_count = type_count;
+        header->magic.store(shm_magic, std::memory_order_release);
+        return 0;
+    }
+
+    // logd side, EAGAIN while the producer has not finished creating it
+    inline int Attach(const std::string& name) noexcept {
+        Close();
+        const int fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+        if (fd < 0) {
+            return errno;
+        }
+        const auto size = lseek(fd, 0, SEEK_END);
+        if (size < static_cast<off_t>(page_size)) {
+            close(fd);
+            return EAGAIN;
+        }
+        if (const int error = Map(fd, size)) {
+            return error;
+        }
+        if (header->magic.load(std::memory_order_acquire) != shm_magic) {
+            Close();
+            return EAGAIN;
+        }
+        if (header->version != shm_version ||
+            Layout(header->ring_bytes, header->max_rings,
+                   header->dictionary_bytes)
+                    .total > mapped_size) {
+            Close();
+            return EINVAL;
+        }
+        return 0;
+    }
+
+    inline void Close() noexcept {
+        if (header) {
+            munmap(header, mapped_size);
+            header = nullptr;
+        }
+    }
+
+    inline bool IsOpen() const noexcept { return header != nullptr; }
+    inline ShmHeader& Header() const noexcept { return *header; }
+
+    inline ShmByteRing Ring(const std::uint32_t index) const noexcept {
+        const auto layout = Layout(header->ring_bytes, header->max_rings,
+                                   header->dictionary_bytes);
+        auto base = reinterpret_cast<unsigned char*>(header) + layout.rings +
+                    index * layout.ring_stride;
+        return {reinterpret_cast<ShmRingControl*>(base),
+                base + sizeof(ShmRingControl), header->ring_bytes};
+    }
+
+    // Producer side, callers serialise, false when the dictionary is full
+    inline bool AddDictEntry(const LogDictKind kind, const std::uint32_t id,
+                             const std::uint64_t (&fields)[4],
+                             std::string_view text_1,
+                             std::string_view text_2 = {}) noexcept {
+        const auto size = LogDictEntrySize(text_1.size() + text_2.size());
+        const auto used =
+            header->dictionary_used.load(std::memory_order_relaxed);
+        if (used + size > header->dictionary_bytes) {
+            return false;
+        }
+        WriteLogDictEntry(Dictionary() + used, kind, id, fields, text_1,
+                          text_2);
+        header->dictionary_used.store(used + size, std::memory_order_release);
+        return true;
+    }
+
+    // logd side, calls handle(entry, text) for every entry after offset and
+    // moves offset past them
+    template <typename Handle>
+    inline void ReadDictionary(std::uint64_t& offset,
+                               Handle&& handle) const noexcept {
+        const auto used =
+            header->dictionary_used.load(std::memory_order_acquire);
+        if (offset < used) {
+            ForEachLogDictEntry(Dictionary() + offset, used - offset, handle);
+            offset = used;
+        }
+    }
+
+   private:
+    struct Offsets {
+        std::uint64_t rings;
+        std::uint64_t ring_stride;
+        std::uint64_t total;
+    };
+
+    static inline Offsets Layout(
+        const std::uint64_t ring_bytes, const std::uint64_t max_rings,
+        const std::uint64_t dictionary_bytes) noexcept {
+        const auto rings = page_size + (dictionary_bytes + page_size - 1) /
+                                           page_size * page_size;
+        const auto stride = (sizeof(ShmRingControl) + ring_bytes + page_size -
+                             1) / page_size * page_size;
+        return {rings, stride, rings + stride * max_rings};
+    }
+
+    inline unsigned char* Dictionary() const noexcept {
+        return reinterpret_cast<unsigned char*>(header) + page_size;
+    }
+
+    inline int Map(const int fd, const std::size_t size) noexcept {
+        auto mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           fd, 0);
+        const int error = errno;
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            return error;
+        }
+        header = static_cast<ShmHeader*>(mapped);
+        mapped_size = size;
+        return 0;
+    }
+
+    ShmHeader* header{};
+    std::size_t mapped_size{};
+};
+
+#endif /* SHMRING_H_ */
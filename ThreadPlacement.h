@@ -0,0 +1,136 @@
+#ifndef THREADPLACEMENT_H_
+#define THREADPLACEMENT_H_
+
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+// Cpu, scheduler and numa placement of the backend thread
+// Every call returns 0 or an errno value so the caller can report what was
+// actually applied
+class ThreadPlacement {
+   public:
+    // Node the cpu belongs to from sysfs, -1 when there is no numa
+    // information
+    static inline int NumaNodeOfCpu(const int cpu) noexcept {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+        auto dir = opendir(path);
+        if (!dir) {
+            return -1;
+        }
+        int node = -1;
+        while (auto entry = readdir(dir)) {
+            if (std::strncmp(entry->d_name, "node", 4) == 0 &&
+                entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+                node = std::atoi(entry->d_name + 4);
+                break;
+            }
+        }
+        closedir(dir);
+        return node;
+    }
+
+    static inline int PinCurrentThread(const int cpu) noexcept {
+        if (cpu < 0 || cpu >= CPU_SETSIZE) {
+            return EINVAL;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    // SCHED_FIFO, needs CAP_SYS_NICE or an rtprio limit
+    static inline int SetRealtime(const int priority) noexcept {
+        sched_param param{};
+        param.sched_priority = priority;
+        return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    }
+
+    // Everything the calling thread faults in from now on comes from node
+    static inline int PreferNodeForCurrentThread(const int node) noexcept {
+        unsigned long mask[max_nodes / (8 * sizeof(unsigned long))]{};
+        if (!SetNode(mask, node)) {
+            return EINVAL;
+        }
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, max_nodes) != 0) {
+            return errno;
+        }
+        return 0;
+    }
+
+    // For memory other threads allocate but the backend mostly touches,
+    // moves the whole pages inside [pointer, pointer + size) to
+    // memory_node, does nothing until a node is set
+    static inline void BindToMemoryNode(void* pointer,
+                                        std::size_t size) noexcept {
+        const int node = memory_node.load(std::memory_order_relaxed);
+        unsigned long mask[max_nodes / (8 * sizeof(unsigned long))]{};
+        if (!SetNode(mask, node)) {
+            return;
+        }
+        static const std::uintptr_t page_size = sysconf(_SC_PAGESIZE);
+        const auto start = reinterpret_cast<std::uintptr_t>(pointer);
+        const auto begin = (start + page_size - 1) & ~(page_size - 1);
+        const auto end = (start + size) & ~(page_size - 1);
+        if (end <= begin) {
+            return;
+        }
+        // Best effort, a failure only costs remote memory accesses
+        syscall(SYS_mbind, begin, end - begin, MPOL_PREFERRED, mask, max_nodes,
+                MPOL_MF_MOVE);
+    }
+
+    // Faults the pages of [pointer, pointer + size) in writable without
+    // changing what is in them, so the first store on the hot path does not
+    // take a page fault, call after BindToMemoryNode
+    static inline void Prefault(void* pointer, std::size_t size) noexcept {
+        static const std::uintptr_t page_size = sysconf(_SC_PAGESIZE);
+        const auto start = reinterpret_cast<std::uintptr_t>(pointer);
+        const auto begin = start & ~(page_size - 1);
+        const auto end = start + size;
+        if (!size || madvise(reinterpret_cast<void*>(begin), end - begin,
+                             MADV_POPULATE_WRITE) == 0) {
+            return;
+        }
+        // Before Linux 5.14, adding 0 writes a page without changing it
+        for (auto page = begin; page < end; page += page_size) {
+            __atomic_fetch_add(reinterpret_cast<char*>(std::max(page, start)),
+                               0, __ATOMIC_RELAXED);
+        }
+    }
+
+    // Set by StartLogger from the backend core
+    static inline std::atomic<int> memory_node{-1};
+
+   private:
+    static constexpr int max_nodes = 1024;
+
+    static inline bool SetNode(unsigned long* mask, const int node) noexcept {
+        if (node < 0 || node >= max_nodes) {
+            return false;
+        }
+        static constexpr int bits = 8 * sizeof(unsigned long);
+        mask[node / bits] |= 1UL << (node % bits);
+        return true;
+    }
+};
+
+#endif /* THREADPLACEMENT_H_ */
@@ -0,0 +1,158 @@
+#ifndef TSCCLOCK_H_
+#define TSCCLOCK_H_
+
+#include <time.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string_view>
+#include <thread>
+
+#include "LogBuffer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define LOGGER_HAS_TSC 1
+#endif
+
+// Producer side timestamps are a raw rdtsc, converted to wall clock time on
+// the backend with a tick rate calibrated against system_clock in
+// StartLogger and re-anchored every resync_interval so drift between the two
+// clocks does not build up
+// Without a tsc the raw value is CLOCK_MONOTONIC nanoseconds
+class TscClock {
+   public:
+    static constexpr std::chrono::nanoseconds resync_interval =
+        std::chrono::seconds(1);
+
+    static inline std::uint64_t Now() noexcept {
+#ifdef LOGGER_HAS_TSC
+        return __rdtsc();
+#else
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+    }
+
+    // Blocks for about calibration_time
+    static inline void Calibrate() noexcept {
+        static constexpr auto calibration_time = std::chrono::milliseconds(10);
+        const auto start = Sample();
+        std::this_thread::sleep_for(calibration_time);
+        const auto end = Sample();
+        first = start;
+        Store(end, NanosPerTick(start, end));
+    }
+
+    // Cheap enough to call on every backend loop, only one caller does the
+    // actual resync
+    static inline void MaybeResync(const std::uint64_t now) noexcept {
+        if (static_cast<std::int64_t>(
+                now - next_resync.load(std::memory_order_relaxed)) < 0) {
+            return;
+        }
+        if (resyncing.exchange(true, std::memory_order_acquire)) {
+            return;
+        }
+        const auto anchor = Sample();
+        // Rate over everything since calibration, the longer the baseline the
+        // smaller the error
+        Store(anchor, NanosPerTick(first, anchor));
+        resyncing.store(false, std::memory_order_release);
+    }
+
+    static inline std::int64_t ToEpochNanos(const std::uint64_t tsc) noexcept {
+        const auto params = Load();
+        const auto ticks = static_cast<std::int64_t>(tsc - params.anchor.tsc);
+        return params.anchor.epoch_ns +
+               static_cast<std::int64_t>(ticks * params.nanos_per_tick);
+    }
+
+    // Rate ToEpochNanos currently converts with, for readers that convert
+    // ticks on their own
+    static inline double CurrentNanosPerTick() noexcept {
+        return Load().nanos_per_tick;
+    }
+
+   private:
+    struct Anchor {
+        std::uint64_t tsc;
+        std::int64_t epoch_ns;
+    };
+
+    struct Params {
+        Anchor anchor;
+        double nanos_per_tick;
+    };
+
+    // system_clock read bracketed by two tsc reads, the tsc taken as the
+    // midpoint
+    static inline Anchor Sample() noexcept {
+        const auto before = Now();
+        const auto epoch_ns =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch())
+                .count();
+        const auto after = Now();
+        return {before + (after - before) / 2, epoch_ns};
+    }
+
+    static inline double NanosPerTick(const Anchor& from,
+                                      const Anchor& to) noexcept {
+        if (to.tsc == from.tsc) {
+            return 1.0;
+        }
+        return static_cast<double>(to.epoch_ns - from.epoch_ns) /
+               static_cast<double>(to.tsc - from.tsc);
+    }
+
+    static inline Params Load() noexcept {
+        Params params;
+        unsigned sequence;
+        do {
+            sequence = seq.load(std::memory_order_acquire);
+            params = current;
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while ((sequence & 1) ||
+                 sequence != seq.load(std::memory_order_relaxed));
+        return params;
+    }
+
+    static inline void Store(const Anchor& anchor,
+                             const double nanos_per_tick) noexcept {
+        const auto sequence = seq.load(std::memory_order_relaxed);
+        seq.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        current = {anchor, nanos_per_tick};
+        seq.store(sequence + 2, std::memory_order_release);
+        next_resync.store(
+            anchor.tsc + static_cast<std::uint64_t>(
+                             resync_interval.count() / nanos_per_tick),
+            std::memory_order_relaxed);
+    }
+
+    static inline Anchor first{};
+    static inline Params current{{0, 0}, 1.0};
+    static inline std::atomic<unsigned> seq{};
+    static inline std::atomic<std::uint64_t> next_resync{};
+    static inline std::atomic<bool> resyncing{};
+};
+
+// Renders epoch nanoseconds with WriteTimestamp into a buffer it keeps, so
+// everything up to the seconds is only rendered again when the second
+// changes
+class TimestampFormatter {
+   public:
+    inline std::string_view Format(const std::int64_t epoch_ns) noexcept {
+        WriteTimestamp(text, epoch_ns, cached_second);
+        return {text, timestamp_length};
+    }
+
+   private:
+    std::int64_t cached_second = no_second;
+    char text[timestamp_length];
+};
+
+#endif /* TSCCLOCK_H_ */
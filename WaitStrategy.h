@@ -0,0 +1,158 @@
+#ifndef WAITSTRATEGY_H_
+#define WAITSTRATEGY_H_
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <thread>
+
+#include "SpinLock.h"
+
+// What the backend does when a pass over the queues found nothing
+// BusySpin      polls again straight away, lowest wake latency, one full core
+// SpinPauseYield polls with pause in between, then yields the core
+// SpinPark      same, then sleeps on a futex until a producer wakes it,
+//               producers pay a fence and a load on every log for this
+enum class WaitStrategy { BusySpin = 0, SpinPauseYield = 1, SpinPark = 2 };
+
+// Consumer side Idle / Busy, producer side Notify
+class BackendWaiter {
+   public:
+    // Idle passes before the backend starts pausing, then yielding or parking
+    static constexpr unsigned spin_passes = 1024;
+    static constexpr unsigned pause_passes = 4096;
+    // Parked backend still wakes up this often to resync the clock and see
+    // run go false if a wake was missed
+    static constexpr long park_timeout_ns = 100000000;
+
+    inline void SetStrategy(const WaitStrategy strategy_) noexcept {
+        strategy = strategy_;
+        notify = strategy_ == WaitStrategy::SpinPark;
+    }
+
+    inline WaitStrategy Strategy() const noexcept { return strategy; }
+
+    // Something was processed
+    inline void Busy() noexcept { idle_passes = 0; }
+
+    // Nothing was processed, has_work re-checks the queues after the backend
+    // has announced that it is going to sleep so a log that raced with it is
+    // not missed
+    template <typename HasWork>
+    inline void Idle(HasWork&& has_work) noexcept {
+        if (strategy == WaitStrategy::BusySpin) {
+            return;
+        }
+        idle_passes++;
+        if (idle_passes <= spin_passes) {
+            return;
+        }
+        if (idle_passes <= spin_passes + pause_passes) {
+            CpuRelax();
+            return;
+        }
+        if (strategy == WaitStrategy::SpinPauseYield) {
+            std::this_thread::yield();
+            return;
+        }
+        parked.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!has_work()) {
+            parks++;
+            const timespec timeout{0, park_timeout_ns};
+            syscall(SYS_futex, &parked, FUTEX_WAIT_PRIVATE, 1, &timeout,
+                    nullptr, 0);
+        }
+        parked.store(0, std::memory_order_relaxed);
+        idle_passes = 0;
+    }
+
+    // Producer side, after the entry is in the queue
+    inline void Notify() noexcept {
+        if (!notify) {
+            return;
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parked.load(std::memory_order_relaxed)) {
+            Wake();
+        }
+    }
+
+    inline void Wake() noexcept {
+        if (parked.exchange(0, std::memory_order_relaxed)) {
+            syscall(SYS_futex, &parked, FUTEX_WAKE_PRIVATE, 1, nullptr,
+                    nullptr, 0);
+        }
+    }
+
+    // Times the backend went to sleep
+    inline unsigned long Parks() const noexcept { return parks; }
+
+   private:
+    // Set before the backend starts, read by producers
+    WaitStrategy strategy = WaitStrategy::BusySpin;
+    bool notify{};
+    // Only written when the backend parks, so producers reading it keep it
+    // shared in their caches
+    alignas(64) std::atomic<std::uint32_t> parked{};
+    // Backend only
+    alignas(64) unsigned idle_passes{};
+    unsigned long parks{};
+};
+
+// Producers that block on a full queue sleep here until the backend has
+// made room, the backend only makes a syscall when someone is waiting
+class QueueSpaceWaiter {
+   public:
+    // Producer side, try_push is retried until it succeeds
+    template <typename TryPush>
+    inline void Wait(TryPush&& try_push) noexcept {
+        for (unsigned i = 0; i < spin_tries; i++) {
+            CpuRelax();
+            if (try_push()) {
+                return;
+            }
+        }
+        while (true) {
+            const auto epoch = space_epoch.load(std::memory_order_relaxed);
+            waiting.fetch_add(1, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (try_push()) {
+                waiting.fetch_sub(1, std::memory_order_relaxed);
+                return;
+            }
+            const timespec timeout{0, wait_timeout_ns};
+            syscall(SYS_futex, &space_epoch, FUTEX_WAIT_PRIVATE, epoch,
+                    &timeout, nullptr, 0);
+            waiting.fetch_sub(1, std::memory_order_relaxed);
+            if (try_push()) {
+                return;
+            }
+        }
+    }
+
+    // Backend side, after entries were released
+    inline void Notify() noexcept {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed)) {
+            space_epoch.fetch_add(1, std::memory_order_relaxed);
+            syscall(SYS_futex, &space_epoch, FUTEX_WAKE_PRIVATE, INT_MAX,
+                    nullptr, nullptr, 0);
+        }
+    }
+
+   private:
+    static constexpr unsigned spin_tries = 256;
+    // In case a wake is missed
+    static constexpr long wait_timeout_ns = 1000000;
+
+    alignas(64) std::atomic<std::uint32_t> space_epoch{};
+    std::atomic<std::uint32_t> waiting{};
+};
+
+#endif /* WAITSTRATEGY_H_ */
@@ -0,0 +1,79 @@
+#ifndef BENCHTYPES_H_
+#define BENCHTYPES_H_
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "LoggerTypeRegistry.h"
+#include "latency_profile.h"
+
+// Types for the benchmarks, built with
+// -DLOGGER_TYPES_HEADER='"benchmarks/BenchTypes.h"'
+
+inline std::int64_t SteadyNanos() noexcept {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Backend records how long after sent it got to the message
+struct WakeProbe {
+    static constexpr bool plain_bytes = true;
+
+    std::int64_t sent;
+
+    static inline std::vector<std::int64_t> latencies;
+
+    inline void print(std::string* data_to_print) const noexcept {
+        latencies.push_back(SteadyNanos() - sent);
+        data_to_print->assign("probe");
+    }
+};
+
+// logger_bench payloads, the backend records sent to rendered in
+// nanoseconds, only one backend worker may be running
+inline LatencyHistogram rendered_latencies;
+
+// Fits in the queue entry
+struct BenchSmall {
+    static constexpr bool plain_bytes = true;
+
+    std::int64_t sent;
+    int value;
+
+    inline void print(LogBuffer& out) const noexcept {
+        rendered_latencies.record(SteadyNanos() - sent);
+        out.Append("small ");
+        out.AppendInteger(value);
+    }
+};
+
+// Does not, always goes through the mempool
+struct BenchLarge {
+    static constexpr bool plain_bytes = true;
+    static constexpr std::size_t text_size = 240;
+
+    std::int64_t sent;
+    char text[text_size];
+
+    BenchLarge() noexcept = default;
+    explicit BenchLarge(const std::int64_t _sent) noexcept : sent(_sent) {
+        std::memset(text, 'x', text_size - 1);
+        text[text_size - 1] = '\0';
+    }
+
+    inline void print(LogBuffer& out) const noexcept {
+        rendered_latencies.record(SteadyNanos() - sent);
+        out.Append("large ");
+        out.Append(std::string_view(text));
+    }
+};
+
+using RegisteredLoggerTypes =
+    LoggerTypeList<WakeProbe, BenchSmall, BenchLarge>;
+
+#endif /* BENCHTYPES_H_ */
@@ -0,0 +1,213 @@
+// Compression ratio and throughput trade-off on the output of the example
+// LoggerTypes, every configuration runs in its own child process
+// One line per sink and compression mode starting with sink=, key=value
+// pairs
+// msgs_per_sec  from the first log until the file is closed, so the time
+//               to compress and write the last buffers is included
+// stream_bytes  what the file holds once decompressed
+// file_bytes    what it takes on disk
+// Then one line starting with codec= for LzCodec alone on the text output,
+// one FileOptions::buffer_size block at a time like the frames
+// compression_bench [messages per thread] [threads]
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CompressedFrames.h"
+#include "Logger.h"
+
+struct Mode {
+    const char* name;
+    Compression compression;
+    bool thread;
+};
+
+static const Mode all_modes[] = {
+    {"none", Compression::None, false},
+    {"lz", Compression::Lz, false},
+    {"lz_thread", Compression::Lz, true},
+};
+
+static const char* Name(const SinkType sink) noexcept {
+    return sink == SinkType::Binary ? "binary" : "sync";
+}
+
+// A mix of pooled and inline objects and LogFmt with time and location, the
+// way an application's log usually looks
+static void LogOne(Logger& logger, const int thread, const int i) noexcept {
+    switch (i % 4) {
+        case 0: {
+            auto data = Logger::getObj<LoggerType1>();
+            data->number = i;
+            Logger::Log(&logger, LOGGER_CALLSITE(true, true, true), data);
+            break;
+        }
+        case 1:
+            Logger::LogEmplace<LoggerType2>(
+                &logger, LOGGER_CALLSITE(true, false, true), thread,
+                static_cast<char>('a' + i % 26));
+            break;
+        default:
+            Logger::LogFmt<"order {} price {:.2f} qty {}">(
+                &logger, LOGGER_CALLSITE(true, true, true), i, i * 0.25,
+                i & 1023);
+            break;
+    }
+}
+
+// Uncompressed size through FrameReader and size on disk
+static void FileSizes(const std::string& path, unsigned long* stream_bytes,
+                      unsigned long* file_bytes) noexcept {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path.c_str());
+        return;
+    }
+    FrameReader frames;
+    frames.Open(fd);
+    *stream_bytes += frames.Size();
+    *file_bytes += lseek(fd, 0, SEEK_END);
+    close(fd);
+}
+
+static void Codec(const std::string& path, const std::size_t block) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path.c_str());
+        return;
+    }
+    std::vector<unsigned char> input(lseek(fd, 0, SEEK_END));
+    if (pread(fd, input.data(), input.size(), 0) !=
+        static_cast<ssize_t>(input.size())) {
+        perror(path.c_str());
+    }
+    close(fd);
+
+    std::vector<unsigned char> compressed(LzCodec::CompressBound(block));
+    std::vector<unsigned char> output(block);
+    const auto table = std::make_unique<std::uint32_t[]>(LzCodec::table_size);
+    std::chrono::duration<double> compress_time{};
+    std::chrono::duration<double> decompress_time{};
+    unsigned long stored = 0;
+    bool intact = true;
+    for (std::size_t offset = 0; offset < input.size(); offset += block) {
+        const auto length = std::min(block, input.size() - offset);
+        const auto start = std::chrono::steady_clock::now();
+        const auto size = LzCodec::Compress(input.data() + offset, length,
+                                            compressed.data(), table.get());
+        const auto middle = std::chrono::steady_clock::now();
+        intact &= LzCodec::Decompress(compressed.data(), size, output.data(),
+                                      length) &&
+                  std::equal(output.begin(), output.begin() + length,
+                             input.begin() + offset);
+        decompress_time += std::chrono::steady_clock::now() - middle;
+        compress_time += middle - start;
+        stored += size;
+    }
+    const double megabytes = static_cast<double>(input.size()) / (1 << 20);
+    printf(
+        "codec=lz block_bytes=%zu input_bytes=%zu stored_bytes=%lu "
+        "ratio=%.2f compress_mb_per_sec=%.0f decompress_mb_per_sec=%.0f "
+        "intact=%d\n",
+        block, input.size(), stored,
+        static_cast<double>(input.size()) / static_cast<double>(stored),
+        megabytes / compress_time.count(), megabytes / decompress_time.count(),
+        intact);
+}
+
+static void Run(const SinkType sink, const Mode& mode, const int threads,
+                const int messages) {
+    LoggerOptions options;
+    options.start_thread = true;
+    options.sink = sink;
+    Logger::StartLogger(options);
+    FileOptions file_options;
+    file_options.compression = mode.compression;
+    file_options.compression_thread = mode.thread;
+    const std::string filename =
+        "compression_bench_" + std::to_string(getpid()) + ".log";
+    auto logger = new Logger(filename, file_options);
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> producers;
+    for (int t = 0; t < threads; t++) {
+        producers.emplace_back([&, t] {
+            for (int i = 0; i < messages; i++) {
+                LogOne(*logger, t, i);
+            }
+        });
+    }
+    for (auto& producer : producers) {
+        producer.join();
+    }
+    Logger::StopLogger();
+    delete logger;
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    // FileWrapper adds the pid and the file number
+    const auto prefix = filename + "_" + std::to_string(getpid()) + "_";
+    std::vector<std::string> files;
+    for (int count = 0;; count++) {
+        const auto path = prefix + (count < 10 ? "0" : "") +
+                          std::to_string(count);
+        if (access(path.c_str(), F_OK) != 0) {
+            break;
+        }
+        files.push_back(path);
+    }
+    unsigned long stream_bytes = 0;
+    unsigned long file_bytes = 0;
+    for (const auto& path : files) {
+        FileSizes(path, &stream_bytes, &file_bytes);
+    }
+    const double total = static_cast<double>(threads) * messages;
+    printf(
+        "sink=%s compression=%s threads=%d messages=%.0f msgs_per_sec=%.0f "
+        "stream_bytes=%lu file_bytes=%lu ratio=%.2f\n",
+        Name(sink), mode.name, threads, total, total / elapsed.count(),
+        stream_bytes, file_bytes,
+        file_bytes ? static_cast<double>(stream_bytes) /
+                         static_cast<double>(file_bytes)
+                   : 0.0);
+    if (sink == SinkType::Sync && mode.compression == Compression::None &&
+        !files.empty()) {
+        Codec(files.front(), file_options.buffer_size);
+    }
+    for (const auto& path : files) {
+        unlink(path.c_str());
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    const int messages = argc > 1 ? std::atoi(argv[1]) : 200000;
+    const int threads = argc > 2 ? std::atoi(argv[2]) : 1;
+    for (const auto sink : {SinkType::Sync, SinkType::Binary}) {
+        for (const auto& mode : all_modes) {
+            const pid_t child = fork();
+            if (child == 0) {
+                Run(sink, mode, threads, messages);
+                _exit(0);
+            }
+            int status = 0;
+            waitpid(child, &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr,
+                        "compression_bench: sink=%s compression=%s failed\n",
+                        Name(sink), mode.name);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
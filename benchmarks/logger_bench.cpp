@@ -0,0 +1,260 @@
+// Hot path benchmark over producer threads, payload, call site flags and
+// sink, every combination runs in its own child process so max_rss_kb is
+// that configuration's high water mark and no state carries over
+// One line per configuration starting with threads=, key=value pairs, the
+// logger's own messages are printed in between
+// producer_*  ns spent in getObj and Log or LogEmplace or LogFmt, includes
+//             the cost of reading the clock around it
+// render_*    ns from the producer starting the log until the backend has
+//             rendered the message, before it is written out, -1 for fmt
+//             payloads and the binary sink since those are written without
+//             calling back into the benchmark
+// msgs_per_sec  from the first log until StopLogger has drained and flushed
+// logger_bench [messages per thread] [threads] [payloads] [flags] [sinks]
+// where each list is comma separated, e.g.
+// logger_bench 100000 1,4 small_inline,fmt none sync,mmap
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Logger.h"
+
+enum class Payload { SmallPool, SmallInline, Large, Fmt };
+
+struct Flags {
+    const char* name;
+    bool log_time;
+    bool log_location;
+};
+
+struct BenchConfig {
+    int threads;
+    Payload payload;
+    Flags flags;
+    SinkType sink;
+};
+
+static const char* Name(const Payload payload) noexcept {
+    switch (payload) {
+        case Payload::SmallPool:
+            return "small_pool";
+        case Payload::SmallInline:
+            return "small_inline";
+        case Payload::Large:
+            return "large";
+        case Payload::Fmt:
+            return "fmt";
+    }
+    return "";
+}
+
+static const char* Name(const SinkType sink) noexcept {
+    switch (sink) {
+        case SinkType::Sync:
+            return "sync";
+        case SinkType::IoUring:
+            return "io_uring";
+        case SinkType::Mmap:
+            return "mmap";
+        case SinkType::SharedMemory:
+            return "shm";
+        case SinkType::Binary:
+            return "binary";
+    }
+    return "";
+}
+
+static const Flags all_flags[] = {
+    {"none", false, false},
+    {"time", true, false},
+    {"time_location", true, true},
+};
+
+// Comma separated names out of choices, all of them for "all"
+template <typename T, typename NameOf>
+static std::vector<T> Parse(const char* arg, const std::vector<T>& choices,
+                            NameOf&& name_of) {
+    if (!arg || std::string(arg) == "all") {
+        return choices;
+    }
+    std::vector<T> picked;
+    std::stringstream list(arg);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        bool found = false;
+        for (const auto& choice : choices) {
+            if (item == name_of(choice)) {
+                picked.push_back(choice);
+                found = true;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "logger_bench: unknown value %s\n", item.c_str());
+            std::exit(1);
+        }
+    }
+    return picked;
+}
+
+static std::uint64_t Percentile(const LatencyHistogram& histogram,
+                                const double percentile) noexcept {
+    const auto target = static_cast<unsigned long>(
+        percentile / 100 * static_cast<double>(histogram.count()));
+    unsigned long seen = 0;
+    for (std::size_t i = 0; i < histogram.bucket_count(); i++) {
+        seen += histogram.bucket(i);
+        if (seen > target) {
+            return histogram.value_at(i);
+        }
+    }
+    return histogram.max();
+}
+
+static void LogOne(Logger& logger, const Payload payload,
+                   const CallSiteId site, const int i) noexcept {
+    switch (payload) {
+        case Payload::SmallPool: {
+            auto data = Logger::getObj<BenchSmall>();
+            data->sent = SteadyNanos();
+            data->value = i;
+            Logger::Log(&logger, site, data);
+            break;
+        }
+        case Payload::SmallInline:
+            Logger::LogEmplace<BenchSmall>(&logger, site, SteadyNanos(), i);
+            break;
+        case Payload::Large:
+            Logger::LogEmplace<BenchLarge>(&logger, site, SteadyNanos());
+            break;
+        case Payload::Fmt:
+            Logger::LogFmt<"order {} price {:.2f} qty {}">(&logger, site, i,
+                                                          i * 0.25, i & 1023);
+            break;
+    }
+}
+
+static void Run(const BenchConfig& config, const int messages) {
+    LoggerOptions options;
+    options.start_thread = true;
+    options.sink = config.sink;
+    Logger::StartLogger(options);
+    const std::string filename =
+        "logger_bench_" + std::to_string(getpid()) + ".log";
+    auto logger = new Logger(filename);
+    const auto site = CallSiteRegistry::Intern(std::source_location::current(),
+                                               config.flags.log_time,
+                                               config.flags.log_location, true);
+
+    std::vector<LatencyHistogram> producer_latencies(config.threads);
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> producers;
+    for (int t = 0; t < config.threads; t++) {
+        producers.emplace_back([&, t] {
+            auto& latencies = producer_latencies[t];
+            for (int i = 0; i < messages; i++) {
+                const auto before = ProfilingClock::Start();
+                LogOne(*logger, config.payload, site, i);
+                latencies.record(ProfilingClock::End() - before);
+            }
+        });
+    }
+    for (auto& producer : producers) {
+        producer.join();
+    }
+    Logger::StopLogger();
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    delete logger;
+    // FileWrapper adds the pid and the file number
+    unlink((filename + "_" + std::to_string(getpid()) + "_00").c_str());
+
+    LatencyHistogram producer;
+    for (const auto& latencies : producer_latencies) {
+        producer.merge(latencies);
+    }
+    const double nanos_per_tick = ProfilingClock::NanosPerTick();
+    auto producer_ns = [&](const double percentile) {
+        return static_cast<long>(Percentile(producer, percentile) *
+                                 nanos_per_tick);
+    };
+    auto render_ns = [&](const double percentile) {
+        return rendered_latencies.empty()
+                   ? -1L
+                   : static_cast<long>(
+                         Percentile(rendered_latencies, percentile));
+    };
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    const double total = static_cast<double>(config.threads) * messages;
+
+    printf(
+        "threads=%d payload=%s flags=%s sink=%s messages=%.0f "
+        "producer_p50_ns=%ld producer_p99_ns=%ld producer_p999_ns=%ld "
+        "producer_max_ns=%ld render_p50_ns=%ld render_p99_ns=%ld "
+        "render_p999_ns=%ld render_max_ns=%ld msgs_per_sec=%.0f "
+        "max_rss_kb=%ld\n",
+        config.threads, Name(config.payload), config.flags.name,
+        Name(config.sink), total, producer_ns(50), producer_ns(99),
+        producer_ns(99.9), static_cast<long>(producer.max() * nanos_per_tick),
+        render_ns(50), render_ns(99), render_ns(99.9),
+        rendered_latencies.empty()
+            ? -1L
+            : static_cast<long>(rendered_latencies.max()),
+        total / elapsed.count(), usage.ru_maxrss);
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    const int messages = argc > 1 ? std::atoi(argv[1]) : 100000;
+    const auto threads = Parse<int>(
+        argc > 2 ? argv[2] : nullptr, {1, 2, 4},
+        [](const int count) { return std::to_string(count); });
+    const auto payloads = Parse<Payload>(
+        argc > 3 ? argv[3] : nullptr,
+        {Payload::SmallPool, Payload::SmallInline, Payload::Large,
+         Payload::Fmt},
+        [](const Payload payload) { return std::string(Name(payload)); });
+    const auto flags = Parse<Flags>(
+        argc > 4 ? argv[4] : nullptr,
+        std::vector<Flags>(std::begin(all_flags), std::end(all_flags)),
+        [](const Flags& flag) { return std::string(flag.name); });
+    const auto sinks = Parse<SinkType>(
+        argc > 5 ? argv[5] : nullptr,
+        {SinkType::Sync, SinkType::IoUring, SinkType::Mmap, SinkType::Binary},
+        [](const SinkType sink) { return std::string(Name(sink)); });
+
+    for (const auto thread_count : threads) {
+        for (const auto payload : payloads) {
+            for (const auto& flag : flags) {
+                for (const auto sink : sinks) {
+                    const BenchConfig config{thread_count, payload, flag,
+                                             sink};
+                    const pid_t child = fork();
+                    if (child == 0) {
+                        Run(config, messages);
+                        _exit(0);
+                    }
+                    int status = 0;
+                    waitpid(child, &status, 0);
+                    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                        fprintf(stderr,
+                                "logger_bench: threads=%d payload=%s flags=%s "
+                                "sink=%s failed\n",
+                                thread_count, Name(payload), flag.name,
+                                Name(sink));
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+// Wake up latency against idle cpu cost of each backend WaitStrategy
+// For every strategy the backend is first left idle to measure the cpu it
+// burns, then woken up by single messages spaced far enough apart that it
+// has gone all the way to its slowest wait state
+// One line per strategy, key=value pairs
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+
+#include "Logger.h"
+
+static double CpuSeconds() noexcept {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static const char* Name(WaitStrategy strategy) noexcept {
+    switch (strategy) {
+        case WaitStrategy::BusySpin:
+            return "BusySpin";
+        case WaitStrategy::SpinPauseYield:
+            return "SpinPauseYield";
+        case WaitStrategy::SpinPark:
+            return "SpinPark";
+    }
+    return "";
+}
+
+int main(int argc, char** argv) {
+    const int wakes = argc > 1 ? std::atoi(argv[1]) : 200;
+    const auto idle_time = std::chrono::milliseconds(500);
+    const auto gap = std::chrono::milliseconds(2);
+
+    for (auto strategy : {WaitStrategy::BusySpin, WaitStrategy::SpinPauseYield,
+                          WaitStrategy::SpinPark}) {
+        LoggerOptions options;
+        options.start_thread = true;
+        options.core_id = argc > 2 ? std::atoi(argv[2]) : -1;
+        options.wait_strategy = strategy;
+        Logger::StartLogger(options);
+        Logger logger("wait_strategy_bench");
+        const auto site = LOGGER_CALLSITE(false, false, true);
+
+        // Main thread sleeps, so this is all the backend
+        const auto cpu_before = CpuSeconds();
+        std::this_thread::sleep_for(idle_time);
+        const auto idle_cpu = (CpuSeconds() - cpu_before) /
+                              std::chrono::duration<double>(idle_time).count();
+
+        WakeProbe::latencies.clear();
+        for (int i = 0; i < wakes; i++) {
+            std::this_thread::sleep_for(gap);
+            Logger::LogEmplace<WakeProbe>(&logger, site, SteadyNanos());
+        }
+        Logger::StopLogger();
+
+        auto& latencies = WakeProbe::latencies;
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) {
+            return latencies[std::min(latencies.size() - 1,
+                                      static_cast<std::size_t>(
+                                          p / 100 * latencies.size()))];
+        };
+        printf(
+            "strategy=%s idle_cpu_pct=%.1f wake_p50_ns=%ld wake_p90_ns=%ld "
+            "wake_p99_ns=%ld wake_max_ns=%ld\n",
+            Name(strategy), idle_cpu * 100, percentile(50), percentile(90),
+            percentile(99), latencies.back());
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+// Backend throughput against the number of workers
+// files producer threads each log messages to their own Logger, timed from
+// the first log until StopLogger has drained and flushed everything
+// One line per worker count, key=value pairs
+// worker_scaling_bench [files] [messages per file] [max workers]
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Logger.h"
+
+int main(int argc, char** argv) {
+    const int files = argc > 1 ? std::atoi(argv[1]) : 8;
+    const int messages = argc > 2 ? std::atoi(argv[2]) : 200000;
+    const std::size_t max_workers = argc > 3 ? std::atoi(argv[3]) : 8;
+
+    for (std::size_t workers = 1; workers <= max_workers; workers *= 2) {
+        LoggerOptions options;
+        options.start_thread = true;
+        options.worker_count = workers;
+        options.wait_strategy = WaitStrategy::SpinPauseYield;
+        Logger::StartLogger(options);
+        std::vector<std::unique_ptr<Logger>> loggers;
+        for (int i = 0; i < files; i++) {
+            loggers.push_back(std::make_unique<Logger>(
+                "worker_scaling_bench_" + std::to_string(i)));
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> producers;
+        for (int i = 0; i < files; i++) {
+            producers.emplace_back([&logger = *loggers[i], messages] {
+                const auto site = LOGGER_CALLSITE(true, false, true);
+                for (int j = 0; j < messages; j++) {
+                    Logger::LogFmt<"order {} price {:.2f} qty {}">(
+                        &logger, site, j, j * 0.25, j & 1023);
+                }
+            });
+        }
+        for (auto& producer : producers) {
+            producer.join();
+        }
+        Logger::StopLogger();
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        loggers.clear();
+
+        const double total = static_cast<double>(files) * messages;
+        printf("workers=%zu files=%d messages=%.0f seconds=%.3f "
+               "msgs_per_sec=%.0f\n",
+               workers, files, total, elapsed.count(),
+               total / elapsed.count());
+    }
+    return 0;
+}
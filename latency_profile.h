@@ -1,71 +1,261 @@
 #ifndef LATENCY_PROFILE_H_
 #define LATENCY_PROFILE_H_
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <ctime>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
 #if TEST_LATENCY_CALCULATIONS
 #include <iostream>
 #endif
 
 #define NANO_MULTIPLIER 1000000000
 
+// Timestamps for profiling, rdtsc fenced so the measured code can not be
+// reordered around it, converted to nanoseconds only when stats are printed
+// The tick rate is measured against steady_clock over everything since
+// startup
+// Without a tsc the ticks are CLOCK_MONOTONIC nanoseconds
+class ProfilingClock {
+   public:
+    // Waits for everything before it to finish before reading the counter
+    static inline std::uint64_t Start() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+        _mm_lfence();
+        return __rdtsc();
+#else
+        return Monotonic();
+#endif
+    }
+
+    // rdtscp waits for the measured code, the fence keeps what follows
+    // from starting early
+    static inline std::uint64_t End() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned aux;
+        const auto ticks = __rdtscp(&aux);
+        _mm_lfence();
+        return ticks;
+#else
+        return Monotonic();
+#endif
+    }
+
+    // Sleeps if the process is less than min_calibration old
+    static inline double NanosPerTick() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+        static constexpr auto min_calibration = std::chrono::milliseconds(10);
+        auto now = std::chrono::steady_clock::now();
+        if (now - anchor.time < min_calibration) {
+            std::this_thread::sleep_for(min_calibration - (now - anchor.time));
+            now = std::chrono::steady_clock::now();
+        }
+        const auto ticks = End();
+        const std::chrono::duration<double, std::nano> elapsed =
+            now - anchor.time;
+        return elapsed.count() / static_cast<double>(ticks - anchor.ticks);
+#else
+        return 1.0;
+#endif
+    }
+
+   private:
+    static inline std::uint64_t Monotonic() noexcept {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<std::uint64_t>(ts.tv_sec) * NANO_MULTIPLIER +
+               ts.tv_nsec;
+    }
+
+    struct Anchor {
+        std::uint64_t ticks;
+        std::chrono::steady_clock::time_point time;
+    };
+    static inline const Anchor anchor{Start(),
+                                      std::chrono::steady_clock::now()};
+};
+
+// Log linear histogram, HDR style
+// Values below 2^precision_bits get a bucket each, above that every power of
+// two is split into 2^(precision_bits - 1) buckets, so the relative error is
+// below 2^(1 - precision_bits) (under 1% for the default 8)
+// Recording is a count increment at a computed index, all buckets are
+// allocated up front
+// Only one thread records, any thread may read or merge from it at the same
+// time, every field is accessed through relaxed atomic_refs for that
+class LatencyHistogram {
+   public:
+    static constexpr unsigned default_precision_bits = 8;
+    // Anything at or above 2^40 lands in the last bucket
+    static constexpr unsigned max_value_bits = 40;
+
+    explicit LatencyHistogram(
+        const unsigned precision_bits_ = default_precision_bits) noexcept
+        : precision_bits(precision_bits_ < 2    ? 2
+                         : precision_bits_ > 20 ? 20
+                                                : precision_bits_),
+          sub_bucket_count(1UL << precision_bits),
+          counts(sub_bucket_count +
+                     (max_value_bits - precision_bits + 1) *
+                         (sub_bucket_count / 2),
+                 0) {}
+
+    // Recording thread only
+    inline void record(const unsigned long value) noexcept {
+        auto& bucket_ = counts[index_of(value)];
+        Store(bucket_, bucket_ + 1);
+        Store(total_count, total_count + 1);
+        Store(total_sum, total_sum + value);
+        if (value < min_value) {
+            Store(min_value, value);
+        }
+        if (value > max_value) {
+            Store(max_value, value);
+        }
+    }
+
+    // Both need the same precision, other may still be recording
+    inline void merge(const LatencyHistogram& other) noexcept {
+        for (std::size_t i = 0; i < counts.size() && i < other.counts.size();
+             i++) {
+            Store(counts[i], counts[i] + Load(other.counts[i]));
+        }
+        Store(total_count, total_count + Load(other.total_count));
+        Store(total_sum, total_sum + Load(other.total_sum));
+        Store(min_value, std::min(min_value, Load(other.min_value)));
+        Store(max_value, std::max(max_value, Load(other.max_value)));
+    }
+
+    inline void reset() noexcept {
+        for (auto& bucket_ : counts) {
+            Store(bucket_, 0);
+        }
+        Store(total_count, 0);
+        Store(total_sum, 0);
+        Store(min_value, ~0UL);
+        Store(max_value, 0);
+    }
+
+    inline bool empty() const noexcept { return count() == 0; }
+    inline unsigned long count() const noexcept { return Load(total_count); }
+    inline unsigned long sum() const noexcept { return Load(total_sum); }
+    inline unsigned long min() const noexcept { return Load(min_value); }
+    inline unsigned long max() const noexcept { return Load(max_value); }
+    inline std::size_t bucket_count() const noexcept { return counts.size(); }
+    inline unsigned long bucket(std::size_t index) const noexcept {
+        return Load(counts[index]);
+    }
+
+    // Highest value that falls into the bucket, clamped to the largest value
+    // recorded
+    inline unsigned long value_at(const std::size_t index) const noexcept {
+        unsigned long value;
+        if (index < sub_bucket_count) {
+            value = index;
+        } else {
+            const auto half = sub_bucket_count / 2;
+            const auto shift = (index - sub_bucket_count) / half + 1;
+            const auto mantissa = (index - sub_bucket_count) % half + half;
+            value = ((mantissa + 1) << shift) - 1;
+        }
+        return std::min(value, max());
+    }
+
+   private:
+    static inline unsigned long Load(const unsigned long& field) noexcept {
+        return std::atomic_ref<unsigned long>(
+                   const_cast<unsigned long&>(field))
+            .load(std::memory_order_relaxed);
+    }
+
+    static inline void Store(unsigned long& field,
+                             const unsigned long value) noexcept {
+        std::atomic_ref<unsigned long>(field).store(value,
+                                                    std::memory_order_relaxed);
+    }
+
+    inline std::size_t index_of(const unsigned long value) const noexcept {
+        if (value < sub_bucket_count) {
+            return value;
+        }
+        const unsigned msb = 63 - __builtin_clzl(value);
+        if (msb >= max_value_bits) {
+            return counts.size() - 1;
+        }
+        const unsigned shift = msb - precision_bits + 1;
+        const auto half = sub_bucket_count / 2;
+        return sub_bucket_count + (shift - 1) * half + (value >> shift) - half;
+    }
+
+    const unsigned precision_bits;
+    const unsigned long sub_bucket_count;
+    std::vector<unsigned long> counts;
+    unsigned long total_count{};
+    unsigned long total_sum{};
+    unsigned long min_value = ~0UL;
+    unsigned long max_value{};
+};
+
+// Samples are ProfilingClock ticks, get_the_stats prints nanoseconds
 class LatencyProfilingStats {
    private:
     bool started_{};
-    std::timespec startTime{}, endTime{};
-    std::map<unsigned long, unsigned long> latencies;
+    std::uint64_t start_ticks{};
+    LatencyHistogram latencies;
     const std::string identifier;
 
    public:
-    std::string get_the_stats() noexcept {
+    std::string get_the_stats() const noexcept {
         if (latencies.empty()) {
             return "Latency of " + identifier + " Is empty";
         }
+        const double nanos_per_tick = ProfilingClock::NanosPerTick();
+        auto nanos = [nanos_per_tick](const unsigned long ticks) {
+            return static_cast<unsigned long>(ticks * nanos_per_tick + 0.5);
+        };
 
-        unsigned long n = 0;
-        unsigned long total_sum = 0;
+        const unsigned long n = latencies.count();
         unsigned long mean = 0;
         unsigned long median = 0;
         std::vector<unsigned long> mode;
         unsigned long max_count = 0;
-        unsigned long lower_range = 1000000;
-        unsigned long upper_range = 0;
 
         std::map<double, unsigned long> percentiles_values = {
             {1, 0},  {10, 0},   {25, 0},    {50, 0},     {75, 0},     {90, 0},
             {99, 0}, {99.9, 0}, {99.99, 0}, {99.999, 0}, {99.9999, 0}};
 
-        for (auto it = latencies.begin(); it != latencies.end(); it++) {
-            n += it->second;                      // Total number of elements
-            total_sum += it->first * it->second;  // Total summation of elements
-
-            // Lower Range
-            if (lower_range > it->first) {
-                lower_range = it->first;
+        for (std::size_t i = 0; i < latencies.bucket_count(); i++) {
+            const auto bucket_count = latencies.bucket(i);
+            if (!bucket_count) {
+                continue;
             }
-
-            // Upper Range
-            if (upper_range < it->first) {
-                upper_range = it->first;
-            }
-
             // Mode calculation
-            if (max_count < it->second) {
-                max_count = it->second;
+            if (max_count < bucket_count) {
+                max_count = bucket_count;
                 mode.clear();
-                mode.push_back(it->first);
-            } else if (max_count == it->second) {
-                mode.push_back(it->first);
+                mode.push_back(nanos(latencies.value_at(i)));
+            } else if (max_count == bucket_count) {
+                mode.push_back(nanos(latencies.value_at(i)));
             }
 
 #if TEST_LATENCY_CALCULATIONS
-            std::cout << it->first << ": " << it->second << std::endl;
+            std::cout << nanos(latencies.value_at(i)) << ": " << bucket_count
+                      << std::endl;
 #endif
         }
 
@@ -75,20 +265,24 @@ class LatencyProfilingStats {
         }
 
         unsigned long counter = 0;
-        auto it = latencies.begin();
+        std::size_t i = 0;
         auto it1 = percentiles_values.begin();
 
-        while (it1 != percentiles_values.end() && it != latencies.end()) {
-            if (counter + it->second < it1->second) {
-                counter += it->second;
-                it++;
+        // Empty buckets are skipped, a target of 0 lands on the smallest
+        // value recorded rather than on bucket 0
+        while (it1 != percentiles_values.end() &&
+               i < latencies.bucket_count()) {
+            const auto bucket_count = latencies.bucket(i);
+            if (!bucket_count || counter + bucket_count < it1->second) {
+                counter += bucket_count;
+                i++;
             } else {
-                it1->second = it->first;
+                it1->second = nanos(latencies.value_at(i));
                 it1++;
             }
         }
 
-        mean = total_sum / n;
+        mean = nanos(latencies.sum() / n);
         median = percentiles_values[50];
 
         std::stringstream ss;
@@ -104,7 +298,8 @@ class LatencyProfilingStats {
                 ss << "\n";
         }
 
-        ss << "Range: " << lower_range << "(l), " << upper_range << "(u)\n";
+        ss << "Range: " << nanos(latencies.min()) << "(l), "
+           << nanos(latencies.max()) << "(u)\n";
         ss << "Percentiles: ";
 
         int percentiles_map_size = percentiles_values.size();
@@ -121,8 +316,12 @@ class LatencyProfilingStats {
         return ss.str();
     }
 
-    explicit LatencyProfilingStats(const std::string iden) noexcept
-        : identifier(std::move(iden)) {}
+    // precision_bits as in LatencyHistogram
+    explicit LatencyProfilingStats(
+        const std::string iden,
+        const unsigned precision_bits =
+            LatencyHistogram::default_precision_bits) noexcept
+        : latencies(precision_bits), identifier(std::move(iden)) {}
 
     LatencyProfilingStats() = delete;
     LatencyProfilingStats(const LatencyProfilingStats&) = delete;
@@ -133,20 +332,84 @@ class LatencyProfilingStats {
     ~LatencyProfilingStats() = default;
 
     inline void start() noexcept {
-        clock_gettime(CLOCK_REALTIME, &startTime);
+        start_ticks = ProfilingClock::Start();
         started_ = true;
     }
 
     inline void end() noexcept {
-        clock_gettime(CLOCK_REALTIME, &endTime);
+        const auto end_ticks = ProfilingClock::End();
         if (started_) {
-            unsigned long time_diff =
-                (endTime.tv_sec - startTime.tv_sec) * NANO_MULTIPLIER +
-                (endTime.tv_nsec - startTime.tv_nsec);
-            latencies[time_diff]++;
+            latencies.record(end_ticks - start_ticks);
         }
         started_ = false;
     }
+
+    // Adds the samples of other, e.g. the same stage measured on another
+    // thread
+    inline void merge(const LatencyProfilingStats& other) noexcept {
+        latencies.merge(other.latencies);
+    }
+
+    inline const LatencyHistogram& histogram() const noexcept {
+        return latencies;
+    }
+};
+
+// One stage measured from any number of threads
+// Every thread records into its own LatencyProfilingStats, get_the_stats
+// merges them, so recording never touches another thread's cache lines
+class LatencyStage {
+   public:
+    explicit LatencyStage(const std::string iden) noexcept
+        : identifier(std::move(iden)),
+          id(next_id.fetch_add(1, std::memory_order_relaxed)) {}
+
+    LatencyStage() = delete;
+    LatencyStage(const LatencyStage&) = delete;
+    LatencyStage(const LatencyStage&&) = delete;
+    LatencyStage operator=(const LatencyStage&) = delete;
+    LatencyStage operator=(const LatencyStage&&) = delete;
+
+    ~LatencyStage() = default;
+
+    // The calling thread's stats, created on first use and kept after the
+    // thread exits
+    inline LatencyProfilingStats& local() noexcept {
+        thread_local std::vector<LatencyProfilingStats*> instances;
+        if (id >= instances.size()) {
+            instances.resize(id + 1);
+        }
+        auto& instance = instances[id];
+        if (!instance) {
+            std::lock_guard guard(mutex);
+            per_thread.push_back(
+                std::make_unique<LatencyProfilingStats>(identifier));
+            instance = per_thread.back().get();
+        }
+        return *instance;
+    }
+
+    inline void start() noexcept { local().start(); }
+    inline void end() noexcept { local().end(); }
+
+    // Every thread so far
+    std::string get_the_stats() noexcept {
+        LatencyProfilingStats merged(identifier);
+        {
+            std::lock_guard guard(mutex);
+            for (auto& instance : per_thread) {
+                merged.merge(*instance);
+            }
+        }
+        return merged.get_the_stats();
+    }
+
+   private:
+    const std::string identifier;
+    const std::size_t id;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<LatencyProfilingStats>> per_thread;
+    static inline std::atomic<std::size_t> next_id{};
 };
 
 class LatencyProfilingHelper {
@@ -158,6 +421,8 @@ class LatencyProfilingHelper {
         : latency_reference(_latency_pointer) {
         latency_reference.start();
     }
+    explicit LatencyProfilingHelper(LatencyStage& stage)
+        : LatencyProfilingHelper(stage.local()) {}
     ~LatencyProfilingHelper() { latency_reference.end(); }
 
     LatencyProfilingHelper() = delete;
@@ -24,6 +24,8 @@ int main() {
     LatencyProfilingStats objlog("ObjLog");
     Logger::StartLogger(true, -1);
     Logger logger("LOGFILE_TESTING");
+    // Queues and mempool slots of this thread, before the measured loop
+    Logger::Warmup();
     std::signal(SIGINT, signal_handler);
     // logger.log<LoggerType1>(true, true, LOGLOCATION, 1024);
     // logger.log<LoggerType1>(true, false, LOGLOCATION, 10);
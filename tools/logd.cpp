@@ -0,0 +1,216 @@
+// Companion process for SinkType::SharedMemory
+// Attaches to the shared memory a producer created in StartLogger, formats
+// its records the way the backend thread would and writes its files
+// Keeps going when the producer crashes and exits once the producer has
+// stopped or died and everything it logged is written
+// Has to be built with the same LOGGER_TYPES_HEADER as the producer, objects
+// arrive as bytes and are printed here
+// logd [shm name] [sync|io_uring|mmap]
+#include <signal.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef LOGGER_TYPES_HEADER
+#define LOGGER_TYPES_HEADER "LoggerTypes.h"
+#endif
+#include LOGGER_TYPES_HEADER
+
+#include "FileWrapper.h"
+#include "LogDictionary.h"
+#include "ShmRing.h"
+#include "SpinLock.h"
+#include "TscClock.h"
+
+class LogDaemon {
+   public:
+    LogDaemon(ShmRegion& region_, const SinkType sink_) noexcept
+        : region(region_), header(region_.Header()), sink(sink_) {}
+
+    // Until the producer is gone and the rings are empty
+    void Run() noexcept {
+        bool finishing = false;
+        unsigned idle_passes = 0;
+        while (true) {
+            TscClock::MaybeResync(TscClock::Now());
+            ReadDictionary();
+            const auto ring_count =
+                std::min(header.ring_count.load(std::memory_order_acquire),
+                         header.max_rings);
+            while (rings.size() < ring_count) {
+                rings.push_back(region.Ring(rings.size()));
+            }
+            unsigned long processed = 0;
+            for (auto& ring : rings) {
+                while (auto record = ring.Peek()) {
+                    Render(*record);
+                    ring.Pop(record);
+                    processed++;
+                }
+            }
+            if (processed) {
+                idle_passes = 0;
+                const auto now = std::chrono::steady_clock::now();
+                for (auto& file : files) {
+                    if (file) {
+                        file->FlushIfDue(now);
+                    }
+                }
+                continue;
+            }
+            for (auto& file : files) {
+                if (file) {
+                    file->Flush();
+                }
+            }
+            // One more pass after noticing, for what was committed just
+            // before
+            if (finishing) {
+                break;
+            }
+            finishing = header.stopped.load(std::memory_order_acquire) ||
+                        (kill(header.pid, 0) != 0 && errno == ESRCH);
+            if (++idle_passes < spin_passes) {
+                CpuRelax();
+            } else {
+                std::this_thread::sleep_for(idle_sleep);
+            }
+        }
+        files.clear();
+    }
+
+    unsigned long Unrenderable() const noexcept { return unrenderable; }
+
+   private:
+    static constexpr unsigned spin_passes = 4096;
+    static constexpr auto idle_sleep = std::chrono::microseconds(200);
+
+    void ReadDictionary() noexcept {
+        region.ReadDictionary(dictionary_offset, [&](const LogDictEntry& entry,
+                                                     std::string_view text) {
+            if (dictionary.Add(entry, text) ||
+                entry.kind != LogDictKind::Logger) {
+                return;
+            }
+            FileOptions options;
+            options.buffer_size = entry.fields[0];
+            options.segment_size = entry.fields[1];
+            options.flush_interval = std::chrono::nanoseconds(entry.fields[2]);
+            options.direct_io = entry.fields[3] & 1;
+            options.compression =
+                static_cast<Compression>(entry.fields[3] >> 8 & 0xff);
+            options.compression_thread = entry.fields[3] >> 16 & 1;
+            if (entry.id >= files.size()) {
+                files.resize(entry.id + 1);
+            }
+            files[entry.id] =
+                std::make_unique<FileWrapper>(text, options, sink, header.pid);
+        });
+    }
+
+    void Render(const ShmRecord& record) noexcept {
+        // The producer may have added the entries after the read at the top
+        // of the pass, they are always written before the record
+        if (!Known(record)) {
+            ReadDictionary();
+            if (!Known(record)) {
+                unrenderable++;
+                return;
+            }
+        }
+        auto& file = *files[record.logger];
+        file.BeginMessage();
+        if (!dictionary.Render(
+                file, record.call_site, TscClock::ToEpochNanos(record.tsc),
+                Payload(record.kind), record.type, record.format,
+                reinterpret_cast<const unsigned char*>(&record + 1),
+                record.payload_size)) {
+            unrenderable++;
+        }
+    }
+
+    bool Known(const ShmRecord& record) const noexcept {
+        return record.logger < files.size() && files[record.logger] &&
+               dictionary.Knows(record.call_site, Payload(record.kind),
+                                record.format);
+    }
+
+    static inline LogPayload Payload(const ShmRecordKind kind) noexcept {
+        switch (kind) {
+            case ShmRecordKind::Object:
+                return LogPayload::Object;
+            case ShmRecordKind::Format:
+                return LogPayload::Format;
+            default:
+                return LogPayload::Text;
+        }
+    }
+
+    ShmRegion& region;
+    ShmHeader& header;
+    const SinkType sink;
+    std::vector<ShmByteRing> rings;
+    std::uint64_t dictionary_offset{};
+    LogDictionary<RegisteredLoggerTypes> dictionary;
+    std::vector<std::unique_ptr<FileWrapper>> files;
+    unsigned long unrenderable{};
+};
+
+int main(int argc, char** argv) {
+    const std::string name = argc > 1 ? argv[1] : "/logger_shm";
+    SinkType sink = SinkType::Sync;
+    if (argc > 2) {
+        const std::string sink_name = argv[2];
+        if (sink_name == "io_uring") {
+            sink = SinkType::IoUring;
+        } else if (sink_name == "mmap") {
+            sink = SinkType::Mmap;
+        } else if (sink_name != "sync") {
+            fprintf(stderr, "logd: unknown sink %s\n", argv[2]);
+            return 1;
+        }
+    }
+
+    // The producer may not have started yet
+    ShmRegion region;
+    bool waiting = false;
+    while (const int error = region.Attach(name)) {
+        if (error != ENOENT && error != EAGAIN) {
+            fprintf(stderr, "logd: %s: %s\n", name.c_str(), strerror(error));
+            return 1;
+        }
+        if (!waiting) {
+            fprintf(stderr, "logd: waiting for %s\n", name.c_str());
+            waiting = true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    const auto pid = region.Header().pid;
+    if (region.Header().type_count != RegisteredLoggerTypes::size) {
+        fprintf(stderr,
+                "logd: producer has %u logger types, logd was built with "
+                "%zu\n",
+                region.Header().type_count, RegisteredLoggerTypes::size);
+    }
+    TscClock::Calibrate();
+    auto daemon = std::make_unique<LogDaemon>(region, sink);
+    daemon->Run();
+    if (daemon->Unrenderable()) {
+        fprintf(stderr, "logd: %lu records could not be rendered\n",
+                daemon->Unrenderable());
+    }
+    region.Close();
+
+    // Only if a newer producer has not replaced it in the meantime
+    ShmRegion current;
+    if (current.Attach(name) == 0 && current.Header().pid == pid) {
+        shm_unlink(name.c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,391 @@
+// Renders files of SinkType::Binary as the text the other sinks would have
+// written, to stdout
+// Has to be built with the same LOGGER_TYPES_HEADER as the writer to print
+// objects, objects of other types are dumped as bytes
+// With a time range, segments outside of it are skipped by their Trailer
+// and reading starts at the last Index entry before the range, so only the
+// segments around the range are read, a file whose last segment has no
+// Trailer (the writer crashed) is walked from the front instead
+// Compressed files are read frame by frame, and files of the text sinks are
+// copied through as they are, so logdecode also reads compressed text logs
+// logdecode [--from time] [--to time] file...
+// time is epoch seconds or "YYYY-MM-DD HH:MM:SS" in UTC, both with an
+// optional fraction, the range includes both ends
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef LOGGER_TYPES_HEADER
+#define LOGGER_TYPES_HEADER "LoggerTypes.h"
+#endif
+#include LOGGER_TYPES_HEADER
+
+#include "BinaryLog.h"
+#include "CompressedFrames.h"
+#include "LogDictionary.h"
+
+// What LogDictionary::Render appends to, written to stdout in large pieces
+class Output {
+   public:
+    static constexpr std::size_t flush_size = 1 << 20;
+
+    ~Output() noexcept { Flush(); }
+
+    inline void Append(char data) { text.push_back(data); }
+    inline void Append(const char* data, std::size_t length) {
+        text.append(data, length);
+    }
+    inline void Append(std::string_view data) { text.append(data); }
+
+    inline void MaybeFlush() noexcept {
+        if (text.size() >= flush_size) {
+            Flush();
+        }
+    }
+
+    inline void Flush() noexcept {
+        fwrite(text.data(), 1, text.size(), stdout);
+        text.clear();
+    }
+
+   private:
+    std::string text;
+};
+
+// Records of one file read through a buffer, at any offset of its
+// uncompressed stream
+class RecordReader {
+   public:
+    static constexpr std::size_t chunk_size = 1 << 20;
+
+    explicit RecordReader(FrameReader& frames_) noexcept : frames(frames_) {}
+
+    // Payload stays valid until the next call, false at the end of the file
+    // or on a record that runs past it
+    inline bool Read(const std::uint64_t offset, BinaryRecord* record,
+                     const unsigned char** payload) {
+        if (!Fill(offset, sizeof(BinaryRecord))) {
+            return false;
+        }
+        std::memcpy(record, Data(offset), sizeof(BinaryRecord));
+        if (!Fill(offset, sizeof(BinaryRecord) + record->payload_size)) {
+            return false;
+        }
+        *payload = Data(offset) + sizeof(BinaryRecord);
+        return true;
+    }
+
+   private:
+    inline const unsigned char* Data(const std::uint64_t offset) const {
+        return buffer.data() + (offset - start);
+    }
+
+    // Makes [offset, offset + length) of the file available in buffer
+    inline bool Fill(const std::uint64_t offset, const std::size_t length) {
+        if (offset >= start && offset + length <= start + buffer.size()) {
+            return true;
+        }
+        buffer.resize(std::max(length, chunk_size));
+        buffer.resize(frames.Read(offset, buffer.data(), buffer.size()));
+        start = offset;
+        return buffer.size() >= length;
+    }
+
+    FrameReader& frames;
+    std::vector<unsigned char> buffer;
+    std::uint64_t start{};
+};
+
+class Decoder {
+   public:
+    Decoder(const std::int64_t from_, const std::int64_t to_) noexcept
+        : from(from_), to(to_) {}
+
+    bool DecodeFile(const char* path) {
+        const int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror(path);
+            return false;
+        }
+        FrameReader frames;
+        frames.Open(fd);
+        const auto size = frames.Size();
+        RecordReader reader(frames);
+        std::vector<Segment> segments;
+        if (!IsBinary(reader)) {
+            CopyText(frames, size);
+        } else if (!FindSegments(reader, size, &segments)) {
+            // No trailer to start from, every record header gets read
+            Walk(reader, 0, size);
+        } else {
+            for (const auto& segment : segments) {
+                DecodeSegment(reader, segment);
+            }
+        }
+        close(fd);
+        output.Flush();
+        return true;
+    }
+
+    unsigned long Unrenderable() const noexcept { return unrenderable; }
+
+   private:
+    struct Segment {
+        std::uint64_t offset;
+        BinaryTrailer trailer;
+    };
+
+    // Files of the binary sink start with a Segment
+    bool IsBinary(RecordReader& reader) {
+        BinaryRecord record;
+        const unsigned char* payload;
+        BinarySegmentInfo info;
+        if (!reader.Read(0, &record, &payload) ||
+            record.kind != BinaryRecordKind::Segment ||
+            record.payload_size != sizeof(info)) {
+            return false;
+        }
+        std::memcpy(&info, payload, sizeof(info));
+        return info.magic == binary_segment_magic;
+    }
+
+    // Text is not filtered by time
+    void CopyText(FrameReader& frames, const std::uint64_t size) {
+        std::vector<unsigned char> chunk(Output::flush_size);
+        for (std::uint64_t offset = 0; offset < size;) {
+            const auto got = frames.Read(offset, chunk.data(), chunk.size());
+            if (!got) {
+                break;
+            }
+            output.Append(reinterpret_cast<const char*>(chunk.data()), got);
+            output.Flush();
+            offset += got;
+        }
+    }
+
+    // Backwards from the end of the file, trailer to trailer, false when the
+    // file does not end with one
+    bool FindSegments(RecordReader& reader, std::uint64_t end,
+                      std::vector<Segment>* segments) {
+        static constexpr auto trailer_record =
+            sizeof(BinaryRecord) + sizeof(BinaryTrailer);
+        while (end) {
+            BinaryRecord record;
+            const unsigned char* payload;
+            if (end < trailer_record ||
+                !reader.Read(end - trailer_record, &record, &payload) ||
+                record.kind != BinaryRecordKind::Trailer ||
+                record.payload_size != sizeof(BinaryTrailer)) {
+                return false;
+            }
+            Segment segment;
+            std::memcpy(&segment.trailer, payload, sizeof(BinaryTrailer));
+            const auto& trailer = segment.trailer;
+            if (trailer.magic != binary_trailer_magic ||
+                trailer.segment_offset >= end ||
+                trailer.index_offset >= end ||
+                trailer.dictionary_offset >= end) {
+                return false;
+            }
+            segment.offset = trailer.segment_offset;
+            segments->insert(segments->begin(), segment);
+            end = trailer.segment_offset;
+        }
+        return true;
+    }
+
+    void DecodeSegment(RecordReader& reader, const Segment& segment) {
+        const auto& trailer = segment.trailer;
+        if (!trailer.messages || trailer.last_ns < from ||
+            trailer.first_ns > to) {
+            return;
+        }
+        auto start = segment.offset;
+        BinaryRecord record;
+        const unsigned char* payload;
+        if (from != std::numeric_limits<std::int64_t>::min() &&
+            reader.Read(trailer.index_offset, &record, &payload) &&
+            record.kind == BinaryRecordKind::Index) {
+            // The entries before the start are skipped along with their
+            // records, the Dictionary has them all
+            const auto count = record.payload_size / sizeof(BinaryIndexEntry);
+            for (std::size_t i = 0; i < count; i++) {
+                BinaryIndexEntry entry;
+                std::memcpy(&entry, payload + i * sizeof(entry),
+                            sizeof(entry));
+                if (entry.time_ns >= from) {
+                    break;
+                }
+                start = entry.offset;
+            }
+            if (start != segment.offset &&
+                reader.Read(trailer.dictionary_offset, &record, &payload) &&
+                record.kind == BinaryRecordKind::Dictionary) {
+                ForEachLogDictEntry(payload, record.payload_size,
+                                    [&](const LogDictEntry& entry,
+                                        std::string_view text) {
+                                        dictionary.Add(entry, text);
+                                    });
+            }
+        }
+        Walk(reader, start, trailer.index_offset);
+    }
+
+    // Renders the messages in [offset, end)
+    void Walk(RecordReader& reader, std::uint64_t offset,
+              const std::uint64_t end) {
+        BinaryRecord record;
+        const unsigned char* payload;
+        while (offset < end && reader.Read(offset, &record, &payload)) {
+            offset += sizeof(BinaryRecord) + record.payload_size;
+            switch (record.kind) {
+                case BinaryRecordKind::Segment:
+                    anchor_tsc = 0;
+                    anchor_ns = 0;
+                    nanos_per_tick = 1.0;
+                    break;
+                case BinaryRecordKind::Sync: {
+                    BinarySync sync;
+                    if (record.payload_size != sizeof(sync)) {
+                        break;
+                    }
+                    std::memcpy(&sync, payload, sizeof(sync));
+                    anchor_tsc = record.tsc;
+                    anchor_ns = sync.anchor_ns;
+                    nanos_per_tick = sync.nanos_per_tick;
+                    break;
+                }
+                case BinaryRecordKind::DictEntry:
+                    ForEachLogDictEntry(payload, record.payload_size,
+                                        [&](const LogDictEntry& entry,
+                                            std::string_view text) {
+                                            dictionary.Add(entry, text);
+                                        });
+                    break;
+                case BinaryRecordKind::Object:
+                    Render(record, LogPayload::Object, payload);
+                    break;
+                case BinaryRecordKind::Format:
+                    Render(record, LogPayload::Format, payload);
+                    break;
+                case BinaryRecordKind::Text:
+                    Render(record, LogPayload::Text, payload);
+                    break;
+                case BinaryRecordKind::Index:
+                case BinaryRecordKind::Dictionary:
+                case BinaryRecordKind::Trailer:
+                    break;
+                default:
+                    fprintf(stderr,
+                            "logdecode: unknown record kind %u, skipping the "
+                            "rest\n",
+                            static_cast<unsigned>(record.kind));
+                    return;
+            }
+        }
+    }
+
+    void Render(const BinaryRecord& record, const LogPayload kind,
+                const unsigned char* payload) {
+        const auto ticks = static_cast<std::int64_t>(record.tsc - anchor_tsc);
+        const auto time_ns =
+            anchor_ns + static_cast<std::int64_t>(ticks * nanos_per_tick);
+        if (time_ns < from || time_ns > to) {
+            return;
+        }
+        if (!dictionary.Render(output, record.call_site, time_ns, kind,
+                               record.type, record.format, payload,
+                               record.payload_size)) {
+            unrenderable++;
+        }
+        output.MaybeFlush();
+    }
+
+    const std::int64_t from;
+    const std::int64_t to;
+    LogDictionary<RegisteredLoggerTypes> dictionary;
+    Output output;
+    std::uint64_t anchor_tsc{};
+    std::int64_t anchor_ns{};
+    double nanos_per_tick = 1.0;
+    unsigned long unrenderable{};
+};
+
+// Epoch nanoseconds of "1760774400.25" or "2025-10-18 08:00:00.25"
+static bool ParseTime(const char* text, std::int64_t* epoch_ns) {
+    std::int64_t seconds;
+    const char* fraction;
+    tm parts{};
+    if (const char* rest = strptime(text, "%Y-%m-%d %H:%M:%S", &parts)) {
+        seconds = timegm(&parts);
+        fraction = rest;
+    } else {
+        char* end;
+        seconds = std::strtoll(text, &end, 10);
+        if (end == text) {
+            return false;
+        }
+        fraction = end;
+    }
+    std::int64_t nanos = 0;
+    if (*fraction == '.') {
+        fraction++;
+        for (int digit = 0; digit < 9; digit++) {
+            nanos *= 10;
+            if (*fraction >= '0' && *fraction <= '9') {
+                nanos += *fraction++ - '0';
+            }
+        }
+        while (*fraction >= '0' && *fraction <= '9') {
+            fraction++;
+        }
+    }
+    if (*fraction) {
+        return false;
+    }
+    *epoch_ns = seconds * 1000000000 + nanos;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    auto from = std::numeric_limits<std::int64_t>::min();
+    auto to = std::numeric_limits<std::int64_t>::max();
+    std::vector<const char*> files;
+    for (int i = 1; i < argc; i++) {
+        const std::string_view arg = argv[i];
+        if ((arg == "--from" || arg == "--to") && i + 1 < argc) {
+            if (!ParseTime(argv[++i], arg == "--from" ? &from : &to)) {
+                fprintf(stderr, "logdecode: can not read time %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+    if (files.empty()) {
+        fprintf(stderr, "usage: %s [--from time] [--to time] file...\n",
+                argv[0]);
+        return 1;
+    }
+
+    auto decoder = std::make_unique<Decoder>(from, to);
+    bool failed = false;
+    for (const auto file : files) {
+        failed |= !decoder->DecodeFile(file);
+    }
+    if (decoder->Unrenderable()) {
+        fprintf(stderr, "logdecode: %lu records could not be rendered\n",
+                decoder->Unrenderable());
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,59 @@
+// Polls the stats a process publishes with LoggerOptions::stats_shm_name
+// One line per poll, key=value pairs, rates are over the last interval
+// logstat <shm name> [interval ms] [polls, 0 for forever]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include "LoggerStats.h"
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <shm name> [interval ms] [polls]\n",
+                argv[0]);
+        return 1;
+    }
+    const auto interval =
+        std::chrono::milliseconds(argc > 2 ? std::atoi(argv[2]) : 1000);
+    const long polls = argc > 3 ? std::atol(argv[3]) : 0;
+
+    SharedStats shared;
+    if (const int error = shared.Attach(argv[1])) {
+        fprintf(stderr, "logstat: %s: %s\n", argv[1], strerror(error));
+        return 1;
+    }
+    LoggerStats previous{};
+    bool have_previous = false;
+    for (long i = 0; !polls || i < polls; i++) {
+        LoggerStats stats;
+        if (!shared.Read(&stats)) {
+            std::this_thread::sleep_for(interval);
+            continue;
+        }
+        double messages_per_sec = 0, bytes_per_sec = 0;
+        if (have_previous && stats.time_ns > previous.time_ns) {
+            const double seconds = (stats.time_ns - previous.time_ns) / 1e9;
+            messages_per_sec =
+                (stats.messages_written - previous.messages_written) / seconds;
+            bytes_per_sec =
+                (stats.bytes_written - previous.bytes_written) / seconds;
+        }
+        printf(
+            "messages=%lu bytes=%lu dropped=%lu msgs_per_sec=%.0f "
+            "bytes_per_sec=%.0f queue_depth=%lu queue_capacity=%lu "
+            "pool_in_use=%lu pool_slots=%lu rotations=%lu "
+            "backend_lag_ns=%lu max_backend_lag_ns=%lu workers=%lu\n",
+            stats.messages_written, stats.bytes_written,
+            stats.messages_dropped, messages_per_sec, bytes_per_sec,
+            stats.queue_depth, stats.queue_capacity, stats.pool_in_use,
+            stats.pool_slots, stats.rotations, stats.backend_lag_ns,
+            stats.max_backend_lag_ns, stats.workers);
+        fflush(stdout);
+        previous = stats;
+        have_previous = true;
+        std::this_thread::sleep_for(interval);
+    }
+    return 0;
+}